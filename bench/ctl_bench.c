@@ -0,0 +1,363 @@
+/* -*- mode: C -*-
+   *
+   *       File:         ctl_bench.c
+   *
+   *       Generador de carga para el socket de control de shFSO.
+   *
+   *       Uso: ctl_bench [-S shell] [-c conexiones] [-b lote]
+   *                      [-n trabajos]
+   *
+   *       Arranca el shell bajo un pseudo-terminal con -s y reparte n
+   *       envíos de "true" (por omisión 20000) entre c procesos
+   *       cliente, cada uno con su propia conexión. Cada cliente
+   *       envía lotes de b tramas 'S' seguidas, espera las b
+   *       respuestas y, para cada trabajo, espera a que termine con
+   *       un pidfd propio (si ya no existe, terminó antes de la
+   *       respuesta). Muestra:
+   *
+   *         envíos/s  trabajos lanzados por segundo, en total
+   *         rtt       desde que se envía un lote hasta que llega la
+   *                   última respuesta
+   *         latencia  desde que se envía un trabajo hasta que termina
+   *
+   *       Al final comprueba con "wait ; jobs" que la lista quedó
+   *       vacía.
+   *
+   */
+
+/*
+  Copyright (C) 2009, 2013 Pedro J. Ruiz López <holzplatten@es.gnu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+
+#include "pty.h"
+
+#define TIMEOUT 60000   /* ms */
+#define JOB "true"
+
+/*-
+  *      Routine:      full_io
+  *
+  *      Purpose:
+  *              Lee o escribe exactamente 'len' bytes.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              0 si se completó, -1 e.o.c.
+  *
+  */
+int full_io(int fd, void *buf, size_t len, int wr)
+{
+  char *p = buf;
+  ssize_t n;
+
+  while (len > 0)
+    {
+      n = wr ? write(fd, p, len) : read(fd, p, len);
+      if (n == -1 && errno == EINTR)
+	continue;
+      if (n <= 0)
+	return -1;
+      p += n;
+      len -= n;
+    }
+
+  return 0;
+}
+
+/*-
+  *      Routine:      client
+  *
+  *      Purpose:
+  *              Envía 'n' trabajos en lotes de 'batch' por una nueva
+  *              conexión a 'sock' y escribe en 'out' los tiempos
+  *              medidos: el número de lotes, el de trabajos, los rtt
+  *              y las latencias (en ns, u64).
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              no retorna
+  *
+  */
+void client(char *sock, int n, int batch, int out)
+{
+  struct sockaddr_un sa;
+  struct pollfd *pfd;
+  char *req, *rep, *p;
+  uint64_t *rtt, *lat, t0, *end;
+  uint32_t len = strlen(JOB), hdr;
+  int fd, i, k, b, nb = 0, nl = 0, left, pid;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  strncpy(sa.sun_path, sock, sizeof(sa.sun_path) - 1);
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (connect(fd, (struct sockaddr *) &sa, sizeof(sa)))
+    {
+      perror(sock);
+      _exit(1);
+    }
+
+  /* Un lote es siempre el mismo: b tramas 'S' con JOB. */
+  req = malloc(batch * (5 + len));
+  for (i = 0, p = req; i < batch; i++, p += 5 + len)
+    {
+      memcpy(p, &len, 4);
+      p[4] = 'S';
+      memcpy(p + 5, JOB, len);
+    }
+  rep = malloc(batch * 13);
+  pfd = malloc(batch * sizeof(*pfd));
+  end = malloc(batch * sizeof(*end));
+  rtt = malloc((n / batch + 1) * sizeof(*rtt));
+  lat = malloc(n * sizeof(*lat));
+
+  for (i = 0; i < n; i += b)
+    {
+      b = n - i < batch ? n - i : batch;
+
+      t0 = now_ns();
+      if (full_io(fd, req, b * (5 + len), 1))
+	_exit(1);
+      for (k = 0; k < b; k++)
+	{
+	  /* Sólo se esperan respuestas 'S': 4 + 1 + 8 bytes. */
+	  if (full_io(fd, rep + 13 * k, 13, 0))
+	    _exit(1);
+	  memcpy(&hdr, rep + 13 * k, 4);
+	  if (hdr != 8 || rep[13 * k + 4] != 'S')
+	    {
+	      fprintf(stderr, "ctl_bench: respuesta inesperada '%c'\n",
+		      rep[13 * k + 4]);
+	      _exit(1);
+	    }
+	}
+      rtt[nb++] = now_ns() - t0;
+
+      /* Esperar a que terminen todos los trabajos del lote. */
+      for (k = 0, left = 0; k < b; k++)
+	{
+	  memcpy(&pid, rep + 13 * k + 5, 4);
+	  pfd[k].fd = syscall(SYS_pidfd_open, pid, 0);
+	  pfd[k].events = POLLIN;
+	  end[k] = 0;
+	  if (pfd[k].fd == -1)
+	    end[k] = now_ns();    /* ya terminó (ESRCH) */
+	  else
+	    left++;
+	}
+      while (left > 0)
+	{
+	  if (poll(pfd, b, TIMEOUT) <= 0)
+	    _exit(1);
+	  for (k = 0; k < b; k++)
+	    if (pfd[k].fd != -1 && pfd[k].revents)
+	      {
+		end[k] = now_ns();
+		close(pfd[k].fd);
+		pfd[k].fd = -1;
+		left--;
+	      }
+	}
+      for (k = 0; k < b; k++)
+	lat[nl++] = end[k] - t0;
+    }
+
+  if (full_io(out, &nb, sizeof(nb), 1) || full_io(out, &nl, sizeof(nl), 1)
+      || full_io(out, rtt, nb * sizeof(*rtt), 1)
+      || full_io(out, lat, nl * sizeof(*lat), 1))
+    _exit(1);
+
+  _exit(0);
+}
+
+/*-
+  *      Routine:      cmp_u64
+  *
+  *      Purpose:
+  *              Comparación para qsort.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              <0, 0 o >0.
+  *
+  */
+int cmp_u64(const void *a, const void *b)
+{
+  uint64_t x = *(uint64_t *) a, y = *(uint64_t *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+/*-
+  *      Routine:      report
+  *
+  *      Purpose:
+  *              Muestra mediana, p99 y máximo de 'n' tiempos.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              none
+  *
+  */
+void report(char *what, uint64_t *v, int n)
+{
+  if (n == 0)
+    return;
+  qsort(v, n, sizeof(*v), cmp_u64);
+  printf("   %-9s p50 %9.1f us   p99 %9.1f us   max %9.1f us\n", what,
+	 v[n / 2] / 1e3, v[(int) (n * 0.99)] / 1e3, v[n - 1] / 1e3);
+}
+
+int main(int argc, char *argv[])
+{
+  char *shell = "./shFSO", *sh_argv[4];
+  char dir[] = "/tmp/shfso_ctl.XXXXXX";
+  char path[PATH_MAX], sock[PATH_MAX + 16], env_home[PATH_MAX + 8];
+  char *env[3] = { "PATH=/usr/bin:/bin", env_home, NULL };
+  int conns = 4, batch = 64, njobs = 20000, opt, i, n, ok = 0, running;
+  int *pipes, *pids, nr = 0, nl = 0, st;
+  uint64_t *rtt, *lat, t0, t = 0;
+  pty_t *pt = NULL;
+
+  while ((opt = getopt(argc, argv, "S:c:b:n:")) != -1)
+    switch (opt)
+      {
+      case 'S': shell = optarg; break;
+      case 'c': conns = atoi(optarg); break;
+      case 'b': batch = atoi(optarg); break;
+      case 'n': njobs = atoi(optarg); break;
+      default:
+	fprintf(stderr, "Uso: %s [-S shell] [-c conexiones] [-b lote] "
+		"[-n trabajos]\n", argv[0]);
+	return 2;
+      }
+
+  if (conns < 1 || batch < 1 || njobs < conns || !mkdtemp(dir)
+      || !realpath(shell, path))
+    {
+      fprintf(stderr, "ctl_bench: parámetros no válidos\n");
+      return 1;
+    }
+  snprintf(sock, sizeof(sock), "%s/ctl", dir);
+  snprintf(env_home, sizeof(env_home), "HOME=%s", dir);
+  sh_argv[0] = path;
+  sh_argv[1] = "-s";
+  sh_argv[2] = sock;
+  sh_argv[3] = NULL;
+
+  pipes = malloc(conns * sizeof(*pipes));
+  pids = malloc(conns * sizeof(*pids));
+  rtt = malloc((njobs / batch + conns) * sizeof(*rtt));
+  lat = malloc(njobs * sizeof(*lat));
+
+  if (!(pt = pty_spawn(sh_argv, env)) || pty_prompt(pt, TIMEOUT))
+    {
+      fprintf(stderr, "ctl_bench: el shell no arranca\n");
+      goto out;
+    }
+
+  t0 = now_ns();
+  for (i = 0; i < conns; i++)
+    {
+      int fds[2];
+
+      pipe(fds);
+      n = njobs / conns + (i < njobs % conns);
+      if ((pids[i] = fork()) == 0)
+	{
+	  close(fds[0]);
+	  client(sock, n, batch, fds[1]);
+	}
+      close(fds[1]);
+      pipes[i] = fds[0];
+    }
+
+  /* El shell redibuja la línea al recoger hijos: hay que vaciar el
+     terminal mientras tanto para que no se bloquee escribiendo. */
+  for (running = conns; running > 0; )
+    {
+      pty_expect(pt, "\001", 20);
+      pty_mark(pt);
+      while (waitpid(-1, &st, WNOHANG) > 0)
+	{
+	  running--;
+	  if (!WIFEXITED(st) || WEXITSTATUS(st))
+	    {
+	      fprintf(stderr, "ctl_bench: un cliente falló\n");
+	      goto out;
+	    }
+	  t = now_ns() - t0;
+	}
+    }
+
+  for (i = 0; i < conns; i++)
+    {
+      int cr, cl;
+
+      if (full_io(pipes[i], &cr, sizeof(cr), 0)
+	  || full_io(pipes[i], &cl, sizeof(cl), 0)
+	  || full_io(pipes[i], rtt + nr, cr * sizeof(*rtt), 0)
+	  || full_io(pipes[i], lat + nl, cl * sizeof(*lat), 0))
+	goto out;
+      nr += cr;
+      nl += cl;
+      close(pipes[i]);
+    }
+
+  pty_send(pt, "\rwait ; jobs\r");
+  if (pty_expect(pt, "vacía", TIMEOUT))
+    goto out;
+  ok = 1;
+
+ out:
+  if (pt)
+    {
+      pty_send(pt, "logout\r");
+      pty_close(pt, 5000);
+    }
+  unlink(sock);
+  rmdir(dir);
+
+  if (!ok)
+    {
+      fprintf(stderr, "ctl_bench: el shell no completó la prueba\n");
+      return 1;
+    }
+
+  printf(" %d trabajos, %d conexiones, lotes de %d, %ld CPUs\n",
+	 njobs, conns, batch, sysconf(_SC_NPROCESSORS_ONLN));
+  printf("   envíos/s  %9.0f   (%.3f s)\n", njobs / (t / 1e9), t / 1e9);
+  report("rtt", rtt, nr);
+  report("latencia", lat, nl);
+
+  return 0;
+}
@@ -0,0 +1,193 @@
+/* -*- mode: C -*-
+   *
+   *       File:         glob_bench.c
+   *
+   *       Benchmark de la expansión de comodines de shFSO sobre
+   *       un directorio con muchas entradas (1M por defecto).
+   *
+   *       Uso: glob_bench [-n entradas] [-d directorio] [-r repeticiones]
+   *
+   *       Compara el coste de expandir un patrón leyendo el
+   *       directorio, el de varios patrones sobre el mismo
+   *       directorio en una misma línea (una sola lectura gracias
+   *       a la caché) y, como referencia, glob(3).
+   *
+   */
+
+/*
+  Copyright (C) 2009, 2013 Pedro J. Ruiz López <holzplatten@es.gnu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Se compila junto con el shell para medir exactamente su código. */
+#define main shfso_main
+#include "../shFSO.c"
+#undef main
+
+#include <glob.h>
+#include <time.h>
+
+#define NPAT 8
+
+double now_ms()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/*-
+  *      Routine:      populate
+  *
+  *      Purpose:
+  *              Crea 'n' ficheros vacíos f0000000, f0000001, ...
+  *              en 'dir', salvo que ya estén creados.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              none
+  *
+  */
+void populate(char *dir, int n)
+{
+  char name[32];
+  int dfd, fd, i;
+  double t;
+
+  mkdir(dir, 0700);
+  dfd = open(dir, O_RDONLY|O_DIRECTORY);
+  if (dfd == -1)
+    {
+      perror(dir);
+      exit(1);
+    }
+
+  snprintf(name, sizeof(name), "f%07d", n-1);
+  if (faccessat(dfd, name, F_OK, 0) == 0)
+    {
+      close(dfd);
+      return;
+    }
+
+  printf("Creando %d entradas en %s...\n", n, dir);
+  t = now_ms();
+  for (i = 0; i < n; i++)
+    {
+      snprintf(name, sizeof(name), "f%07d", i);
+      fd = openat(dfd, name, O_WRONLY|O_CREAT, 0600);
+      if (fd == -1)
+	{
+	  perror(name);
+	  exit(1);
+	}
+      close(fd);
+    }
+  printf("  %.0f ms\n", now_ms() - t);
+  close(dfd);
+}
+
+/*-
+  *      Routine:      run_line
+  *
+  *      Purpose:
+  *              Trocea y expande una línea como lo hace el bucle
+  *              principal del shell.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              El número de argumentos resultante.
+  *
+  */
+int run_line(char *line, int flush)
+{
+  char buf[MAXLINEA], *argv[MAXARG];
+  int n;
+
+  snprintf(buf, sizeof(buf), "%s", line);
+  n = lee_linea(buf, argv);
+  libera_mem_arg(argv, n);
+  if (flush)
+    glob_flush();
+
+  return n;
+}
+
+int main(int argc, char *argv[])
+{
+  char *dir = "/tmp/shfso_glob_bench";
+  char pat[PATH_MAX], line[MAXLINEA];
+  int n = 1000000, reps = 5, opt, i, r, nargs = 0;
+  double t, t_one, t_line, t_nocache, t_glob;
+  glob_t g;
+
+  while ((opt = getopt(argc, argv, "n:d:r:")) != -1)
+    switch (opt)
+      {
+      case 'n': n = atoi(optarg); break;
+      case 'd': dir = optarg; break;
+      case 'r': reps = atoi(optarg); break;
+      default:
+	fprintf(stderr, "Uso: %s [-n entradas] [-d dir] [-r reps]\n", argv[0]);
+	exit(2);
+      }
+
+  populate(dir, n);
+
+  /* Un patrón: una lectura del directorio. */
+  snprintf(pat, sizeof(pat), "%s/f%06d*", dir, (n/2) / 10);
+  t = now_ms();
+  for (r = 0; r < reps; r++)
+    nargs = run_line(pat, 1);
+  t_one = (now_ms() - t) / reps;
+
+  /* NPAT patrones sobre el mismo directorio en una línea. */
+  line[0] = '\0';
+  for (i = 0; i < NPAT; i++)
+    snprintf(line + strlen(line), sizeof(line) - strlen(line),
+	     "%s/f%06d* ", dir, (n/NPAT * i) / 10);
+  t = now_ms();
+  for (r = 0; r < reps; r++)
+    run_line(line, 1);
+  t_line = (now_ms() - t) / reps;
+
+  /* Lo mismo vaciando la caché entre patrón y patrón. */
+  t = now_ms();
+  for (r = 0; r < reps; r++)
+    for (i = 0; i < NPAT; i++)
+      {
+	snprintf(pat, sizeof(pat), "%s/f%06d*", dir, (n/NPAT * i) / 10);
+	run_line(pat, 1);
+      }
+  t_nocache = (now_ms() - t) / reps;
+
+  /* Referencia: glob(3). */
+  snprintf(pat, sizeof(pat), "%s/f%06d*", dir, (n/2) / 10);
+  t = now_ms();
+  for (r = 0; r < reps; r++)
+    {
+      glob(pat, 0, NULL, &g);
+      globfree(&g);
+    }
+  t_glob = (now_ms() - t) / reps;
+
+  printf("Directorio: %s (%d entradas), %d repeticiones\n", dir, n, reps);
+  printf("  1 patrón (%d argumentos)        : %9.2f ms\n", nargs, t_one);
+  printf("  %d patrones, una línea (caché)   : %9.2f ms\n", NPAT, t_line);
+  printf("  %d patrones, sin caché           : %9.2f ms\n", NPAT, t_nocache);
+  printf("  glob(3), 1 patrón               : %9.2f ms\n", t_glob);
+
+  return 0;
+}
@@ -0,0 +1,294 @@
+/* -*- mode: C -*-
+   *
+   *       File:         jobctl_bench.c
+   *
+   *       Benchmark del control de trabajos de shFSO bajo un
+   *       pseudo-terminal.
+   *
+   *       Uso: jobctl_bench [-S shell] [-n n1,n2,...] [-c ciclos]
+   *                         [-t p99_ms]
+   *
+   *       Para cada número de trabajos n se lanzan n-1 trabajos en
+   *       segundo plano y uno en primer plano, y se repiten ciclos
+   *       Ctrl-Z / fg / bg sobre este último midiendo:
+   *
+   *         stop  desde la pulsación de Ctrl-Z hasta que el shell
+   *               informa de que el trabajo está PARADO
+   *         fg    desde que se teclea "fg n" hasta que el trabajo
+   *               recibe SIGCONT
+   *         bg    lo mismo con "bg n"
+   *
+   *       Termina con error si, para algún n, el p99 de alguna
+   *       medida supera el umbral (-t, en milisegundos; 50 por
+   *       omisión). Por omisión se hacen 500 ciclos, así que el p99
+   *       no es la peor medida sino la quinta peor: un solo
+   *       retraso del planificador no basta para fallar.
+   *
+   *       Los trabajos son este mismo programa invocado como
+   *       'jcstub': espera señales y escribe "@CONT@" en el terminal
+   *       cada vez que recibe SIGCONT.
+   *
+   */
+
+/*
+  Copyright (C) 2009, 2013 Pedro J. Ruiz López <holzplatten@es.gnu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/prctl.h>
+
+#include "pty.h"
+
+#define MARK "@CONT@"
+#define TIMEOUT 10000   /* ms */
+
+static char *names[3] = { "stop", "fg", "bg" };
+
+static void on_cont(int sig)
+{
+  write(STDOUT_FILENO, MARK "\n", sizeof(MARK));
+}
+
+/*-
+  *      Routine:      stub
+  *
+  *      Purpose:
+  *              Trabajo de prueba: no hace nada salvo anunciar cada
+  *              SIGCONT. Muere con el shell que lo lanzó.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              no retorna
+  *
+  */
+void stub()
+{
+  prctl(PR_SET_PDEATHSIG, SIGKILL);
+  if (getppid() == 1)
+    exit(0);
+  signal(SIGCONT, on_cont);
+  for (;;)
+    pause();
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+  uint64_t x = *(uint64_t *) a, y = *(uint64_t *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+/*-
+  *      Routine:      report
+  *
+  *      Purpose:
+  *              Muestra p50, p99 y máximo de una serie de medidas.
+  *      Conditions:
+  *              n > 0
+  *      Returns:
+  *              El p99 en nanosegundos.
+  *
+  */
+uint64_t report(char *name, uint64_t *v, int n)
+{
+  uint64_t p99;
+
+  qsort(v, n, sizeof(*v), cmp_u64);
+  p99 = v[(n*99)/100 < n ? (n*99)/100 : n-1];
+  printf("   %-5s p50 %9.1f us   p99 %9.1f us   max %9.1f us\n",
+	 name, v[n/2] / 1e3, p99 / 1e3, v[n-1] / 1e3);
+
+  return p99;
+}
+
+/*-
+  *      Routine:      run
+  *
+  *      Purpose:
+  *              Ejecuta el benchmark con 'njobs' trabajos y deja en
+  *              'p99' el percentil 99 (ns) de cada medida (ver
+  *              names).
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              1 si se completó, 0 si hubo un error.
+  *
+  */
+int run(char *shell, char *dir, int njobs, int cycles, uint64_t *p99)
+{
+  char env_path[PATH_MAX + 8], env_home[PATH_MAX + 8], cmd[64];
+  char *env[3], *argv[2];
+  uint64_t *stop, *fg, *bg, t;
+  int i, ok = 0;
+  pty_t *pt;
+
+  snprintf(env_path, sizeof(env_path), "PATH=%s", dir);
+  snprintf(env_home, sizeof(env_home), "HOME=%s", dir);
+  env[0] = env_path;
+  env[1] = env_home;
+  env[2] = NULL;
+  argv[0] = shell;
+  argv[1] = NULL;
+
+  stop = calloc(cycles + 1, sizeof(*stop));
+  fg = calloc(cycles, sizeof(*fg));
+  bg = calloc(cycles, sizeof(*bg));
+
+  if (!(pt = pty_spawn(argv, env)) || pty_prompt(pt, TIMEOUT))
+    {
+      fprintf(stderr, "jobctl_bench: el shell no arranca\n");
+      return 0;
+    }
+
+  for (i = 1; i < njobs; i++)
+    {
+      pty_send(pt, "jcstub &\r");
+      if (pty_prompt(pt, TIMEOUT))
+	goto out;
+    }
+
+  /* Primer plano y primera parada. */
+  pty_send(pt, "jcstub\r");
+  usleep(50000);
+  pty_mark(pt);
+  t = now_ns();
+  pty_send(pt, "\032");
+  if (pty_expect(pt, "PARADO", TIMEOUT))
+    goto out;
+  stop[0] = now_ns() - t;
+  if (pty_expect(pt, "> ", TIMEOUT))
+    goto out;
+
+  snprintf(cmd, sizeof(cmd), "fg %d\r", njobs);
+  for (i = 0; i < cycles; i++)
+    {
+      pty_mark(pt);
+      t = now_ns();
+      pty_send(pt, cmd);
+      if (pty_expect(pt, MARK, TIMEOUT))
+	goto out;
+      fg[i] = now_ns() - t;
+
+      pty_mark(pt);
+      t = now_ns();
+      pty_send(pt, "\032");
+      if (pty_expect(pt, "PARADO", TIMEOUT))
+	goto out;
+      stop[i+1] = now_ns() - t;
+      if (pty_expect(pt, "> ", TIMEOUT))
+	goto out;
+
+      pty_mark(pt);
+      cmd[0] = 'b';
+      t = now_ns();
+      pty_send(pt, cmd);
+      if (pty_expect(pt, MARK, TIMEOUT))
+	goto out;
+      bg[i] = now_ns() - t;
+      if (pty_expect(pt, "> ", TIMEOUT))
+	goto out;
+      cmd[0] = 'f';
+    }
+  ok = 1;
+
+ out:
+  if (!ok)
+    fprintf(stderr, "jobctl_bench: sin respuesta del shell con %d trabajos\n",
+	    njobs);
+  else
+    {
+      printf(" %d trabajos, %d ciclos\n", njobs, cycles);
+      p99[0] = report(names[0], stop, cycles + 1);
+      p99[1] = report(names[1], fg, cycles);
+      p99[2] = report(names[2], bg, cycles);
+    }
+
+  pty_send(pt, "logout\r");
+  pty_close(pt, 5000);
+  free(stop);
+  free(fg);
+  free(bg);
+
+  return ok;
+}
+
+int main(int argc, char *argv[])
+{
+  char *shell = "./shFSO", *counts = NULL, *c, *base;
+  char dir[] = "/tmp/shfso_jobctl.XXXXXX";
+  char self[PATH_MAX], path[PATH_MAX + 16];
+  int cycles = 500, opt, fail = 0, k;
+  double thresh = 50;
+  uint64_t p99[3];
+
+  base = strrchr(argv[0], '/') ? strrchr(argv[0], '/') + 1 : argv[0];
+  if (strcmp(base, "jcstub") == 0)
+    stub();
+
+  while ((opt = getopt(argc, argv, "S:n:c:t:")) != -1)
+    switch (opt)
+      {
+      case 'S': shell = optarg; break;
+      case 'n': counts = strdup(optarg); break;
+      case 'c': cycles = atoi(optarg); break;
+      case 't': thresh = atof(optarg); break;
+      default:
+	fprintf(stderr, "Uso: %s [-S shell] [-n n1,n2,...] [-c ciclos] "
+		"[-t p99_ms]\n", argv[0]);
+	return 2;
+      }
+
+  if (!mkdtemp(dir) || !realpath("/proc/self/exe", self)
+      || !realpath(shell, path))
+    {
+      perror("jobctl_bench");
+      return 1;
+    }
+  shell = strdup(path);
+  if (!counts)
+    counts = strdup("1,10,100,1000,10000");
+  snprintf(path, sizeof(path), "%s/jcstub", dir);
+  symlink(self, path);
+
+  for (c = strtok(counts, ","); c; c = strtok(NULL, ","))
+    {
+      if (!run(shell, dir, atoi(c), cycles, p99))
+	{
+	  fail = 1;
+	  continue;
+	}
+      for (k = 0; k < 3; k++)
+	if (p99[k] > thresh * 1e6)
+	  {
+	    printf("   REGRESIÓN: %s p99 %.1f ms > %.1f ms\n", names[k],
+		   p99[k] / 1e6, thresh);
+	    fail = 1;
+	  }
+    }
+
+  unlink(path);
+  rmdir(dir);
+
+  return fail;
+}
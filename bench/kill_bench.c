@@ -0,0 +1,395 @@
+/* -*- mode: C -*-
+   *
+   *       File:         kill_bench.c
+   *
+   *       Benchmark de 'kill' sobre muchos trabajos bajo un
+   *       pseudo-terminal.
+   *
+   *       Uso: kill_bench [-S shell] [-n trabajos] [-s señal] [-t ms]
+   *            kill_bench -L [-S shell] [-n trabajos] [-H] [-t ms]
+   *
+   *       Lanza n trabajos en segundo plano (por omisión 10000) y
+   *       mide:
+   *
+   *         kill  lo que tarda el comando interno "kill %1-%n" en
+   *               señalar todos los grupos (fase 'builtin' de
+   *               'stats')
+   *         total desde que se teclea la orden hasta que el shell
+   *               vuelve a mostrar el prompt, tras recoger e
+   *               informar de todos los trabajos
+   *
+   *       Al final comprueba con "wait ; jobs" que la lista quedó
+   *       vacía. Con -s se envía antes la señal indicada (p.ej. CONT,
+   *       que no despierta a nadie) para medir sólo el coste del
+   *       shell; la medida final es siempre con TERM.
+   *
+   *       Termina con error si 'kill' supera el umbral (-t, en
+   *       milisegundos): el de la señal de -s si se indicó, el de
+   *       TERM si no. Con TERM el tiempo incluye la salida de los
+   *       propios trabajos, que en una máquina con pocos núcleos
+   *       desalojan al shell en cuanto reciben la señal.
+   *
+   *       Con -L no se usa 'kill': se mide lo que tarda "logout"
+   *       en terminar todos los trabajos, desde que se teclea hasta
+   *       que el shell se despide, y el umbral se aplica a eso. Con
+   *       -H los trabajos ignoran SIGHUP, así que el shell tiene que
+   *       agotar el plazo de gracia y recurrir a SIGKILL.
+   *
+   *       Sin -H se mide antes lo mismo sin shell ('núcleo'): el
+   *       programa lanza los n trabajos, les envía SIGHUP y los
+   *       recoge. Es lo que cuesta al núcleo terminar tantos
+   *       procesos. Sólo es informativo: el umbral se aplica igual,
+   *       y si el núcleo solo ya lo supera se avisa de que en esta
+   *       máquina no se puede cumplir.
+   *
+   *       Los trabajos son este mismo programa invocado como
+   *       'kstub', que sólo espera señales.
+   *
+   */
+
+/*
+  Copyright (C) 2009, 2013 Pedro J. Ruiz López <holzplatten@es.gnu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+
+#include "pty.h"
+
+#define TIMEOUT 60000   /* ms */
+#define PER_LINE 64     /* trabajos lanzados por línea */
+#define NOHUP_ENV "KSTUB_NOHUP"
+
+/*-
+  *      Routine:      stub
+  *
+  *      Purpose:
+  *              Trabajo de prueba: espera señales. Muere con el
+  *              shell que lo lanzó.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              no retorna
+  *
+  */
+void stub()
+{
+  prctl(PR_SET_PDEATHSIG, SIGKILL);
+  if (getenv(NOHUP_ENV))
+    signal(SIGHUP, SIG_IGN);
+  if (getppid() == 1)
+    exit(0);
+  for (;;)
+    pause();
+}
+
+/*-
+  *      Routine:      measure
+  *
+  *      Purpose:
+  *              Teclea "kill -'sig' %1-%n" y obtiene el tiempo del
+  *              comando interno (máximo de la fase 'builtin' tras
+  *              un 'stats -r') y el total hasta el prompt.
+  *      Conditions:
+  *              El shell debe estar esperando órdenes.
+  *      Returns:
+  *              0 si todo fue bien, -1 e.o.c.
+  *
+  */
+int measure(pty_t *pt, char *sig, int njobs, double *t_kill,
+	    uint64_t *t_total)
+{
+  char cmd[64], *s;
+  uint64_t t;
+
+  pty_send(pt, "stats -r\r");
+  if (pty_prompt(pt, TIMEOUT))
+    return -1;
+
+  snprintf(cmd, sizeof(cmd), "kill -%s %%1-%%%d\r", sig, njobs);
+  t = now_ns();
+  pty_send(pt, cmd);
+  if (pty_prompt(pt, TIMEOUT))
+    return -1;
+  *t_total = now_ns() - t;
+
+  /* 'stats -r' apenas cuenta: el máximo es el del kill. */
+  pty_send(pt, "stats\r");
+  if (pty_expect(pt, "reap ", TIMEOUT)
+      || !(s = strstr(pt->buf, " builtin "))
+      || sscanf(s, " builtin %*d %*f %*f %lf", t_kill) != 1
+      || pty_prompt(pt, TIMEOUT))
+    return -1;
+
+  *t_kill /= 1e3;
+  return 0;
+}
+
+/*-
+  *      Routine:      measure_logout
+  *
+  *      Purpose:
+  *              Teclea "logout" y mide hasta que el shell se
+  *              despide. Deja en 'summary' su resumen.
+  *      Conditions:
+  *              El shell debe estar esperando órdenes.
+  *      Returns:
+  *              0 si todo fue bien, -1 e.o.c.
+  *
+  */
+int measure_logout(pty_t *pt, uint64_t *t_total, char *summary, int len)
+{
+  uint64_t t;
+  char *s;
+
+  t = now_ns();
+  pty_send(pt, "logout\r");
+  if (pty_expect(pt, "Bye", TIMEOUT))
+    return -1;
+  *t_total = now_ns() - t;
+
+  if (!(s = strstr(pt->buf, " logout: ")))
+    return -1;
+  snprintf(summary, len, "%.*s", (int) strcspn(s, "\r\n"), s);
+
+  return 0;
+}
+
+/*-
+  *      Routine:      measure_floor
+  *
+  *      Purpose:
+  *              Lanza 'njobs' trabajos 'stub' en sus propios grupos,
+  *              espera a que todos estén dormidos en pause(), les
+  *              envía SIGHUP y mide hasta recogerlos a todos.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              0 si todo fue bien, -1 e.o.c.
+  *
+  */
+int measure_floor(char *stub, char **env, int njobs, uint64_t *t)
+{
+  char path[64], st;
+  int *pids, i, ready;
+  uint64_t t0;
+  FILE *f;
+
+  if (!(pids = malloc(njobs * sizeof(*pids))))
+    return -1;
+  for (i = 0; i < njobs; i++)
+    if ((pids[i] = fork()) == 0)
+      {
+	setpgid(0, 0);
+	execle(stub, "kstub", (char *) NULL, env);
+	_exit(127);
+      }
+    else if (pids[i] == -1)
+      {
+	while (i-- > 0)
+	  {
+	    kill(pids[i], SIGKILL);
+	    waitpid(pids[i], NULL, 0);
+	  }
+	free(pids);
+	return -1;
+      }
+
+  for (i = 0; i < njobs; )
+    {
+      /* Estado 'S' con el nombre ya cambiado: terminó de arrancar. */
+      snprintf(path, sizeof(path), "/proc/%d/stat", pids[i]);
+      ready = (f = fopen(path, "r"))
+	&& fscanf(f, "%*d (kstub) %c", &st) == 1 && st == 'S';
+      if (f)
+	fclose(f);
+      if (ready)
+	i++;
+      else
+	usleep(1000);
+    }
+
+  t0 = now_ns();
+  for (i = 0; i < njobs; i++)
+    kill(-pids[i], SIGHUP);
+  for (i = 0; i < njobs; i++)
+    waitpid(pids[i], NULL, 0);
+  *t = now_ns() - t0;
+
+  free(pids);
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  char *shell = "./shFSO", *base, *sh_argv[2], *env[4];
+  char dir[] = "/tmp/shfso_kill.XXXXXX";
+  char self[PATH_MAX], path[PATH_MAX + 16];
+  char env_path[PATH_MAX + 8], env_home[PATH_MAX + 8];
+  char line[PER_LINE * 10 + 8];
+  char summary[256] = "";
+  int njobs = 10000, opt, i, k, ok = 0, logout = 0, nohup = 0;
+  double thresh = 100;
+  char *sig = NULL;
+  double t_kill = 0, t_sig = 0;
+  uint64_t t_total = 0, t_sig_total = 0, t_floor = 0;
+  pty_t *pt = NULL;
+
+  base = strrchr(argv[0], '/') ? strrchr(argv[0], '/') + 1 : argv[0];
+  if (strcmp(base, "kstub") == 0)
+    stub();
+
+  while ((opt = getopt(argc, argv, "LHS:n:s:t:")) != -1)
+    switch (opt)
+      {
+      case 'L': logout = 1; break;
+      case 'H': nohup = 1; break;
+      case 'S': shell = optarg; break;
+      case 'n': njobs = atoi(optarg); break;
+      case 's': sig = optarg; break;
+      case 't': thresh = atof(optarg); break;
+      default:
+	fprintf(stderr, "Uso: %s [-S shell] [-n trabajos] [-s señal] "
+		"[-t ms]\n"
+		"     %s -L [-S shell] [-n trabajos] [-H] [-t ms]\n",
+		argv[0], argv[0]);
+	return 2;
+      }
+
+  if (njobs < 1 || !mkdtemp(dir) || !realpath("/proc/self/exe", self)
+      || !realpath(shell, path))
+    {
+      perror("kill_bench");
+      return 1;
+    }
+  shell = strdup(path);
+  snprintf(path, sizeof(path), "%s/kstub", dir);
+  symlink(self, path);
+
+  snprintf(env_path, sizeof(env_path), "PATH=%s", dir);
+  snprintf(env_home, sizeof(env_home), "HOME=%s", dir);
+  env[0] = env_path;
+  env[1] = env_home;
+  env[2] = nohup ? NOHUP_ENV "=1" : NULL;
+  env[3] = NULL;
+  sh_argv[0] = shell;
+  sh_argv[1] = NULL;
+
+  if (logout && !nohup && measure_floor(path, env, njobs, &t_floor))
+    {
+      perror("kill_bench");
+      goto out;
+    }
+
+  if (!(pt = pty_spawn(sh_argv, env)) || pty_prompt(pt, TIMEOUT))
+    {
+      fprintf(stderr, "kill_bench: el shell no arranca\n");
+      goto out;
+    }
+
+  /* Varios trabajos por línea para no pagar una ida y vuelta del
+     terminal por cada uno. */
+  for (i = 0; i < njobs; i += k)
+    {
+      line[0] = '\0';
+      for (k = 0; k < PER_LINE && i + k < njobs; k++)
+	strcat(line, k ? " ; kstub &" : "kstub &");
+      strcat(line, "\r");
+      pty_send(pt, line);
+      if (pty_prompt(pt, TIMEOUT))
+	{
+	  fprintf(stderr, "kill_bench: sin respuesta tras %d trabajos\n", i);
+	  goto out;
+	}
+    }
+
+  if (logout)
+    {
+      if (measure_logout(pt, &t_total, summary, sizeof(summary)) == 0)
+	ok = 1;
+      goto out;
+    }
+
+  if (sig && measure(pt, sig, njobs, &t_sig, &t_sig_total))
+    goto out;
+  if (measure(pt, "TERM", njobs, &t_kill, &t_total))
+    goto out;
+
+  pty_send(pt, "wait ; jobs\r");
+  if (pty_expect(pt, "vacía", TIMEOUT))
+    goto out;
+  ok = 1;
+
+ out:
+  if (pt)
+    {
+      if (!(logout && ok))
+	pty_send(pt, "logout\r");
+      pty_close(pt, 5000);
+    }
+  unlink(path);
+  rmdir(dir);
+
+  if (!ok)
+    {
+      fprintf(stderr, "kill_bench: el shell no completó la prueba\n");
+      return 1;
+    }
+
+  printf(" %d trabajos\n", njobs);
+  if (logout)
+    {
+      printf("   logout%s %9.1f ms   %s\n", nohup ? " (sin SIGHUP)" : "",
+	     t_total / 1e6, summary);
+      if (t_floor)
+	printf("   núcleo   %9.1f ms   (los mismos trabajos, sin shell)\n",
+	       t_floor / 1e6);
+      if (t_total / 1e6 > thresh)
+	{
+	  printf("   REGRESIÓN: logout %.1f ms > %.1f ms\n",
+		 t_total / 1e6, thresh);
+	  if (t_floor / 1e6 > thresh)
+	    printf("   (inalcanzable aquí: el núcleo solo tarda %.1f ms)\n",
+		   t_floor / 1e6);
+	  return 1;
+	}
+      return 0;
+    }
+  if (sig)
+    printf("   kill -%-5s %9.1f ms   hasta el prompt %9.1f ms\n",
+	   sig, t_sig, t_sig_total / 1e6);
+  printf("   kill -%-5s %9.1f ms   hasta el prompt %9.1f ms\n",
+	 "TERM", t_kill, t_total / 1e6);
+
+  if (sig)
+    t_kill = t_sig;
+  if (t_kill > thresh)
+    {
+      printf("   REGRESIÓN: kill %.1f ms > %.1f ms\n", t_kill, thresh);
+      return 1;
+    }
+
+  return 0;
+}
@@ -0,0 +1,402 @@
+/* -*- mode: C -*-
+   *
+   *       File:         map_bench.c
+   *
+   *       Benchmark de rendimiento de 'map' bajo un pseudo-terminal.
+   *
+   *       Uso: map_bench [-S shell] [-j n1,n2,...] [-l lineas]
+   *                      [-w trabajo]
+   *
+   *       Genera un fichero de entrada y, para cada número de
+   *       trabajadores n, teclea
+   *
+   *         map -j n -i entrada -o salida mapstub
+   *
+   *       midiendo el tiempo hasta que vuelve el prompt. Comprueba
+   *       que la salida es la esperada, en el mismo orden que la
+   *       entrada, y muestra líneas por segundo y la aceleración
+   *       respecto al primer n de la lista.
+   *
+   *       'mapstub' es este mismo programa: por cada línea calcula
+   *       -w iteraciones de FNV-1a sobre ella (trabajo de CPU puro) y
+   *       escribe el resultado en hexadecimal.
+   *
+   *       Comprueba también el orden con un filtro que no da una
+   *       línea por línea: 'mapgrep', que como "grep 7" sólo deja
+   *       pasar las líneas con un 7.
+   *
+   *       Al final comprueba que 'map' no se atasca con una entrada
+   *       que llega poco a poco (STREAM_LINES líneas por una FIFO)
+   *       y un filtro que no vuelca su salida hasta terminar, como
+   *       mapstub, cuya salida estándar va a una tubería.
+   *
+   */
+
+/*
+  Copyright (C) 2009, 2013 Pedro J. Ruiz López <holzplatten@es.gnu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "pty.h"
+
+#define TIMEOUT 600000  /* ms */
+#define WORK_ENV "MAPSTUB_WORK"
+#define STREAM_LINES 64
+#define STREAM_US 5000      /* entre línea y línea */
+#define STREAM_TIMEOUT 10000  /* ms */
+
+/*-
+  *      Routine:      work
+  *
+  *      Purpose:
+  *              El cálculo de 'mapstub' sobre una línea.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              El hash.
+  *
+  */
+uint64_t work(char *s, size_t len, long iter)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+  size_t i;
+
+  while (iter-- > 0)
+    for (i = 0; i < len; i++)
+      {
+	h ^= (unsigned char) s[i];
+	h *= 0x100000001b3ULL;
+      }
+
+  return h;
+}
+
+/*-
+  *      Routine:      stub
+  *
+  *      Purpose:
+  *              Filtro de prueba: una línea de salida por línea de
+  *              entrada.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              no retorna
+  *
+  */
+void stub()
+{
+  char *line = NULL, *e = getenv(WORK_ENV);
+  size_t cap = 0;
+  ssize_t len;
+  long iter = e ? atol(e) : 1000;
+
+  while ((len = getline(&line, &cap, stdin)) > 0)
+    printf("%016llx\n", (unsigned long long) work(line, len, iter));
+
+  exit(0);
+}
+
+/*-
+  *      Routine:      filter
+  *
+  *      Purpose:
+  *              'mapgrep': deja pasar sólo las líneas que contienen
+  *              un 7.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              no retorna
+  *
+  */
+void filter()
+{
+  char *line = NULL;
+  size_t cap = 0;
+
+  while (getline(&line, &cap, stdin) > 0)
+    if (strchr(line, '7'))
+      fputs(line, stdout);
+
+  exit(0);
+}
+
+/*-
+  *      Routine:      sparse
+  *
+  *      Purpose:
+  *              Lanza 'map -j 3' con mapgrep sobre el fichero 'in' y
+  *              comprueba que la salida es la de aplicarlo a toda la
+  *              entrada de una vez.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              0 si la salida es la esperada, 1 e.o.c.
+  *
+  */
+int sparse(pty_t *pt, char *in, char *out)
+{
+  char cmd[3 * PATH_MAX], *line = NULL, *expect = NULL, *got;
+  size_t cap = 0, len = 0;
+  long n;
+  int ok;
+  FILE *f, *m;
+
+  m = open_memstream(&expect, &len);
+  if ((f = fopen(in, "r")))
+    {
+      while (getline(&line, &cap, f) > 0)
+	if (strchr(line, '7'))
+	  fputs(line, m);
+      fclose(f);
+    }
+  fclose(m);
+  free(line);
+
+  unlink(out);
+  snprintf(cmd, sizeof(cmd), "map -j 3 -i %s -o %s mapgrep\r", in, out);
+  pty_send(pt, cmd);
+  ok = pty_prompt(pt, TIMEOUT) == 0;
+
+  got = malloc(len + 1);
+  f = fopen(out, "r");
+  n = f ? fread(got, 1, len + 1, f) : 0;
+  if (f)
+    fclose(f);
+  ok = ok && n == len && memcmp(got, expect, len) == 0;
+  printf("   filtro que descarta líneas: %s\n",
+	 ok ? "correcto" : "SALIDA ERRÓNEA");
+  free(expect);
+  free(got);
+
+  return !ok;
+}
+
+/*-
+  *      Routine:      stream
+  *
+  *      Purpose:
+  *              Prueba de atasco: lanza 'map -j 2' sobre la FIFO
+  *              'in' mientras un hijo escribe en ella STREAM_LINES
+  *              líneas, una cada STREAM_US, y comprueba la salida.
+  *      Conditions:
+  *              'in' debe ser una FIFO.
+  *      Returns:
+  *              0 si 'map' terminó con la salida esperada, 1 e.o.c.
+  *
+  */
+int stream(pty_t *pt, char *in, char *out, long iter)
+{
+  char line[64], cmd[3 * PATH_MAX], *expect, *got;
+  int i, len = 0, pid, ok;
+  FILE *f;
+
+  expect = malloc(STREAM_LINES * 17 + 1);
+  got = malloc(STREAM_LINES * 17 + 2);
+  for (i = 0; i < STREAM_LINES; i++)
+    {
+      snprintf(line, sizeof(line), "linea %d de la FIFO\n", i);
+      len += sprintf(expect + len, "%016llx\n",
+		     (unsigned long long) work(line, strlen(line), iter));
+    }
+
+  if ((pid = fork()) == 0)
+    {
+      f = fopen(in, "w");
+      for (i = 0; f && i < STREAM_LINES; i++)
+	{
+	  fprintf(f, "linea %d de la FIFO\n", i);
+	  fflush(f);
+	  usleep(STREAM_US);
+	}
+      _exit(0);
+    }
+
+  unlink(out);
+  snprintf(cmd, sizeof(cmd), "map -j 2 -i %s -o %s mapstub\r", in, out);
+  pty_send(pt, cmd);
+  ok = pty_prompt(pt, STREAM_TIMEOUT) == 0;
+  if (!ok)
+    {
+      /* Desatascar al shell para poder salir. */
+      pty_send(pt, "\003");
+      pty_prompt(pt, 5000);
+    }
+  waitpid(pid, NULL, 0);
+
+  f = fopen(out, "r");
+  i = f ? fread(got, 1, len + 1, f) : 0;
+  if (f)
+    fclose(f);
+  if (ok && (i != len || memcmp(got, expect, len) != 0))
+    {
+      ok = 0;
+      i = -1;
+    }
+  printf("   FIFO, filtro con buffer: %s\n",
+	 ok ? "correcto" : i == -1 ? "SALIDA ERRÓNEA" : "ATASCADO");
+  free(expect);
+  free(got);
+
+  return !ok;
+}
+
+int main(int argc, char *argv[])
+{
+  char *shell = "./shFSO", *counts = NULL, *c, *base, *s;
+  char dir[] = "/tmp/shfso_map.XXXXXX";
+  char self[PATH_MAX], path[PATH_MAX + 16], grep[PATH_MAX + 16];
+  char in[PATH_MAX + 16];
+  char out[PATH_MAX + 16], cmd[3 * PATH_MAX];
+  char env_path[PATH_MAX + 8], env_home[PATH_MAX + 8], env_work[64];
+  char *env[4], *sh_argv[2], *expect, *got;
+  long lines = 50000, iter = 1000, i, len;
+  int opt, fail = 0;
+  double base_t = 0, t;
+  uint64_t t0;
+  FILE *f;
+  pty_t *pt;
+
+  base = strrchr(argv[0], '/') ? strrchr(argv[0], '/') + 1 : argv[0];
+  if (strcmp(base, "mapstub") == 0)
+    stub();
+  if (strcmp(base, "mapgrep") == 0)
+    filter();
+
+  while ((opt = getopt(argc, argv, "S:j:l:w:")) != -1)
+    switch (opt)
+      {
+      case 'S': shell = optarg; break;
+      case 'j': counts = strdup(optarg); break;
+      case 'l': lines = atol(optarg); break;
+      case 'w': iter = atol(optarg); break;
+      default:
+	fprintf(stderr, "Uso: %s [-S shell] [-j n1,n2,...] [-l lineas] "
+		"[-w trabajo]\n", argv[0]);
+	return 2;
+      }
+
+  if (!mkdtemp(dir) || !realpath("/proc/self/exe", self)
+      || !realpath(shell, path))
+    {
+      perror("map_bench");
+      return 1;
+    }
+  shell = strdup(path);
+  if (!counts)
+    counts = strdup("1,2,4,8");
+  snprintf(path, sizeof(path), "%s/mapstub", dir);
+  symlink(self, path);
+  snprintf(grep, sizeof(grep), "%s/mapgrep", dir);
+  symlink(self, grep);
+  snprintf(in, sizeof(in), "%s/in", dir);
+  snprintf(out, sizeof(out), "%s/out", dir);
+
+  /* Entrada y salida esperada. */
+  f = fopen(in, "w");
+  expect = malloc(lines * 17 + 1);
+  for (i = 0, len = 0; i < lines; i++)
+    {
+      snprintf(cmd, sizeof(cmd), "linea %ld de la entrada de prueba\n", i);
+      fputs(cmd, f);
+      len += sprintf(expect + len, "%016llx\n",
+		     (unsigned long long) work(cmd, strlen(cmd), iter));
+    }
+  fclose(f);
+  got = malloc(len + 2);
+
+  snprintf(env_path, sizeof(env_path), "PATH=%s", dir);
+  snprintf(env_home, sizeof(env_home), "HOME=%s", dir);
+  snprintf(env_work, sizeof(env_work), WORK_ENV "=%ld", iter);
+  env[0] = env_path;
+  env[1] = env_home;
+  env[2] = env_work;
+  env[3] = NULL;
+  sh_argv[0] = shell;
+  sh_argv[1] = NULL;
+
+  printf(" %ld líneas, %ld iteraciones por línea, %ld CPUs\n",
+	 lines, iter, sysconf(_SC_NPROCESSORS_ONLN));
+
+  if (!(pt = pty_spawn(sh_argv, env)) || pty_prompt(pt, TIMEOUT))
+    {
+      fprintf(stderr, "map_bench: el shell no arranca\n");
+      fail = 1;
+      goto out;
+    }
+
+  for (c = strtok(counts, ","); c; c = strtok(NULL, ","))
+    {
+      unlink(out);
+      snprintf(cmd, sizeof(cmd), "map -j %s -i %s -o %s mapstub\r",
+	       c, in, out);
+      t0 = now_ns();
+      pty_send(pt, cmd);
+      if (pty_prompt(pt, TIMEOUT))
+	{
+	  fprintf(stderr, "map_bench: sin respuesta con -j %s\n", c);
+	  fail = 1;
+	  break;
+	}
+      t = (now_ns() - t0) / 1e9;
+
+      f = fopen(out, "r");
+      i = f ? fread(got, 1, len + 1, f) : 0;
+      if (f)
+	fclose(f);
+      s = i == len && memcmp(got, expect, len) == 0 ? "" : "  SALIDA ERRÓNEA";
+      if (*s)
+	fail = 1;
+
+      if (base_t == 0)
+	base_t = t;
+      printf("   -j %-3s %8.3f s %12.0f líneas/s   x%.2f%s\n",
+	     c, t, lines / t, base_t / t, s);
+    }
+
+  if (!fail)
+    fail = sparse(pt, in, out);
+
+  if (!fail)
+    {
+      unlink(in);
+      mkfifo(in, 0600);
+      fail = stream(pt, in, out, iter);
+    }
+
+ out:
+  if (pt)
+    {
+      pty_send(pt, "logout\r");
+      pty_close(pt, 5000);
+    }
+  unlink(out);
+  unlink(in);
+  unlink(path);
+  unlink(grep);
+  rmdir(dir);
+
+  return fail;
+}
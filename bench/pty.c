@@ -0,0 +1,336 @@
+/* -*- mode: C -*-
+   *
+   *       File:         pty.c
+   *
+   *       Rutinas para ejecutar shFSO bajo un pseudo-terminal desde
+   *       los programas de benchmark.
+   *
+   */
+
+/*
+  Copyright (C) 2009, 2013 Pedro J. Ruiz López <holzplatten@es.gnu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+
+#include "pty.h"
+
+/*-
+  *      Routine:      now_ns
+  *
+  *      Purpose:
+  *              Lee el reloj monótono.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              El instante actual en nanosegundos.
+  *
+  */
+uint64_t now_ns()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*-
+  *      Routine:      pty_spawn
+  *
+  *      Purpose:
+  *              Ejecuta 'argv' con el lado esclavo de un nuevo
+  *              pseudo-terminal como terminal de control, añadiendo
+  *              'env' (terminado en NULL) a su entorno.
+  *              El shell necesita no ser líder de sesión para poder
+  *              crear su propio grupo de procesos, así que se lanza
+  *              desde un proceso intermedio que crea la sesión y lo
+  *              espera.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              El pseudo-terminal, o NULL si hubo un error.
+  *
+  */
+pty_t * pty_spawn(char *argv[], char *env[])
+{
+  struct winsize ws = { 50, 200, 0, 0 };
+  pty_t *p;
+  int fd, slave, pid, status;
+
+  if ((fd = posix_openpt(O_RDWR|O_NOCTTY|O_CLOEXEC)) == -1
+      || grantpt(fd) || unlockpt(fd))
+    {
+      perror("posix_openpt");
+      return NULL;
+    }
+
+  pid = fork();
+  if (pid == -1)
+    {
+      perror("fork");
+      return NULL;
+    }
+
+  if (pid == 0)
+    {
+      setsid();
+      if ((slave = open(ptsname(fd), O_RDWR)) == -1)
+	{
+	  perror("ptsname");
+	  _exit(127);
+	}
+      ioctl(slave, TIOCSCTTY, 0);
+      ioctl(slave, TIOCSWINSZ, &ws);
+      dup2(slave, 0);
+      dup2(slave, 1);
+      dup2(slave, 2);
+      if (slave > 2)
+	close(slave);
+
+      for (; env && *env; env++)
+	putenv(*env);
+
+      pid = fork();
+      if (pid == 0)
+	{
+	  setpgid(0, 0);
+	  signal(SIGTTOU, SIG_IGN);
+	  tcsetpgrp(0, getpid());
+	  signal(SIGTTOU, SIG_DFL);
+	  execv(argv[0], argv);
+	  perror(argv[0]);
+	  _exit(127);
+	}
+
+      /* Como el shell deja de ser el grupo en primer plano al
+	 terminar, no recibir SIGHUP antes de recogerlo. */
+      signal(SIGHUP, SIG_IGN);
+      while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+	;
+      _exit(WIFEXITED(status) ? WEXITSTATUS(status) : 128);
+    }
+
+  p = calloc(1, sizeof(*p));
+  p->fd = fd;
+  p->pid = pid;
+
+  return p;
+}
+
+/*-
+  *      Routine:      pty_send
+  *
+  *      Purpose:
+  *              Escribe una cadena en el terminal, como si se
+  *              tecleara.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              0 si se escribió entera.
+  *              -1 e.o.c.
+  *
+  */
+int pty_send(pty_t *p, char *s)
+{
+  int len = strlen(s), n;
+
+  while (len > 0)
+    {
+      n = write(p->fd, s, len);
+      if (n == -1)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  return -1;
+	}
+      s += n;
+      len -= n;
+    }
+
+  return 0;
+}
+
+/*-
+  *      Routine:      pty_read
+  *
+  *      Purpose:
+  *              Lee lo que haya en el terminal, esperando como mucho
+  *              'ms' milisegundos a que haya algo.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              Los bytes leídos, 0 si se agotó el tiempo.
+  *              -1 si el terminal se cerró.
+  *
+  */
+static int pty_read(pty_t *p, int ms)
+{
+  struct pollfd pfd = { p->fd, POLLIN, 0 };
+  int n;
+
+  if (poll(&pfd, 1, ms) <= 0)
+    return 0;
+
+  /* Si se llena el buffer se descarta la mitad más antigua. */
+  if (p->len > PTY_BUF - 4096)
+    {
+      memmove(p->buf, p->buf + PTY_BUF/2, p->len - PTY_BUF/2);
+      p->len -= PTY_BUF/2;
+    }
+
+  n = read(p->fd, p->buf + p->len, PTY_BUF - 1 - p->len);
+  if (n <= 0)
+    return -1;
+
+  p->len += n;
+  p->buf[p->len] = '\0';
+
+  return n;
+}
+
+/*-
+  *      Routine:      pty_mark
+  *
+  *      Purpose:
+  *              Olvida la salida acumulada: las siguientes esperas
+  *              sólo miran lo que llegue a partir de ahora.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              none
+  *
+  */
+void pty_mark(pty_t *p)
+{
+  p->len = 0;
+  p->buf[0] = '\0';
+}
+
+/*-
+  *      Routine:      pty_expect
+  *
+  *      Purpose:
+  *              Espera a que aparezca 'pat' en la salida acumulada
+  *              desde el último pty_mark. La salida no se consume,
+  *              así que se pueden esperar varios patrones que lleguen
+  *              en cualquier orden.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              0 si apareció.
+  *              -1 si se agotaron los 'ms' milisegundos o se cerró
+  *              el terminal.
+  *
+  */
+int pty_expect(pty_t *p, char *pat, int ms)
+{
+  uint64_t limit = now_ns() + (uint64_t) ms * 1000000;
+  int left;
+
+  for (;;)
+    {
+      if (strstr(p->buf, pat))
+	return 0;
+
+      left = (int) ((int64_t) (limit - now_ns()) / 1000000);
+      if (left <= 0 || pty_read(p, left) == -1)
+	return -1;
+    }
+}
+
+/*-
+  *      Routine:      pty_prompt
+  *
+  *      Purpose:
+  *              Espera a que el shell muestre el prompt ("...> " al
+  *              final de la salida, sin nada detrás, o seguido sólo
+  *              del borrado de línea si el editor lo ha redibujado).
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              0 si apareció.
+  *              -1 si se agotó el tiempo o se cerró el terminal.
+  *
+  */
+int pty_prompt(pty_t *p, int ms)
+{
+  uint64_t limit = now_ns() + (uint64_t) ms * 1000000;
+  int left;
+
+  for (;;)
+    {
+      if ((p->len >= 2 && strcmp(p->buf + p->len - 2, "> ") == 0)
+	  || (p->len >= 5 && strcmp(p->buf + p->len - 5, "> \033[K") == 0))
+	{
+	  pty_mark(p);
+	  return 0;
+	}
+
+      left = (int) ((int64_t) (limit - now_ns()) / 1000000);
+      if (left <= 0 || pty_read(p, left) == -1)
+	return -1;
+    }
+}
+
+/*-
+  *      Routine:      pty_close
+  *
+  *      Purpose:
+  *              Espera a que termine el shell (como mucho 'ms'
+  *              milisegundos; después se mata) y cierra el terminal.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              El código de salida del shell.
+  *
+  */
+int pty_close(pty_t *p, int ms)
+{
+  uint64_t limit = now_ns() + (uint64_t) ms * 1000000;
+  int status = 0;
+
+  while (waitpid(p->pid, &status, WNOHANG) == 0)
+    {
+      if (now_ns() > limit)
+	{
+	  kill(p->pid, SIGKILL);
+	  waitpid(p->pid, &status, 0);
+	  break;
+	}
+      if (pty_read(p, 10) == -1)
+	usleep(1000);
+      if (p->len > PTY_BUF/2)
+	pty_mark(p);
+    }
+
+  close(p->fd);
+  free(p);
+
+  return WIFEXITED(status) ? WEXITSTATUS(status) : 128;
+}
@@ -0,0 +1,34 @@
+/* -*- mode: C -*-
+   *
+   *       File:         pty.h
+   *
+   *       Rutinas para ejecutar shFSO bajo un pseudo-terminal desde
+   *       los programas de benchmark.
+   *
+   */
+
+#ifndef SHFSO_PTY_H
+#define SHFSO_PTY_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define PTY_BUF (1024*1024)
+
+typedef struct _pty_t {
+  int fd;               /* lado maestro */
+  pid_t pid;            /* proceso que espera al shell */
+  char buf[PTY_BUF];    /* salida acumulada desde el último pty_mark */
+  int len;
+} pty_t;
+
+pty_t * pty_spawn(char *argv[], char *env[]);
+int pty_send(pty_t *, char *);
+int pty_expect(pty_t *, char *, int);
+int pty_prompt(pty_t *, int);
+void pty_mark(pty_t *);
+int pty_close(pty_t *, int);
+
+uint64_t now_ns();
+
+#endif
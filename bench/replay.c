@@ -0,0 +1,398 @@
+/* -*- mode: C -*-
+   *
+   *       File:         replay.c
+   *
+   *       Reproduce una traza grabada con 'shFSO -r traza' sobre un
+   *       pseudo-terminal y mide el tiempo que añade el propio shell
+   *       a cada línea.
+   *
+   *       Uso: replay [-m] [-l] [-S shell] [-o nueva_traza] traza
+   *
+   *         -m  reproduce a la máxima velocidad (por defecto se
+   *             respetan los intervalos originales entre líneas)
+   *         -l  'traza' es una sesión de texto, una orden por línea
+   *             (ver read_lines), en vez de una traza grabada
+   *
+   *       Los programas externos se sustituyen por stubs que
+   *       terminan en el acto (enlaces a este mismo ejecutable en un
+   *       directorio temporal que pasa a ser el PATH), de modo que
+   *       lo que se mide es el shell y no los comandos. El shell se
+   *       ejecuta a su vez en modo grabación, y de esa segunda traza
+   *       se sacan los tiempos de cada fase.
+   *
+   */
+
+/*
+  Copyright (C) 2009, 2013 Pedro J. Ruiz López <holzplatten@es.gnu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "pty.h"
+
+#define TRACE_MAGIC "SHFSOTR1"
+#define MAXFASES 16
+
+/* Fases del shell, en el orden en que aparecen en la traza. */
+enum { F_READ, F_TOKENIZE, F_BUILTIN, F_FORK, F_EXEC_REAP,
+       F_TERM, F_REAP };
+
+typedef struct _rec_t {
+  uint64_t t;
+  char *line;
+  int32_t status;
+  uint64_t fase[MAXFASES];
+} rec_t;
+
+/*-
+  *      Routine:      read_trace
+  *
+  *      Purpose:
+  *              Carga una traza completa en memoria.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              El número de registros (en '*recs'), -1 si error.
+  *
+  */
+int read_trace(char *path, rec_t **recs)
+{
+  FILE *f;
+  char magic[8];
+  uint32_t nf, len;
+  uint64_t t0;
+  rec_t r;
+  int n = 0, cap = 0;
+
+  *recs = NULL;
+
+  if (!(f = fopen(path, "r")))
+    {
+      perror(path);
+      return -1;
+    }
+
+  if (fread(magic, 8, 1, f) != 1 || memcmp(magic, TRACE_MAGIC, 8)
+      || fread(&nf, sizeof(nf), 1, f) != 1 || nf > MAXFASES
+      || fread(&t0, sizeof(t0), 1, f) != 1)
+    {
+      fprintf(stderr, "%s: no es una traza de shFSO\n", path);
+      fclose(f);
+      return -1;
+    }
+
+  for (;;)
+    {
+      memset(&r, 0, sizeof(r));
+      if (fread(&r.t, sizeof(r.t), 1, f) != 1
+	  || fread(&len, sizeof(len), 1, f) != 1)
+	break;
+      r.line = malloc(len + 1);
+      if (fread(r.line, 1, len, f) != len
+	  || fread(&r.status, sizeof(r.status), 1, f) != 1
+	  || fread(r.fase, sizeof(uint64_t), nf, f) != nf)
+	{
+	  free(r.line);
+	  break;
+	}
+      r.line[len] = '\0';
+
+      if (n == cap)
+	{
+	  cap = cap ? 2*cap : 256;
+	  *recs = realloc(*recs, cap * sizeof(rec_t));
+	}
+      (*recs)[n++] = r;
+    }
+
+  fclose(f);
+  return n;
+}
+
+/*-
+  *      Routine:      read_lines
+  *
+  *      Purpose:
+  *              Carga una sesión escrita a mano: una orden por
+  *              línea, sin tiempos, así que se reproduce seguida.
+  *              Se saltan las líneas vacías y las que empiezan por
+  *              '#'. Sirve para medir sin haber grabado antes una
+  *              traza en un terminal.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              El número de registros (en '*recs'), -1 si error.
+  *
+  */
+int read_lines(char *path, rec_t **recs)
+{
+  FILE *f;
+  char *line = NULL;
+  size_t lcap = 0;
+  ssize_t len;
+  rec_t r;
+  int n = 0, cap = 0;
+
+  *recs = NULL;
+
+  if (!(f = fopen(path, "r")))
+    {
+      perror(path);
+      return -1;
+    }
+
+  while ((len = getline(&line, &lcap, f)) > 0)
+    {
+      if (line[len-1] == '\n')
+	line[--len] = '\0';
+      if (len == 0 || line[0] == '#')
+	continue;
+
+      memset(&r, 0, sizeof(r));
+      r.line = strdup(line);
+
+      if (n == cap)
+	{
+	  cap = cap ? 2*cap : 256;
+	  *recs = realloc(*recs, cap * sizeof(rec_t));
+	}
+      (*recs)[n++] = r;
+    }
+
+  free(line);
+  fclose(f);
+  return n;
+}
+
+/*-
+  *      Routine:      stub_line
+  *
+  *      Purpose:
+  *              Prepara una línea para reproducirla: los nombres de
+  *              comando con ruta se reducen a su nombre, y para cada
+  *              comando se crea un stub en 'dir'.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              La línea a enviar (memoria dinámica).
+  *
+  */
+char * stub_line(char *line, char *dir, char *self)
+{
+  char *out, *copy, *tok, *save, *name, path[PATH_MAX];
+  int cmd = 1;
+
+  out = calloc(1, strlen(line) + 2);
+  copy = strdup(line);
+
+  for (tok = strtok_r(copy, " ", &save); tok; tok = strtok_r(NULL, " ", &save))
+    {
+      name = tok;
+      if (cmd)
+	{
+	  if (strrchr(tok, '/'))
+	    name = strrchr(tok, '/') + 1;
+	  snprintf(path, sizeof(path), "%s/%s", dir, name);
+	  symlink(self, path);
+	}
+      cmd = strcmp(tok, ";") == 0;
+
+      if (*out)
+	strcat(out, " ");
+      strcat(out, name);
+    }
+
+  free(copy);
+  return out;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+  uint64_t x = *(uint64_t *) a, y = *(uint64_t *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+/*-
+  *      Routine:      summary
+  *
+  *      Purpose:
+  *              Muestra p50, p99 y máximo de una serie (en us).
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              none
+  *
+  */
+void summary(char *name, uint64_t *v, int n)
+{
+  if (n == 0)
+    return;
+
+  qsort(v, n, sizeof(*v), cmp_u64);
+  printf(" %-22s p50 %9.1f us   p99 %9.1f us   max %9.1f us\n", name,
+	 v[n/2] / 1e3, v[(n*99)/100 < n ? (n*99)/100 : n-1] / 1e3,
+	 v[n-1] / 1e3);
+}
+
+int main(int argc, char *argv[])
+{
+  char *shell = "./shFSO", *out = NULL, *base;
+  char dir[] = "/tmp/shfso_replay.XXXXXX";
+  char self[PATH_MAX], outpath[PATH_MAX], envbuf[4][PATH_MAX + 32];
+  char *env[5], *sargv[4], **lines;
+  rec_t *in, *res;
+  uint64_t start, target, t, *e2e, *shell_ns, *exec_ns;
+  int fast = 0, text = 0, opt, n, nres, nsent = 0, i;
+  pty_t *p;
+
+  /* Modo stub: invocado a través de un enlace con otro nombre. */
+  base = strrchr(argv[0], '/') ? strrchr(argv[0], '/') + 1 : argv[0];
+  if (strcmp(base, "replay") != 0)
+    return 0;
+
+  while ((opt = getopt(argc, argv, "mlS:o:")) != -1)
+    switch (opt)
+      {
+      case 'm': fast = 1; break;
+      case 'l': text = 1; break;
+      case 'S': shell = optarg; break;
+      case 'o': out = optarg; break;
+      default:
+	fprintf(stderr, "Uso: %s [-m] [-l] [-S shell] [-o nueva_traza] traza\n",
+		argv[0]);
+	return 2;
+      }
+
+  if (optind != argc - 1
+      || (n = (text ? read_lines : read_trace)(argv[optind], &in)) < 0)
+    {
+      fprintf(stderr, "Uso: %s [-m] [-l] [-S shell] [-o nueva_traza] traza\n",
+	      argv[0]);
+      return 2;
+    }
+
+  if (!mkdtemp(dir) || !realpath("/proc/self/exe", self)
+      || !realpath(shell, outpath))
+    {
+      perror("replay");
+      return 1;
+    }
+  shell = strdup(outpath);
+
+  if (!out)
+    {
+      snprintf(outpath, sizeof(outpath), "%s/trace", dir);
+      out = outpath;
+    }
+
+  /* Líneas a enviar; los logout se omiten hasta el final. */
+  lines = calloc(n, sizeof(*lines));
+  for (i = 0; i < n; i++)
+    if (strcmp(in[i].line, "logout") != 0)
+      lines[i] = stub_line(in[i].line, dir, self);
+
+  snprintf(envbuf[0], sizeof(envbuf[0]), "PATH=%s", dir);
+  snprintf(envbuf[1], sizeof(envbuf[1]), "HOME=%s", dir);
+  snprintf(envbuf[2], sizeof(envbuf[2]), "SHFSO_HISTORY=%s/history", dir);
+  snprintf(envbuf[3], sizeof(envbuf[3]), "MEMO_DIR=%s/memo", dir);
+  for (i = 0; i < 4; i++)
+    env[i] = envbuf[i];
+  env[4] = NULL;
+
+  sargv[0] = shell;
+  sargv[1] = "-r";
+  sargv[2] = out;
+  sargv[3] = NULL;
+
+  if (!(p = pty_spawn(sargv, env)) || pty_prompt(p, 10000))
+    {
+      fprintf(stderr, "replay: el shell no arranca\n");
+      return 1;
+    }
+
+  e2e = calloc(n + 1, sizeof(*e2e));
+  start = now_ns();
+  for (i = 0; i < n; i++)
+    {
+      if (!lines[i])
+	continue;
+
+      if (!fast)
+	{
+	  target = start + (in[i].t - in[0].t);
+	  while ((t = now_ns()) < target)
+	    usleep((target - t) / 1000);
+	}
+
+      t = now_ns();
+      pty_send(p, lines[i]);
+      pty_send(p, "\r");
+      if (pty_prompt(p, 30000))
+	{
+	  fprintf(stderr, "replay: sin respuesta a '%s'\n", lines[i]);
+	  break;
+	}
+      e2e[nsent++] = now_ns() - t;
+    }
+
+  pty_send(p, "logout\r");
+  pty_close(p, 5000);
+
+  /* Tiempos internos del shell, de la traza que ha grabado. */
+  nres = read_trace(out, &res);
+  if (nres < nsent)
+    {
+      fprintf(stderr, "replay: la traza %s está incompleta\n", out);
+      return 1;
+    }
+
+  shell_ns = calloc(nsent + 1, sizeof(*shell_ns));
+  exec_ns = calloc(nsent + 1, sizeof(*exec_ns));
+
+  printf(" %10s %10s %10s  %s\n", "shell(us)", "exec(us)", "total(us)", "línea");
+  for (i = 0; i < nsent; i++)
+    {
+      shell_ns[i] = res[i].fase[F_TOKENIZE] + res[i].fase[F_BUILTIN]
+	+ res[i].fase[F_FORK] + res[i].fase[F_TERM] + res[i].fase[F_REAP];
+      exec_ns[i] = res[i].fase[F_EXEC_REAP];
+      printf(" %10.1f %10.1f %10.1f  %s\n", shell_ns[i] / 1e3,
+	     exec_ns[i] / 1e3, e2e[i] / 1e3, res[i].line);
+    }
+
+  printf("\n %d líneas reproducidas (%s)\n", nsent,
+	 fast ? "máxima velocidad" : "velocidad original");
+  summary("sobrecarga del shell", shell_ns, nsent);
+  summary("fork a recogida", exec_ns, nsent);
+  summary("extremo a extremo", e2e, nsent);
+
+  if (out == outpath)
+    {
+      snprintf(self, sizeof(self), "rm -rf '%s'", dir);
+      system(self);
+    }
+
+  return 0;
+}
@@ -0,0 +1,354 @@
+/* -*- mode: C -*-
+   *
+   *       File:         shm_bench.c
+   *
+   *       Benchmark del coste de publicar la tabla de trabajos en
+   *       memoria compartida (-m) y de sus lectores.
+   *
+   *       Uso: shm_bench [-S shell] [-n trabajos] [-r rondas]
+   *                      [-l lectores] [-i us] [-d] [-t %]
+   *
+   *       Bajo un pseudo-terminal lanza n trabajos "true &" (por
+   *       omisión 2000, varios por línea) seguidos de "wait" y mide
+   *       cuánto tarda el shell y cuánta CPU gasta él mismo, en tres
+   *       configuraciones:
+   *
+   *         base      sin -m
+   *         -m        publicando la tabla, sin lectores
+   *         lectores  publicando, con l procesos (por omisión 4)
+   *                   que copian la tabla cada -i microsegundos
+   *                   (por omisión 1000; 0 para no parar nunca);
+   *                   con -d copian también los terminados, como
+   *                   'shfso_jobs -d'
+   *
+   *       Cada configuración se repite r veces (5) y se toma la
+   *       mediana. Termina con error si la CPU del shell en alguna
+   *       supera a la de la base en más de -t por ciento (10), en la
+   *       mediana de las rondas: cada ronda se compara con la base
+   *       de esa misma ronda, así la deriva de la máquina entre
+   *       rondas no cuenta como sobrecoste. El
+   *       tiempo total se muestra pero no se comprueba: con pocos
+   *       núcleos incluye la CPU que gastan los propios lectores.
+   *       Con uno solo, además, cada lector que despierta desaloja
+   *       al shell: parte de lo que cuesta 'lectores' (unos puntos)
+   *       es ese cambio de contexto, no la tabla.
+   *
+   */
+
+/*
+  Copyright (C) 2009, 2013 Pedro J. Ruiz López <holzplatten@es.gnu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "pty.h"
+#include "../jobshm.h"
+
+#define TIMEOUT 60000   /* ms */
+#define PER_LINE 64     /* trabajos lanzados por línea */
+
+int read_done;          /* los lectores copian también done[] (-d) */
+
+/* Compartido con los lectores. */
+struct reader_stats {
+  volatile int stop;
+  uint64_t reads[64];
+  uint64_t retries[64];
+};
+
+/*-
+  *      Routine:      reader
+  *
+  *      Purpose:
+  *              Lector de prueba: copia la tabla de 'path' cada 'us'
+  *              microsegundos hasta que se le pida parar.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              no retorna
+  *
+  */
+void reader(char *path, int us, struct reader_stats *rs, int id)
+{
+  struct jobshm *shm, *v = malloc(sizeof(*v));
+  int fd;
+
+  if ((fd = shm_open(path, O_RDONLY, 0)) == -1)
+    {
+      perror(path);
+      _exit(1);
+    }
+  shm = mmap(NULL, sizeof(*shm), PROT_READ, MAP_SHARED, fd, 0);
+  if (shm == MAP_FAILED)
+    _exit(1);
+
+  while (!rs->stop)
+    {
+      rs->retries[id] += jobshm_snapshot(shm, v, read_done);
+      rs->reads[id]++;
+      if (us)
+	usleep(us);
+    }
+
+  _exit(0);
+}
+
+/*-
+  *      Routine:      cpu_ns
+  *
+  *      Purpose:
+  *              Lee un reloj de CPU.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              El tiempo de CPU en nanosegundos.
+  *
+  */
+uint64_t cpu_ns(clockid_t clk)
+{
+  struct timespec ts;
+
+  clock_gettime(clk, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*-
+  *      Routine:      run
+  *
+  *      Purpose:
+  *              Una ronda: arranca el shell, con -m si 'shm', y
+  *              'nread' lectores si se piden; mide el lanzamiento y
+  *              la espera de 'njobs' trabajos. Deja en 'cpu' la CPU
+  *              que gastó el shell mientras tanto.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              El tiempo en ns, 0 si el shell no completó la prueba.
+  *
+  */
+uint64_t run(char *shell, char **env, int njobs, int shm, int nread,
+	     int us, struct reader_stats *rs, uint64_t *cpu)
+{
+  char *sh_argv[3] = { shell, shm ? "-m" : NULL, NULL };
+  char line[PER_LINE * 10 + 8], path[64], *s;
+  int i, k, pids[64], forked = 0, sh_pid = 0;
+  uint64_t t0, t = 0, c0;
+  clockid_t clk;
+  FILE *f;
+  pty_t *pt;
+
+  if (!(pt = pty_spawn(sh_argv, env)))
+    return 0;
+
+  /* La ayuda inicial dice el nombre del segmento. */
+  if (shm && (pty_expect(pt, JOBSHM_PREFIX, TIMEOUT)
+	      || !(s = strstr(pt->buf, JOBSHM_PREFIX))
+	      || sscanf(s, "%63[^)]", path) != 1))
+    goto out;
+  if (pty_prompt(pt, TIMEOUT))
+    goto out;
+
+  /* El shell es el hijo del proceso que lanzó pty_spawn. */
+  snprintf(line, sizeof(line), "/proc/%d/task/%d/children", pt->pid, pt->pid);
+  if (!(f = fopen(line, "r")))
+    goto out;
+  k = fscanf(f, "%d", &sh_pid);
+  fclose(f);
+  if (k != 1 || clock_getcpuclockid(sh_pid, &clk))
+    goto out;
+
+  rs->stop = 0;
+  for (forked = 0; forked < nread; forked++)
+    if ((pids[forked] = fork()) == 0)
+      reader(path, us, rs, forked);
+
+  t0 = now_ns();
+  c0 = cpu_ns(clk);
+  for (i = 0; i < njobs; i += k)
+    {
+      line[0] = '\0';
+      for (k = 0; k < PER_LINE && i + k < njobs; k++)
+	strcat(line, k ? " ; true &" : "true &");
+      strcat(line, "\r");
+      pty_send(pt, line);
+      if (pty_prompt(pt, TIMEOUT))
+	goto out;
+    }
+  pty_send(pt, "wait\r");
+  if (pty_prompt(pt, TIMEOUT) == 0)
+    {
+      t = now_ns() - t0;
+      *cpu = cpu_ns(clk) - c0;
+    }
+
+ out:
+  rs->stop = 1;
+  for (k = 0; k < forked; k++)
+    waitpid(pids[k], NULL, 0);
+  pty_send(pt, "logout\r");
+  pty_close(pt, 5000);
+
+  return t;
+}
+
+/*-
+  *      Routine:      cmp_double
+  *
+  *      Purpose:
+  *              Comparación para qsort.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              <0, 0 o >0.
+  *
+  */
+int cmp_double(const void *a, const void *b)
+{
+  double x = *(double *) a, y = *(double *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+/*-
+  *      Routine:      cmp_u64
+  *
+  *      Purpose:
+  *              Comparación para qsort.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              <0, 0 o >0.
+  *
+  */
+int cmp_u64(const void *a, const void *b)
+{
+  uint64_t x = *(uint64_t *) a, y = *(uint64_t *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[])
+{
+  char *shell = "./shFSO", path[PATH_MAX], env_home[PATH_MAX + 8];
+  char dir[] = "/tmp/shfso_shm.XXXXXX";
+  char *env[3] = { "PATH=/usr/bin:/bin", env_home, NULL };
+  char *names[3] = { "base", "-m", "lectores" };
+  int njobs = 2000, rounds = 5, nread = 4, us = 1000, opt, c, r, k;
+  int fail = 0;
+  double tol = 10, med[3], cpu[3], over;
+  uint64_t *t[3], *u[3], reads = 0, retries = 0, total = 0;
+  double *d[3];
+  struct reader_stats *rs;
+
+  while ((opt = getopt(argc, argv, "S:n:r:l:i:dt:")) != -1)
+    switch (opt)
+      {
+      case 'S': shell = optarg; break;
+      case 'n': njobs = atoi(optarg); break;
+      case 'r': rounds = atoi(optarg); break;
+      case 'l': nread = atoi(optarg); break;
+      case 'i': us = atoi(optarg); break;
+      case 'd': read_done = 1; break;
+      case 't': tol = atof(optarg); break;
+      default:
+	fprintf(stderr, "Uso: %s [-S shell] [-n trabajos] [-r rondas] "
+		"[-l lectores] [-i us] [-d] [-t %%]\n", argv[0]);
+	return 2;
+      }
+
+  if (njobs < 1 || rounds < 1 || nread < 0 || nread > 64
+      || !realpath(shell, path) || !mkdtemp(dir))
+    {
+      fprintf(stderr, "shm_bench: parámetros no válidos\n");
+      return 1;
+    }
+  snprintf(env_home, sizeof(env_home), "HOME=%s", dir);
+
+  rs = mmap(NULL, sizeof(*rs), PROT_READ|PROT_WRITE,
+	    MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  for (c = 0; c < 3; c++)
+    {
+      t[c] = malloc(rounds * sizeof(*t[c]));
+      u[c] = malloc(rounds * sizeof(*u[c]));
+      d[c] = malloc(rounds * sizeof(*d[c]));
+    }
+
+  /* Las configuraciones se alternan en cada ronda para que las
+     variaciones de la máquina les afecten por igual. */
+  for (r = 0; r < rounds; r++)
+    for (c = 0; c < 3; c++)
+      {
+	t[c][r] = run(path, env, njobs, c > 0, c == 2 ? nread : 0, us, rs,
+		      &u[c][r]);
+	if (t[c][r] == 0)
+	  {
+	    fprintf(stderr, "shm_bench: el shell no completó la prueba\n");
+	    rmdir(dir);
+	    return 1;
+	  }
+	if (c == 2)
+	  {
+	    total += t[c][r];
+	    for (k = 0; k < nread; k++)
+	      {
+		reads += rs->reads[k];
+		retries += rs->retries[k];
+		rs->reads[k] = rs->retries[k] = 0;
+	      }
+	  }
+      }
+  rmdir(dir);
+
+  printf(" %d trabajos, %d rondas, %d lectores cada %d us, %ld CPUs\n",
+	 njobs, rounds, nread, us, sysconf(_SC_NPROCESSORS_ONLN));
+  for (c = 0; c < 3; c++)
+    for (r = 0; r < rounds; r++)
+      d[c][r] = 100.0 * ((double) u[c][r] - u[0][r]) / u[0][r];
+  for (c = 0; c < 3; c++)
+    {
+      qsort(t[c], rounds, sizeof(*t[c]), cmp_u64);
+      qsort(u[c], rounds, sizeof(*u[c]), cmp_u64);
+      qsort(d[c], rounds, sizeof(*d[c]), cmp_double);
+      med[c] = t[c][rounds / 2] / 1e6;
+      cpu[c] = u[c][rounds / 2] / 1e6;
+      over = d[c][rounds / 2];
+      printf("   %-9s %9.1f ms   CPU del shell %8.1f ms  %+6.1f %%",
+	     names[c], med[c], cpu[c], over);
+      if (c == 2)
+	printf("   %.0f lecturas/s, %llu reintentos",
+	       reads / (total / 1e9), (unsigned long long) retries);
+      printf("\n");
+      if (over > tol)
+	{
+	  printf("   REGRESIÓN: %s %.1f %% > %.1f %%\n", names[c], over, tol);
+	  fail = 1;
+	}
+    }
+
+  return fail;
+}
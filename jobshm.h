@@ -0,0 +1,133 @@
+/* -*- mode: C -*-
+   *
+   *       File:         jobshm.h
+   *
+   *       Formato de la tabla de trabajos que shFSO publica en memoria
+   *       compartida (opción -m), común al shell y a sus lectores.
+   *
+   */
+
+/*
+  Copyright (C) 2009, 2013 Pedro J. Ruiz López <holzplatten@es.gnu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SHFSO_JOBSHM_H
+#define SHFSO_JOBSHM_H
+
+#include <sched.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/* El segmento se llama "/shfso.<pid del shell>" (ver shm_open). */
+#define JOBSHM_PREFIX "/shfso."
+#define JOBSHM_MAGIC "SHFSOJB1"
+#define JOBSHM_SLOTS 16384     /* trabajos publicados como mucho */
+#define JOBSHM_DONE 256        /* últimos trabajos terminados */
+#define JOBSHM_NAME 32
+
+/* Un trabajo. Los tiempos son ns: 'start' y 'end' de CLOCK_REALTIME,
+   el resto, el uso de recursos que dio wait4 la última vez que el
+   shell recogió al trabajo (parado o terminado); 0 si nunca. */
+struct jobshm_job {
+  uint64_t seq;                /* orden de lanzamiento, desde 1 */
+  int32_t pid;
+  int32_t pgid;
+  char name[JOBSHM_NAME];
+  char state;                  /* 'R' en ejecución, 'T' parado,
+				  'X' terminado (sólo en done[]) */
+  char pad[3];
+  int32_t status;              /* de wait, en done[] */
+  int64_t start;
+  int64_t end;                 /* en done[] */
+  int64_t utime;
+  int64_t stime;
+  int64_t maxrss;              /* KB */
+  int64_t minflt;
+  int64_t majflt;
+  int64_t nvcsw;
+  int64_t nivcsw;
+};
+
+/* Los trabajos vivos están en job[0..n-1], sin orden: al quitar uno
+   se mueve el último a su hueco. El número de trabajo que muestra
+   'jobs' es la posición de cada uno ordenando por 'seq'.
+
+   'seq' es un seqlock: el shell lo hace impar mientras modifica el
+   segmento y lo vuelve a hacer par al acabar. Un lector copia lo que
+   necesite entre dos lecturas de 'seq' y repite si no eran iguales o
+   eran impares (ver jobshm_snapshot). */
+struct jobshm {
+  char magic[8];
+  uint32_t seq;
+  uint32_t cap;                /* JOBSHM_SLOTS */
+  int32_t shell_pid;
+  uint32_t n;                  /* trabajos en job[] */
+  uint32_t overflow;           /* trabajos vivos que no cupieron */
+  uint32_t pad;
+  uint64_t launched;           /* último 'seq' asignado */
+  uint64_t ndone;              /* terminados en total: el último está
+				  en done[(ndone-1) % JOBSHM_DONE] */
+  struct jobshm_job done[JOBSHM_DONE];
+  struct jobshm_job job[JOBSHM_SLOTS];
+};
+
+/*-
+  *      Routine:      jobshm_snapshot
+  *
+  *      Purpose:
+  *              Copia en 'dst' una vista coherente del segmento
+  *              'src': la cabecera, los trabajos vivos y, si 'done',
+  *              los terminados (si no, dst->done queda como estaba;
+  *              son 32 KB que alargan cada copia). No hace llamadas
+  *              al sistema salvo si el shell lleva un rato a medias
+  *              de una escritura (lo habrán desalojado): entonces le
+  *              cede la CPU.
+  *      Conditions:
+  *              'dst' debe ser un struct jobshm completo.
+  *      Returns:
+  *              Las veces que hubo que repetir la copia porque el
+  *              shell escribía a la vez.
+  *
+  */
+static inline int jobshm_snapshot(const struct jobshm *src,
+				  struct jobshm *dst, int done)
+{
+  uint32_t s1, n;
+  int retries = 0;
+
+  for (;; retries++)
+    {
+      s1 = __atomic_load_n(&src->seq, __ATOMIC_ACQUIRE);
+      if (s1 & 1)
+	{
+	  if (retries >= 16)
+	    sched_yield();
+	  continue;
+	}
+
+      memcpy(dst, src, done ? offsetof(struct jobshm, job)
+	     : offsetof(struct jobshm, done));
+      n = dst->n < JOBSHM_SLOTS ? dst->n : JOBSHM_SLOTS;
+      memcpy(dst->job, src->job, n * sizeof(src->job[0]));
+
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&src->seq, __ATOMIC_RELAXED) == s1)
+	return retries;
+    }
+}
+
+#endif
@@ -25,21 +25,83 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
 #include <string.h>
 #include <signal.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <fnmatch.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include <termios.h>
 
+#include "jobshm.h"
+
 #define MAXLINEA 1024  /* tamaño maximo linea comandos */
 #define MAXARG 256     /* numero maximo argumentos linea comm. */
 #define SET 1
 #define CLEAR 0
 
+#define MEMO_DIR ".shfso_memo"          /* almacén de memo bajo $HOME */
+#define MEMO_MAX (64*1024*1024)         /* tope por defecto del almacén */
+#define MEMO_ENV "PATH"                 /* variables que entran en la clave */
+
+#define EXEC_NOENT 127                 /* status de un hijo si no existe */
+#define EXEC_FAILED 126                /* ... y si no se pudo ejecutar */
+
+#define GLOB_BUF (1024*1024)           /* buffer de getdents64 */
+
+#define WATCHDOG_MS 250                /* periodo de muestreo del RSS */
+
+#define LIST_HASH 4096                 /* listas de la tabla de pids */
+
+#define MAP_CHUNK (64*1024)            /* tamaño máximo de un trozo de 'map' */
+#define MAP_MINCHUNK 4096              /* ... y mínimo, al ajustarlo a -i */
+#define MAP_DEPTH 4                    /* trozos por trabajador en la ventana */
+#define MAP_IDLE_MS 50                 /* entrada parada: enviar lo que haya */
+#define MAP_MAXJ 256                   /* trabajadores como máximo */
+
+#define COPROC_DEPTH 16                /* peticiones en vuelo por coproceso */
+
+#define LOGOUT_GRACE 500               /* ms para terminar tras SIGHUP */
+#define LOGOUT_KILL 1000               /* ms para recoger tras SIGKILL */
+#define LOGOUT_BATCH 256               /* eventos de reap_ep por espera */
+
+#define CTL_MAXCLI 64                  /* clientes del socket de control */
+#define CTL_MAXFRAME (1024*1024)       /* carga máxima de una trama */
+
+#ifndef PIDFD_SIGNAL_PROCESS_GROUP
+#define PIDFD_SIGNAL_PROCESS_GROUP (1UL << 2)
+#endif
+
+#define STATS_SUB_BITS 4                /* subintervalos por potencia de 2 */
+#define STATS_NBUCKETS ((64 - STATS_SUB_BITS + 1) << STATS_SUB_BITS)
+
+#define HIST_FILE ".shfso_history"      /* histórico bajo $HOME */
+#define HIST_TRI_BITS 16                /* log2 del número de listas de trigramas */
+#define HIST_IDX_GROW 1024              /* entradas nuevas para reescribir el índice */
+
 
 
 
@@ -54,13 +116,26 @@ typedef struct _node_t {
   int stopped;
   int fg;
   struct termios term_mode;
+  uint64_t t_launch;    /* instante del fork, hasta la primera recogida */
+  long rss_max;         /* presupuesto de memoria residente (KB), 0 = no */
+  long rss;             /* la de todo su grupo en la última pasada (KB) */
+  int rss_action;       /* SIGSTOP o SIGKILL al superarlo */
+  char reason[64];      /* motivo por el que el shell lo paró o mató */
+  int pidfd;            /* del líder del grupo, -1 si no se pudo abrir */
+  int quiet;            /* enviado por el socket de control: no se informa */
+  int mark;             /* última selección en la que entró (job_select) */
+  int shm_slot;         /* posición en jobshm->job, -1 si no está */
 
   struct _node_t *next;
+  struct _node_t *prev;
+  struct _node_t *hnext;        /* siguiente en la misma lista de la tabla hash */
 } node_t;
 
 typedef struct _list_t {
   node_t * beg;
   node_t * end;
+  node_t * hash[LIST_HASH];     /* nodos por pid */
+  int n;
 } list_t;
 
 
@@ -75,6 +150,7 @@ void list_init(list_t *);
 void list_insert(list_t *, node_t *);
 int list_remove(list_t *, node_t *);
 int list_remove_pid(list_t * , int);
+node_t * list_find_pid(list_t *, int);
 void list_print();
 int list_index(list_t *, node_t *);
 node_t * list_elem(list_t *, int);
@@ -93,6 +169,272 @@ sigset_t block_sigchld;
 
 struct termios shell_tmode;
 
+int last_status;        /* status (waitpid) del último comando en primer plano */
+
+struct {
+  long hits;
+  long misses;
+  long evicted;
+} memo_stats;
+
+struct hist_post {
+  int *ids;             /* entradas que contienen el trigrama, crecientes */
+  int n, cap;
+  unsigned char *enc;   /* si no es NULL, la lista sigue sin decodificar
+			   en hist.imap y 'ids' no vale */
+};
+
+struct {
+  int fd;
+  char *map;            /* proyección del fichero de histórico */
+  size_t len;
+  size_t scanned;       /* bytes ya incorporados al índice */
+  size_t *off;          /* posición de cada entrada en el fichero */
+  int n, cap;
+  int saved;            /* entradas que ya estaban en el índice guardado */
+  char idx[PATH_MAX + 8]; /* índice guardado junto al fichero */
+  unsigned char *imap;  /* su proyección, mientras queden listas en ella */
+  size_t ilen;
+  struct hist_post tri[1 << HIST_TRI_BITS];
+} hist = { -1 };
+
+/* Cabecera del índice guardado ('hist.idx'), en el orden de bytes de
+   la máquina. La siguen la longitud (u32) de cada una de las 1 << bits
+   listas de trigramas y su posición en el fichero (u64) y, desde
+   HIST_IDX_DATA, con 7 bits por byte (ver hist_put), las n posiciones
+   de las entradas y las listas; posiciones y entradas como diferencias
+   con la anterior. 'ino' y 'sum' permiten comprobar que el fichero de
+   histórico sigue empezando por lo que se indexó. */
+#define HIST_IDX_MAGIC "SHFSOHI1"
+
+struct hist_idx_hdr {
+  char magic[8];
+  uint64_t scanned;     /* bytes del histórico indexados */
+  uint64_t ino;         /* i-nodo del fichero de histórico */
+  uint64_t sum;         /* ver hist_sum */
+  uint32_t n;           /* entradas */
+  uint32_t bits;        /* HIST_TRI_BITS */
+};
+
+#define HIST_IDX_DATA (sizeof(struct hist_idx_hdr) \
+		       + (1 << HIST_TRI_BITS) * (sizeof(uint32_t) + sizeof(uint64_t)))
+
+struct comp_index {
+  struct comp_ent {
+    char *name;
+    uint64_t dirs;      /* directorios en los que aparece: bit i para el
+			   i-ésimo del PATH (a partir del 63 comparten
+			   bit, como los internos) */
+  } *v;                 /* ordenado por nombre */
+  int n, cap;
+};
+
+struct {
+  int ifd;              /* inotify */
+  int built;
+  struct comp_index cmds;       /* internos y ejecutables del PATH */
+  struct comp_index files;      /* entradas del directorio actual */
+  struct {
+    char *dir;
+    int wd;
+  } *path;
+  int npath;
+  char *cwd;
+  int cwd_wd;
+  int stale;            /* se perdieron eventos: reconstruir todo */
+} comp = { -1, CLEAR, { NULL }, { NULL }, NULL, 0, NULL, -1, CLEAR };
+
+char prompt[PATH_MAX + 3];
+
+/* Fases medidas por 'stats'. */
+enum { F_READ, F_TOKENIZE, F_BUILTIN, F_FORK, F_EXEC_REAP,
+       F_TERM, F_REAP, NFASES };
+
+char *fase_name[NFASES] = {
+  "read", "tokenize", "builtin", "fork", "exec_to_reap",
+  "term_handoff", "reap"
+};
+
+/* Histograma log-lineal: cada potencia de 2 se divide en
+   1 << STATS_SUB_BITS intervalos, lo que acota el error relativo
+   de los percentiles por debajo del 6%. */
+struct stats_hist {
+  uint64_t count, sum, max;
+  uint32_t bucket[STATS_NBUCKETS];
+} stats[NFASES];
+
+uint64_t fase_linea[NFASES];    /* tiempos de la línea actual */
+
+/* Límites que se aplican a los trabajos nuevos ('limit'). */
+struct limits_t {
+  rlim_t cpu;           /* segundos de CPU */
+  rlim_t as;            /* espacio de direcciones (KB) */
+  rlim_t nofile;        /* ficheros abiertos */
+  rlim_t nproc;         /* procesos del usuario */
+  long rss;             /* presupuesto de RSS para el vigilante (KB) */
+  int action;           /* SIGSTOP o SIGKILL al superarlo */
+} limits = { RLIM_INFINITY, RLIM_INFINITY, RLIM_INFINITY, RLIM_INFINITY,
+	     0, SIGSTOP };
+
+uint64_t watchdog_last;
+int watchdog_jobs;      /* trabajos en la lista con presupuesto de RSS */
+
+/* Trabajos por los que espera 'wait'. El recolector anota aquí el
+   status de cada uno conforme lo recoge. */
+struct {
+  int *pid;             /* ordenados, para la búsqueda binaria */
+  int *status;
+  char *done;
+  int n, ndone;
+  int nstop;            /* los que se pararon: ya no se esperan */
+  int first;            /* status del primero en terminar */
+  int stop;             /* status del último que se paró */
+} wait_set;
+
+volatile sig_atomic_t in_wait;  /* un interno espera y Ctrl-C lo corta */
+volatile sig_atomic_t chld_seen; /* SIGCHLD atendida desde el último prompt */
+
+/* Trabajos seleccionados por una lista de especificaciones. */
+struct job_sel {
+  node_t **v;
+  int n, cap;
+};
+
+int job_gen;            /* selección en curso, para no repetir nodos */
+
+struct rlimit nofile_orig;      /* RLIMIT_NOFILE heredado, para los hijos */
+
+/* Trozo de la entrada de 'map', en la ventana de reordenación. */
+struct map_slot {
+  int done;
+  char *out;            /* salida recibida */
+  size_t len, cap;
+};
+
+/* Trabajador de 'map': un proceso que recibe un trozo entero, con fin
+   de fichero tras él, y termina. */
+struct map_worker {
+  int pid;              /* 0 si está libre */
+  int in, out;          /* hacia su entrada y desde su salida */
+  char *wbuf;           /* el trozo */
+  size_t wlen, woff, wcap;
+  long seq;             /* número del trozo */
+};
+
+/* Coprocesos con nombre ('coproc'): N copias de un programa que
+   responden una línea por cada línea que reciben. */
+struct coproc {
+  char *name;
+  int n;
+  int rr;               /* por dónde empezar a buscar el menos cargado */
+  struct coproc_inst {
+    int pid;
+    int fd;             /* socket conectado a su entrada y su salida */
+    long q[COPROC_DEPTH];       /* peticiones pendientes, en orden */
+    int qh, qn;
+    int skip;           /* respuestas de peticiones abandonadas */
+    long served;
+    char *rbuf;         /* respuesta a medio leer */
+    size_t rlen, rcap;
+    char *wbuf;         /* peticiones pendientes de enviarle */
+    size_t wlen, woff, wcap;
+  } *v;
+  struct coproc *next;
+} *coprocs;
+
+/* Traza binaria del modo grabación (-r). Todos los campos en el
+   orden de bytes de la máquina:
+     cabecera: "SHFSOTR1", u32 número de fases, u64 instante inicial
+     registro: u64 instante en que se leyó la línea (ns desde el
+               inicio), u32 longitud, la línea (sin '\0'),
+               i32 status, u64 duración de cada fase (ns)
+*/
+#define TRACE_MAGIC "SHFSOTR1"
+
+FILE *trace;
+uint64_t trace_t0;
+
+/* Protocolo del socket de control (-s). Enteros en el orden de bytes
+   de la máquina:
+     trama: u32 longitud de la carga, u8 tipo, carga
+   Peticiones:
+     'S' línea de órdenes, sin '\0': se lanza en segundo plano con la
+         entrada, la salida y los errores en /dev/null
+     'Q' i32 pid...: estado de esos trabajos (sin pids, de todos)
+     'K' i32 señal, i32 pid...: envía la señal a esos trabajos
+   Cada trama recibe una respuesta, en el mismo orden:
+     'S' i32 pid, u32 número de trabajo (0 si ya terminó)
+     'Q' por trabajo: i32 pid, u32 número (0 si no está en la lista),
+         u8 estado ('R' en ejecución, 'T' parado, 'X' no está)
+     'K' u32 trabajos señalados
+     'E' mensaje de error
+   Se pueden enviar varias tramas seguidas sin esperar respuesta.
+   El socket sólo se atiende mientras el shell espera una orden en el
+   terminal: durante un trabajo en primer plano las peticiones esperan.
+   Por eso -s exige que la entrada del shell sea un terminal.
+*/
+struct ctl_client {
+  int fd;
+  char *in;             /* tramas recibidas aún sin procesar */
+  size_t ilen, icap;
+  char *out;            /* respuestas pendientes de enviar */
+  size_t olen, ooff, ocap;
+};
+
+struct {
+  int fd;               /* socket de escucha, -1 si no hay */
+  char *path;
+  struct ctl_client cli[CTL_MAXCLI];
+  int ncli;
+} ctl = { -1 };
+
+int launch_quiet;       /* launch_proc no informa del nuevo trabajo */
+
+/* Tabla de trabajos publicada en memoria compartida (-m, ver
+   jobshm.h). Todas las escrituras se hacen con SIGCHLD bloqueada o
+   desde su manejador, así que nunca se anidan. */
+struct jobshm *jobshm;
+node_t **jobshm_node;   /* nodo de cada posición de jobshm->job */
+char jobshm_path[32];
+struct rusage reap_ru;  /* uso de recursos del último hijo recogido */
+
+/* wait4(-1) recorre en el núcleo todos los hijos, terminen o no. Al
+   salir, con miles de trabajos terminando, logout no lo repite por
+   cada uno: espera en un epoll los pidfd de los trabajos, cada evento
+   lleva el pid del que terminó y se recoge sólo a ése. 'reap_scan'
+   obliga a recorrerlos todos si no hay epoll o algún trabajo no tiene
+   pidfd. */
+int reap_ep = -1;
+int reap_scan;
+
+struct glob_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+struct glob_dir {
+  char *path;
+  char *names;          /* nombres, uno tras otro */
+  int *off;             /* posición de cada nombre en 'names' */
+  unsigned char *type;  /* d_type de cada entrada */
+  int n, used;
+  struct glob_dir *next;
+} *glob_cache;          /* directorios leídos en la línea actual */
+
+struct glob_res {
+  char **v;
+  int n, cap;
+};
+
+char *builtins[] = {
+  "logout", "help", "cd", "jobs", "fg", "bg", "memo", "history", "stats",
+  "limit", "wait", "kill", "killall-jobs", "disown", "map", "coproc", "coreq",
+  NULL
+};
+
 
 
 /*
@@ -104,16 +446,89 @@ void init_shell();
 void set_signals(void (*) ());
 void handler_sigchld();
 void handler_sigint();
+void proc_reap();
+void proc_reap_pid(int);
+void proc_close_pidfds();
 
 void proc_info(node_t *, int status);
 void proc_update(node_t *, int status);
+int launch_proc(char **, int bg, int fd_in, int fd_out, int (*)(char **));
 
 int cmd_cd(int argc, char *argv[]);
 void cmd_jobs(int argc, char *argv[]);
 void cmd_fg(int argc, char *argv[]);
 void cmd_bg(int argc, char *argv[]);
+int cmd_memo(int argc, char *argv[], int bg);
+int cmd_limit(int argc, char *argv[], int bg);
+int cmd_wait(int argc, char *argv[]);
+void logout_jobs();
+int cmd_kill(int argc, char *argv[]);
+int cmd_killall(int argc, char *argv[]);
+void cmd_disown(int argc, char *argv[]);
+int cmd_map(int argc, char *argv[], int bg);
+int cmd_coproc(int argc, char *argv[]);
+int cmd_coreq(int argc, char *argv[]);
+void cmd_stats(int argc, char *argv[]);
+void cmd_history(int argc, char *argv[]);
+
+void hist_init();
+void hist_load();
+void hist_save();
+void hist_map();
+void hist_add(char *);
+int hist_index();
+char * hist_entry(int, int *);
+int hist_search(char *, int);
+
+int edit_line(char *, int);
+int read_key();
+void complete(char *, int, int *, int *);
+void comp_build();
+void comp_events();
+
+int expande(char *, char **, int);
+struct glob_dir * glob_read(char *);
+void glob_flush();
+void glob_match(char *, int, char *, struct glob_res *);
+
+uint64_t stats_now();
+void stats_add(int, uint64_t);
+
+int trace_open(char *);
+void trace_record(char *, uint64_t);
+
+void limit_apply();
+int watchdog_active();
+int watchdog();
+int watchdog_poll(int *);
+int fg_wait(node_t *, int *);
+
+void wait_note(int, int);
+
+int job_spec(char *, struct job_sel *);
+int job_select(char **, int, struct job_sel *);
+int job_signal(node_t *, int);
+
+int map_args(int, char **, int *, char **, char **);
+int map_run(char **);
+
+struct coproc * coproc_find(char *);
+void coproc_close(struct coproc *);
+int coproc_run(struct coproc *, FILE *);
+
+int ctl_open(char *);
+void ctl_close();
+int ctl_pollfds(struct pollfd *);
+void ctl_events(struct pollfd *);
+
+int jobshm_open();
+void jobshm_close();
+void jobshm_add(node_t *);
+void jobshm_state(node_t *, struct rusage *);
+void jobshm_del(node_t *, int *, struct rusage *);
 
 int is_nat(char *);
+int is_builtin(char *);
 
 
 
@@ -132,15 +547,20 @@ int is_nat(char *);
   */
 void proc_info(node_t *p, int status)
 {
+  if (p->quiet)
+    return;
+
   if (WIFSTOPPED(status))
     {
-      printf(" [%d] %s (pid=%d) : PARADO\n",
-	     list_index(&proc_list, p), p->name, p->pid);
+      printf(" [%d] %s (pid=%d) : PARADO%s%s\n",
+	     list_index(&proc_list, p), p->name, p->pid,
+	     *p->reason ? " - " : "", p->reason);
     }
   else
     {
-      printf(" [%d] %s (pid=%d) : TERMINADO\n",
-	     list_index(&proc_list, p), p->name, p->pid);
+      printf(" [%d] %s (pid=%d) : TERMINADO%s%s\n",
+	     list_index(&proc_list, p), p->name, p->pid,
+	     *p->reason ? " - " : "", p->reason);
     }
 }
 
@@ -158,12 +578,19 @@ void proc_info(node_t *p, int status)
   */
 void proc_update(node_t *p, int status)
 {
+  if (wait_set.n)
+    wait_note(p->pid, status);
+
   if (WIFSTOPPED(status))
     {
       p->stopped = SET;
+      if (jobshm)
+	jobshm_state(p, &reap_ru);
     }
   else
     {
+      if (jobshm)
+	jobshm_del(p, &status, &reap_ru);
       list_remove(&proc_list, p);
     }
 }
@@ -205,7 +632,8 @@ void set_signals(void (*f)())
   */
 void handler_sigint()
 {
-  printf("Para salir del shell use el comando \"logout\"\n");
+  if (!in_wait)
+    printf("Para salir del shell use el comando \"logout\"\n");
 }
 
 /*-
@@ -213,6 +641,9 @@ void handler_sigint()
   *
   *      Purpose:
   *              Manejador de la señal SIGCHLD.
+  *              Recoge todos los hijos que han cambiado de estado:
+  *              las SIGCHLD no se encolan, así que un solo aviso
+  *              puede corresponder a varias paradas o terminaciones.
   *      Conditions:
   *              none
   *      Returns:
@@ -220,27 +651,107 @@ void handler_sigint()
   *
   */
 void handler_sigchld()
+{
+  sigprocmask(SIG_BLOCK, &block_sigchld, NULL);
+  proc_reap();
+  chld_seen = SET;
+  sigprocmask(SIG_UNBLOCK, &block_sigchld, NULL);
+}
+
+/*-
+  *      Routine:      proc_reap
+  *
+  *      Purpose:
+  *              Recoge todos los hijos que han cambiado de estado.
+  *              Pregunta al núcleo por cualquier hijo y localiza su
+  *              nodo en la tabla hash. El núcleo recorre para ello
+  *              todos los hijos (ver reap_ep).
+  *      Conditions:
+  *              SIGCHLD debe estar bloqueada.
+  *      Returns:
+  *              none
+  *
+  */
+void proc_reap()
 {
   int pid, status;
-  node_t *aux, *next;
+  node_t *aux;
+  uint64_t t = stats_now();
 
-  sigprocmask(SIG_BLOCK, &block_sigchld, NULL);
-  aux = proc_list.beg;
-  while (aux)
+  while ((pid = wait4(-1, &status, WUNTRACED|WNOHANG, &reap_ru)) > 0)
     {
-      next = aux->next;
+      aux = list_find_pid(&proc_list, pid);
+      if (aux == NULL)
+	continue;
 
-      pid = waitpid(aux->pid, &status, WUNTRACED|WNOHANG);
-      if (pid == aux->pid)
+      if (aux->t_launch)
 	{
-	  proc_info(aux, status);
-	  proc_update(aux, status);
+	  stats_add(F_EXEC_REAP, t - aux->t_launch);
+	  aux->t_launch = 0;
 	}
+      proc_info(aux, status);
+      proc_update(aux, status);
+    }
+  stats_add(F_REAP, stats_now() - t);
+}
+
+/*-
+  *      Routine:      proc_reap_pid
+  *
+  *      Purpose:
+  *              Recoge, si ha cambiado de estado, sólo al hijo 'pid'.
+  *              Es la versión de proc_reap que no recorre todos los
+  *              hijos.
+  *      Conditions:
+  *              SIGCHLD debe estar bloqueada.
+  *      Returns:
+  *              none
+  *
+  */
+void proc_reap_pid(int pid)
+{
+  int status;
+  node_t *aux;
+  uint64_t t = stats_now();
 
-      aux = next;
+  if (wait4(pid, &status, WUNTRACED|WNOHANG, &reap_ru) > 0
+      && (aux = list_find_pid(&proc_list, pid)))
+    {
+      if (aux->t_launch)
+	{
+	  stats_add(F_EXEC_REAP, t - aux->t_launch);
+	  aux->t_launch = 0;
+	}
+      proc_info(aux, status);
+      proc_update(aux, status);
     }
-  sigprocmask(SIG_UNBLOCK, &block_sigchld, NULL);
-  
+  stats_add(F_REAP, stats_now() - t);
+}
+
+/*-
+  *      Routine:      proc_close_pidfds
+  *
+  *      Purpose:
+  *              Cierra, en un hijo que no va a hacer exec, sus copias
+  *              de los pidfd de los trabajos y del epoll del
+  *              recolector. O_CLOEXEC sólo los cierra en el exec:
+  *              sin esto el hijo mantendría abiertos los pidfd de
+  *              trabajos que el shell ya ha recogido.
+  *      Conditions:
+  *              Sólo en el hijo, tras el fork.
+  *      Returns:
+  *              none
+  *
+  */
+void proc_close_pidfds()
+{
+  node_t *p;
+
+  for (p = proc_list.beg; p; p = p->next)
+    if (p->pidfd != -1)
+      close(p->pidfd);
+  if (reap_ep != -1)
+    close(reap_ep);
 }
 
 /*-
@@ -256,10 +767,21 @@ void handler_sigchld()
   */
 void init_shell()
 {
+  struct sigaction sa;
+
   shell_term = STDIN_FILENO;
 
+  /* Sin terminal las órdenes se leen de stdin sin buffer, como hacen
+     otros shells: nueva_linea espera con poll y no debe quedar nada
+     leído de más (tampoco para los hijos que hereden la entrada). */
+  if (!isatty(STDIN_FILENO))
+    setvbuf(stdin, NULL, _IONBF, 0);
+
   set_signals(SIG_IGN);
-  signal(SIGCHLD, handler_sigchld);
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handler_sigchld;
+  sa.sa_flags = SA_RESTART;
+  sigaction(SIGCHLD, &sa, NULL);
 
   shell_pid = getpid();
   if (setpgid (shell_pid, shell_pid) < 0)
@@ -273,6 +795,24 @@ void init_shell()
 
   list_init(&proc_list);
 
+  hist_init();
+
+  comp.ifd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+
+  if ((reap_ep = epoll_create1(EPOLL_CLOEXEC)) == -1)
+    reap_scan = SET;
+
+  /* Un pidfd por trabajo: subir el límite blando de descriptores
+     hasta el duro. Los hijos recuperan el original (limit_apply). */
+  getrlimit(RLIMIT_NOFILE, &nofile_orig);
+  if (nofile_orig.rlim_cur < nofile_orig.rlim_max)
+    {
+      struct rlimit rl = nofile_orig;
+
+      rl.rlim_cur = rl.rlim_max;
+      setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
   sigemptyset(&block_sigchld);
   sigaddset(&block_sigchld, SIGCHLD);
 }
@@ -292,7 +832,9 @@ void show_prompt()
 {
   char *pwd = (char *) get_current_dir_name();
 
-  printf("%s> ", pwd);
+  snprintf(prompt, sizeof(prompt), "%s> ", pwd);
+  chld_seen = CLEAR;
+  printf("%s", prompt);
   free(pwd);
 }
 
@@ -305,8 +847,27 @@ int help()
   printf("   Shell para FSO 2009: hsh\n");
   printf("   ---------------------\n");
   printf("   help                   esta ayuda\n");
-  printf("   logout                 salir \n");
+  printf("   logout                 salir, terminando los trabajos que queden\n");
+  printf("   memo programa <args>   ejecuta memorizando el resultado\n");
+  printf("   history [-s texto]     muestra o busca en el histórico\n");
+  printf("   stats [-r] [-j fich]   tiempos internos del shell\n");
+  printf("   limit [opc] [programa] límites de recursos de los trabajos\n");
+  printf("   wait [-n] [-t seg] [trabajo...] espera a trabajos en segundo plano\n");
+  printf("   kill [-SEÑAL] trabajo...  envía una señal a grupos de trabajos\n");
+  printf("   killall-jobs [-SEÑAL]     envía una señal a todos los trabajos\n");
+  printf("   disown [-a] [trabajo...]  olvida trabajos sin señalarlos\n");
+  printf("   (trabajo: N, %%N, %%N-%%M, %%nombre, %%%%)\n");
+  printf("   map -j N [-i fich] [-o fich] programa <args>\n");
+  printf("                          reparte líneas entre N copias del programa\n");
+  printf("   coproc [-n N] nombre programa <args>   lanza coprocesos\n");
+  printf("   coproc [-k nombre]     lista o termina coprocesos\n");
+  printf("   coreq nombre línea     envía una petición y muestra la respuesta\n");
+  printf("   coreq -i fich nombre   envía una petición por línea del fichero\n");
   printf("   programa <args>        ejecuta el programa \n");
+  if (ctl.fd != -1)
+    printf("   (atendiendo trabajos por el socket de control %s)\n", ctl.path);
+  if (jobshm)
+    printf("   (tabla de trabajos publicada en %s)\n", jobshm_path);
   printf("\n");
 }
 
@@ -314,9 +875,20 @@ int help()
 /* lee linea de comandos de la entrada estandar */
 int nueva_linea(char * linea, int len)
 {
-	int i=0;
+	int i=0, r, timeout, acted;
+	struct pollfd pfd = { STDIN_FILENO, POLLIN };
+
+	if (isatty(STDIN_FILENO))
+		return edit_line(linea, len);
+
 	while(i<len)
 	{
+		/* Mientras no llega la entrada sigue pasando el vigilante
+		   de memoria (stdin no tiene buffer, ver init_shell). */
+		while ((timeout = watchdog_poll(&acted)) >= 0
+		       && ((r = poll(&pfd, 1, timeout)) == 0
+			   || (r == -1 && errno == EINTR)))
+			;
 		if((linea[i]=(char)fgetc(stdin))==-1)
 		{
 			perror("fgetc");
@@ -345,12 +917,10 @@ int lee_linea(char * linea, char **argumentos)
 
   if((token=strtok(linea," "))!=NULL) /* busca una palabra separada por espacios */
     {
-      argumentos[narg]=(char *)strdup(token);/* copia la palabra  */
-      narg++; /* incrementa el contador de palabras */
-      while ((token=strtok(NULL," "))!=NULL) /* busca mas palabras en la misma linea */
+      narg=expande(token,argumentos,narg);/* copia la palabra (o su expansión) */
+      while ((token=strtok(NULL," "))!=NULL && narg<MAXARG-1) /* busca mas palabras en la misma linea */
 	{
-	  argumentos[narg]=(char *)strdup(token);
-	  narg++;
+	  narg=expande(token,argumentos,narg);
 	} 
     }
   argumentos[narg]=NULL;
@@ -369,16 +939,118 @@ int libera_mem_arg(char ** argumentos, int n_arg)
 
 
 
+/*============================================================*/    
+/* ejecuta el comando interno formado por la lista "argumentos"
+   ("bg" indica si la linea terminaba en "&").
+   Devuelve -1 si no es un comando interno, 1 en el caso de
+   ejecutar el commando de finalizacion (logout) y 0 e.o.c. */
+int ejecuta_interno(char ** argumentos, int narg, int bg)
+{
+  if (strcmp(argumentos[0],"logout")==0) return 1;
+  if (strcmp(argumentos[0],"help")==0) {help(); return 0;}
+
+  if (strcmp(argumentos[0], "cd") == 0)
+    {
+      cmd_cd(narg, argumentos);
+      return 0;
+    }
+
+  if (strcmp(argumentos[0], "jobs") == 0)
+    {
+      cmd_jobs(narg, argumentos);
+      return 0;
+    }
+
+  if (strcmp(argumentos[0], "fg") == 0)
+    {
+      cmd_fg(narg, argumentos);
+      return 0;
+    }
+
+  if (strcmp(argumentos[0], "bg") == 0)
+    {
+      cmd_bg(narg, argumentos);
+      return 0;
+    }
+  
+  if (strcmp(argumentos[0], "memo") == 0)
+    {
+      cmd_memo(narg, argumentos, bg);
+      return 0;
+    }
+
+  if (strcmp(argumentos[0], "history") == 0)
+    {
+      cmd_history(narg, argumentos);
+      return 0;
+    }
+
+  if (strcmp(argumentos[0], "stats") == 0)
+    {
+      cmd_stats(narg, argumentos);
+      return 0;
+    }
+
+  if (strcmp(argumentos[0], "limit") == 0)
+    {
+      cmd_limit(narg, argumentos, bg);
+      return 0;
+    }
+
+  if (strcmp(argumentos[0], "wait") == 0)
+    {
+      cmd_wait(narg, argumentos);
+      return 0;
+    }
+
+  if (strcmp(argumentos[0], "kill") == 0)
+    {
+      cmd_kill(narg, argumentos);
+      return 0;
+    }
+
+  if (strcmp(argumentos[0], "killall-jobs") == 0)
+    {
+      cmd_killall(narg, argumentos);
+      return 0;
+    }
+
+  if (strcmp(argumentos[0], "disown") == 0)
+    {
+      cmd_disown(narg, argumentos);
+      return 0;
+    }
+
+  if (strcmp(argumentos[0], "map") == 0)
+    {
+      cmd_map(narg, argumentos, bg);
+      return 0;
+    }
+
+  if (strcmp(argumentos[0], "coproc") == 0)
+    {
+      cmd_coproc(narg, argumentos);
+      return 0;
+    }
+
+  if (strcmp(argumentos[0], "coreq") == 0)
+    {
+      cmd_coreq(narg, argumentos);
+      return 0;
+    }
+
+  return -1;
+}
+
 /*============================================================*/    
 /* ejecuta el comando formado la lista "argumentos" con 
    un numero de palabras "narg". Devuelve 1 en el caso
    de ejecutar el commando de finalizacion (logout) */
 int ejecuta_comando(char ** argumentos, int narg)
 {
-  int i, pid;
-  int status;
+  int i, ret;
   int strip_pos, bg=0;
-  node_t *new_proc;
+  uint64_t t;
   
   /* si esta vacio */
   if (narg==0) return 0;
@@ -413,33 +1085,45 @@ int ejecuta_comando(char ** argumentos, int narg)
     }
 
   /* comandos internos */
-  if (strcmp(argumentos[0],"logout")==0) return 1;
-  if (strcmp(argumentos[0],"help")==0) {help(); return 0;}
+  t = stats_now();
+  ret = ejecuta_interno(argumentos, narg, bg);
+  sigprocmask(SIG_BLOCK, &block_sigchld, NULL);
+  stats_add(F_BUILTIN, stats_now() - t);
+  sigprocmask(SIG_UNBLOCK, &block_sigchld, NULL);
+  if (ret != -1)
+    return ret;
 
-  if (strcmp(argumentos[0], "cd") == 0)
-    {
-      cmd_cd(narg, argumentos);
-      return 0;
-    }
+  launch_proc(argumentos, bg, -1, -1, NULL);
 
-  if (strcmp(argumentos[0], "jobs") == 0)
-    {
-      cmd_jobs(narg, argumentos);
-      return 0;
-    }
+  return 0;
+}
 
-  if (strcmp(argumentos[0], "fg") == 0)
-    {
-      cmd_fg(narg, argumentos);
-      return 0;
-    }
+/*-
+  *      Routine:      launch_proc
+  *
+  *      Purpose:
+  *              Lanza el programa 'argv' como un nuevo trabajo, en
+  *              su propio grupo de procesos, y lo añade a la lista
+  *              de trabajos. Si no es 'bg' le cede el terminal y
+  *              espera a que termine o se pare.
+  *              'fd_in' y 'fd_out', si no son -1, sustituyen a la
+  *              entrada y salida estándar del hijo.
+  *              Si se indica 'run', el hijo no ejecuta 'argv' sino
+  *              que termina con lo que devuelva run(argv).
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              El pid del hijo.
+  *
+  */
+int launch_proc(char **argv, int bg, int fd_in, int fd_out,
+		int (*run)(char **))
+{
+  int pid;
+  int status;
+  node_t *new_proc;
+  uint64_t t_fork, t;
 
-  if (strcmp(argumentos[0], "bg") == 0)
-    {
-      cmd_bg(narg, argumentos);
-      return 0;
-    }
-  
   /* Debido a que no podemos predecir el comportamiento del scheduler
      del SO en todo momento, tampoco podemos predecir que las rutinas
      siguientes se ejecuten antes que el proceso hijo resultante del
@@ -448,6 +1132,12 @@ int ejecuta_comando(char ** argumentos, int narg)
   */
   sigprocmask(SIG_BLOCK, &block_sigchld, NULL);
 
+  /* El hijo hereda los buffers de stdio: vaciarlos antes para que
+     lo pendiente (el prompt, por ejemplo) no salga dos veces cuando
+     el hijo sin exec (ver 'run') vuelque su salida. */
+  fflush(NULL);
+
+  t_fork = stats_now();
   pid=fork();
   switch(pid)
     {
@@ -469,22 +1159,42 @@ int ejecuta_comando(char ** argumentos, int narg)
 
       set_signals(SIG_DFL);
 
-      execvp(argumentos[0], argumentos);
+      limit_apply();
+
+      if (fd_in != -1)
+	dup2(fd_in, STDIN_FILENO);
+      if (fd_out != -1)
+	dup2(fd_out, STDOUT_FILENO);
+      /* Un trabajo silencioso tampoco escribe errores en el
+	 terminal: los de execvp saldrían encima del prompt. */
+      if (launch_quiet && fd_out != -1)
+	dup2(fd_out, STDERR_FILENO);
+
+      if (run)
+	{
+	  proc_close_pidfds();
+	  pid = run(argv);
+	  fflush(stdout);
+	  _exit(pid);
+	}
+
+      execvp(argv[0], argv);
 
       /* Este código no se debería ejecutar nunca a menos que falle
 	 la llamada a execvp, lo cual consideramos un error
 	 irrecuperable: terminar devolviendo un valor no-cero. 
+	 Como en sh, 127 si no existe y 126 si no se pudo ejecutar.
       */
       perror("execvp");
-      exit(1);
+      _exit(errno == ENOENT ? EXEC_NOENT : EXEC_FAILED);
       break;
 
     default:
       /**** Padre ****/
 
-      if (bg)
+      if (bg && !launch_quiet)
 	printf("Ejecutando... [%d] %s (pid=%d) ... en segundo plano\n",
-	       list_length(&proc_list)+1, argumentos[0], pid);
+	       list_length(&proc_list)+1, argv[0], pid);
 
       /* Salvar el modo actual del terminal. */
       tcgetattr(shell_term, &shell_tmode);
@@ -492,24 +1202,54 @@ int ejecuta_comando(char ** argumentos, int narg)
       new_proc = malloc(sizeof(node_t));
 
       new_proc->pid = pid;
-      new_proc->name = strdup(argumentos[0]);
+      new_proc->name = strdup(argv[0]);
       new_proc->term_mode = shell_tmode;
       new_proc->fg = !bg;
       new_proc->stopped = CLEAR;
+      new_proc->t_launch = t_fork;
+      new_proc->rss_max = limits.rss;
+      if (new_proc->rss_max)
+	watchdog_jobs++;
+      new_proc->rss_action = limits.action;
+      new_proc->reason[0] = '\0';
+      new_proc->pidfd = syscall(SYS_pidfd_open, pid, 0);
+      if (new_proc->pidfd == -1)
+	reap_scan = SET;
+      else if (reap_ep != -1)
+	{
+	  struct epoll_event ev = { EPOLLIN };
+
+	  ev.data.u64 = pid;
+	  if (epoll_ctl(reap_ep, EPOLL_CTL_ADD, new_proc->pidfd, &ev))
+	    reap_scan = SET;
+	}
+      new_proc->mark = 0;
+      new_proc->quiet = launch_quiet;
+      new_proc->shm_slot = -1;
 
       list_insert(&proc_list, new_proc);
+      if (jobshm)
+	jobshm_add(new_proc);
 
       /* Cada proceso en su propio grupo. */
       setpgid(pid,pid);
 
+      stats_add(F_FORK, stats_now() - t_fork);
+
       if (!bg)
 	{
 	  /* Dar el terminal al hijo. */
+	  t = stats_now();
 	  tcsetpgrp(shell_term, pid);
+	  stats_add(F_TERM, stats_now() - t);
 
-	  waitpid(pid, &status, WUNTRACED);
+	  fg_wait(new_proc, &status);
 
+	  t = stats_now();
+	  stats_add(F_EXEC_REAP, t - t_fork);
+	  new_proc->t_launch = 0;
 	  new_proc->status = status;
+	  last_status = status;
 
 	  /* Salvar el modo del terminal empleado por el hijo. */
 	  tcgetattr(shell_term, &new_proc->term_mode);
@@ -523,6 +1263,7 @@ int ejecuta_comando(char ** argumentos, int narg)
 
 	  /* Restaurar el modo del terminal para el shell. */
 	  tcsetattr(shell_term, TCSANOW, &shell_tmode);
+	  stats_add(F_TERM, stats_now() - t);
 
 	  if (WIFSTOPPED(status))
 	    proc_info(new_proc, status);
@@ -533,98 +1274,274 @@ int ejecuta_comando(char ** argumentos, int narg)
 
   sigprocmask(SIG_UNBLOCK, &block_sigchld, NULL);
 
-  return 0;
+  return pid;
 }
 
 /*============================================================*/    
 /* funcion principal */ 
 /*============================================================*/    
-main()
+main(int argc, char *argv[])
 {
   char *argumentos[MAXARG];
   int narg, i, j, status;
   int fin=0;
-  char linea[MAXLINEA];
+  char linea[MAXLINEA], copia[MAXLINEA];
+  uint64_t t, t_linea;
+  char *ctl_path = NULL;
+  int shm = CLEAR;
+
+  while ((i = getopt(argc, argv, "mr:s:")) != -1)
+    switch (i)
+      {
+      case 'r':
+	if (trace_open(optarg))
+	  exit(1);
+	break;
+      case 's':
+	ctl_path = optarg;
+	break;
+      case 'm':
+	shm = SET;
+	break;
+      default:
+	fprintf(stderr, "Uso: %s [-m] [-r traza] [-s socket]\n", argv[0]);
+	exit(1);
+      }
+
+  if (ctl_path && !isatty(STDIN_FILENO))
+    {
+      fprintf(stderr, "%s: -s necesita un terminal en la entrada\n", argv[0]);
+      exit(1);
+    }
 
   init_shell();
 
+  if (ctl_path && ctl_open(ctl_path))
+    exit(1);
+  if (shm && jobshm_open())
+    {
+      ctl_close();
+      exit(1);
+    }
+
   help(); /* muestra aviso y ayuda */
   while(!fin)  
     {
       /* escribe el prompt */
       show_prompt();
+      /* El manejador de SIGCHLD también anota fases (proc_reap). */
+      sigprocmask(SIG_BLOCK, &block_sigchld, NULL);
+      memset(fase_linea, 0, sizeof(fase_linea));
+      sigprocmask(SIG_UNBLOCK, &block_sigchld, NULL);
       /* lee la linea de comandos*/
+      t=stats_now();
       nueva_linea(linea,MAXLINEA);
+      t_linea=stats_now();
+      sigprocmask(SIG_BLOCK, &block_sigchld, NULL);
+      stats_add(F_READ, t_linea-t);
+      sigprocmask(SIG_UNBLOCK, &block_sigchld, NULL);
+      /* la guarda en el histórico */
+      hist_add(linea);
+      if (trace)
+	strcpy(copia, linea);
+      last_status=0;
       /* analiza linea de comandos y la separa en argumentos */  
+      t=stats_now();
       narg=lee_linea(linea,argumentos);
+      sigprocmask(SIG_BLOCK, &block_sigchld, NULL);
+      stats_add(F_TOKENIZE, stats_now()-t);
+      sigprocmask(SIG_UNBLOCK, &block_sigchld, NULL);
       /* ejecuta linea comandos */
       fin=ejecuta_comando(argumentos,narg);
       /* libera memoria de los argumentos */
       libera_mem_arg(argumentos, narg);
+      /* olvida los directorios leídos al expandir comodines */
+      glob_flush();
+      /* deja constancia en la traza */
+      if (trace)
+	trace_record(copia, t_linea);
     }
+  logout_jobs();
+  hist_save();
+  if (trace)
+    fclose(trace);
+  ctl_close();
+  jobshm_close();
   printf("Bye\n");
   exit(0);
 } 
 
 /*-
-  *      Routine:      cmd_jobs
+  *      Routine:      logout_reap
   *
   *      Purpose:
-  *              Implementación del comando interno 'jobs'.
-  *              Muestra en pantalla el estado de la lista de trabajos.
+  *              Recoge trabajos hasta que no quede ninguno en la
+  *              lista o se alcance 'deadline' (instante de
+  *              stats_now). Si todos tienen pidfd espera en reap_ep
+  *              y recoge sólo los que terminaron: con miles de
+  *              hijos, cada wait4(-1) los recorre todos en el núcleo.
   *      Conditions:
-  *              La lista de trabajos debe ser válida.
+  *              SIGCHLD debe estar bloqueada.
   *      Returns:
-  *              none
+  *              Los trabajos que quedan.
   *
   */
-void cmd_jobs(int argc, char *argv[])
+static int logout_reap(uint64_t deadline)
 {
-  int i, lng;
-  node_t *p;
-
-  if (argc != 1)
-    {
-      printf("ERROR: Parámetro no válido\n");
-      printf(" Sintaxis: jobs\n");
-      return;
-    }
-
-  lng = list_length(&proc_list);
-  if (lng == 0)
-    {
-      printf(" La lista de trabajos está vacía.\n");
-    }
-  else
+  struct epoll_event ev[LOGOUT_BATCH];
+  struct timespec ts;
+  uint64_t now;
+  int i, n;
+
+  if (reap_scan)
+    proc_reap();
+  while (list_length(&proc_list) && (now = stats_now()) < deadline)
     {
-      for (i=1, p=proc_list.beg;
-	   i<=lng;
-	   i++, p=p->next)
+      if (!reap_scan)
 	{
-	  printf(" [%d] %s (pid=%d) : %s\n",
-		 i, p->name, p->pid, p->stopped ? "PARADO" : "EN EJECUCIÓN");
-
+	  n = epoll_wait(reap_ep, ev, LOGOUT_BATCH,
+			 (deadline - now + 999999) / 1000000);
+	  for (i = 0; i < n; i++)
+	    proc_reap_pid(ev[i].data.u64);
+	  continue;
 	}
+      ts.tv_sec = (deadline - now) / 1000000000;
+      ts.tv_nsec = (deadline - now) % 1000000000;
+      if (sigtimedwait(&block_sigchld, NULL, &ts) == SIGCHLD)
+	proc_reap();
     }
-    
+
+  return list_length(&proc_list);
 }
+
 /*-
-  *      Routine:      cmd_cd
+  *      Routine:      logout_jobs
   *
   *      Purpose:
-  *              Implementación del cambio de directorio.
+  *              Termina los trabajos que quedan al salir del shell.
+  *              Envía SIGHUP a todos los grupos de una vez, y
+  *              SIGCONT a los que estén parados; los recoge según van
+  *              acabando durante LOGOUT_GRACE ms desde el último
+  *              envío y manda SIGKILL a los que sigan vivos. Los
+  *              trabajos no se informan uno a uno, sólo se muestra
+  *              un resumen.
   *      Conditions:
   *              none
   *      Returns:
-  *              >0 si error.
-  *              0 e.o.c.
+  *              none
   *
   */
-int cmd_cd(int argc, char *argv[])
+void logout_jobs()
 {
-  char *pwd;
+  int n, hup, kill;
+  uint64_t t;
+  node_t *p;
 
-  if (argc > 2)
+  sigprocmask(SIG_BLOCK, &block_sigchld, NULL);
+
+  n = list_length(&proc_list);
+  if (n == 0)
+    {
+      sigprocmask(SIG_UNBLOCK, &block_sigchld, NULL);
+      return;
+    }
+
+  t = stats_now();
+  for (p = proc_list.beg; p; p = p->next)
+    p->quiet = SET;
+
+  /* Anotar las paradas pendientes: a los trabajos que sigan en
+     marcha no hace falta enviarles SIGCONT. */
+  proc_reap();
+  for (p = proc_list.beg; p; p = p->next)
+    {
+      job_signal(p, SIGHUP);
+      if (p->stopped)
+	job_signal(p, SIGCONT);
+    }
+
+  /* Con un solo procesador los trabajos terminan mientras se les
+     envía la señal: el plazo cuenta desde el último envío. */
+  hup = logout_reap(stats_now() + LOGOUT_GRACE * 1000000ULL);
+
+  for (p = proc_list.beg; p; p = p->next)
+    job_signal(p, SIGKILL);
+
+  kill = logout_reap(stats_now() + LOGOUT_KILL * 1000000ULL);
+
+  printf(" logout: %d trabajos terminados en %.1f ms", n - kill,
+	 (stats_now() - t) / 1e6);
+  if (hup)
+    printf(" (%d con SIGKILL)", hup - kill);
+  printf("\n");
+
+  for (p = proc_list.beg; p; p = p->next)
+    printf(" [%d] %s (pid=%d) : NO TERMINÓ\n",
+	   list_index(&proc_list, p), p->name, p->pid);
+
+  sigprocmask(SIG_UNBLOCK, &block_sigchld, NULL);
+}
+
+/*-
+  *      Routine:      cmd_jobs
+  *
+  *      Purpose:
+  *              Implementación del comando interno 'jobs'.
+  *              Muestra en pantalla el estado de la lista de trabajos.
+  *      Conditions:
+  *              La lista de trabajos debe ser válida.
+  *      Returns:
+  *              none
+  *
+  */
+void cmd_jobs(int argc, char *argv[])
+{
+  int i, lng;
+  node_t *p;
+
+  if (argc != 1)
+    {
+      printf("ERROR: Parámetro no válido\n");
+      printf(" Sintaxis: jobs\n");
+      return;
+    }
+
+  lng = list_length(&proc_list);
+  if (lng == 0)
+    {
+      printf(" La lista de trabajos está vacía.\n");
+    }
+  else
+    {
+      for (i=1, p=proc_list.beg;
+	   i<=lng;
+	   i++, p=p->next)
+	{
+	  printf(" [%d] %s (pid=%d) : %s%s%s\n",
+		 i, p->name, p->pid, p->stopped ? "PARADO" : "EN EJECUCIÓN",
+		 *p->reason ? " - " : "", p->reason);
+
+	}
+    }
+    
+}
+/*-
+  *      Routine:      cmd_cd
+  *
+  *      Purpose:
+  *              Implementación del cambio de directorio.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              >0 si error.
+  *              0 e.o.c.
+  *
+  */
+int cmd_cd(int argc, char *argv[])
+{
+  char *pwd;
+
+  if (argc > 2)
     return 1;
 
   if (argc == 1)
@@ -633,144 +1550,5255 @@ int cmd_cd(int argc, char *argv[])
 
       printf(" Directorio actual = %s\n", pwd);
     }
-  else
+  else
+    {
+      if (chdir(argv[1]))
+	{
+	  perror("cd");
+	  return 2;
+	}
+
+      pwd = (char *) get_current_dir_name();
+
+      setenv("PWD", pwd, 1);
+      printf(" Directorio actual = %s\n", pwd);
+
+    }
+
+  free(pwd);
+}
+
+/*-
+  *      Routine:      cmd_fg
+  *
+  *      Purpose:
+  *              Pone en primer plano un proceso que se encuentra
+  *              parado o en segundo plano.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              none
+  *
+  */
+void cmd_fg(int argc, char *argv[])
+{
+  node_t *p;
+  uint64_t t;
+  struct job_sel sel = { NULL };
+  char *cur = "%%";
+
+  if (argc > 2)
+    {
+      printf(" Sintaxis: fg [trabajo]\n");
+      return;
+    }
+
+  sigprocmask(SIG_BLOCK, &block_sigchld, NULL);
+  if (job_select(argc == 2 ? argv + 1 : &cur, 1, &sel) || sel.n != 1)
+    {
+      if (sel.n > 1)
+	printf("ERROR: %s designa %d trabajos\n", argv[1], sel.n);
+
+      free(sel.v);
+      sigprocmask(SIG_UNBLOCK, &block_sigchld, NULL);
+      return;
+    }
+  p = sel.v[0];
+  free(sel.v);
+
+  t = stats_now();
+
+  /* Salvar el modo actual del terminal. */
+  tcgetattr(shell_term, &shell_tmode);
+
+  /* Restaurar el modo del terminal tal como lo dejó el hijo. */
+  tcsetattr(shell_term, TCSANOW, &p->term_mode);
+  /* Dar el terminal al hijo. */
+  tcsetpgrp(shell_term, p->pid);
+
+  stats_add(F_TERM, stats_now() - t);
+
+  p->fg = SET;
+  p->stopped = CLEAR;
+  p->reason[0] = '\0';
+  if (jobshm)
+    jobshm_state(p, NULL);
+
+  printf("Pasando... [%d] %s (pid=%d) ... a primer plano\n",
+	 list_index(&proc_list, p), p->name, p->pid);
+
+  job_signal(p, SIGCONT);
+
+  fg_wait(p, &p->status);
+
+  t = stats_now();
+
+  /* Salvar el modo del terminal empleado por el hijo. */
+  tcgetattr(shell_term, &p->term_mode);
+
+  /* Recuperar el terminal. */
+  if (tcsetpgrp(shell_term, shell_pid) == -1)
+    {
+      perror("tcsetpgrp");
+      exit(1);
+    }
+
+  /* Restaurar el modo del terminal para el shell. */
+  tcsetattr(shell_term, TCSANOW, &shell_tmode);
+
+  stats_add(F_TERM, stats_now() - t);
+
+  proc_info(p, p->status);
+  proc_update(p, p->status);
+
+  sigprocmask(SIG_UNBLOCK, &block_sigchld, NULL);
+
+}
+
+/*-
+  *      Routine:      cmd_bg
+  *
+  *      Purpose:
+  *              Pone en ejecución en segundo plano los trabajos
+  *              indicados que se encuentran parados.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              none
+  *
+  */
+void cmd_bg(int argc, char *argv[])
+{
+  int i;
+  node_t *p;
+  struct job_sel sel = { NULL };
+  char *cur = "%%";
+
+  sigprocmask(SIG_BLOCK, &block_sigchld, NULL);
+  if (argc == 1)
+    job_select(&cur, 1, &sel);
+  else
+    job_select(argv + 1, argc - 1, &sel);
+
+  for (i = 0; i < sel.n; i++)
+    {
+      p = sel.v[i];
+
+      if (!p->stopped)
+	{
+	  printf("ERROR: El trabajo [%d] ya se encuentra en segundo plano\n",
+		 list_index(&proc_list, p));
+	  continue;
+	}
+
+      p->fg = CLEAR;
+      p->stopped = CLEAR;
+      p->reason[0] = '\0';
+      if (jobshm)
+	jobshm_state(p, NULL);
+
+      printf("Pasando... [%d] %s (pid=%d) ... a segundo plano\n",
+	     list_index(&proc_list, p), p->name, p->pid);
+
+      job_signal(p, SIGCONT);
+    }
+
+  free(sel.v);
+  sigprocmask(SIG_UNBLOCK, &block_sigchld, NULL);
+}
+
+/*-
+  *      Routine:      job_add
+  *
+  *      Purpose:
+  *              Añade un trabajo a la selección si no estaba ya.
+  *      Conditions:
+  *              SIGCHLD debe estar bloqueada.
+  *      Returns:
+  *              none
+  *
+  */
+static void job_add(struct job_sel *s, node_t *p)
+{
+  if (p->mark == job_gen)
+    return;
+  p->mark = job_gen;
+
+  if (s->n == s->cap)
+    {
+      s->cap = s->cap ? 2 * s->cap : 16;
+      s->v = realloc(s->v, s->cap * sizeof(*s->v));
+    }
+  s->v[s->n++] = p;
+}
+
+/*-
+  *      Routine:      job_spec
+  *
+  *      Purpose:
+  *              Añade a la selección los trabajos que designa
+  *              'spec':
+  *                N, %N      el trabajo N
+  *                %N-%M      los trabajos N a M (también N-M)
+  *                %nombre    los trabajos cuyo programa empieza
+  *                           por 'nombre'
+  *                %%, %+     el último trabajo de la lista
+  *              Los rangos se resuelven en un único recorrido de
+  *              la lista.
+  *      Conditions:
+  *              SIGCHLD debe estar bloqueada.
+  *      Returns:
+  *              0 si designa al menos un trabajo.
+  *              -1 e.o.c.
+  *
+  */
+int job_spec(char *spec, struct job_sel *s)
+{
+  char *q = spec, *end;
+  long a, b;
+  int n = s->n;
+  size_t len;
+  node_t *p;
+
+  if (*q == '%')
+    q++;
+
+  if (*q == '\0')
+    return -1;
+
+  if (strcmp(q, "%") == 0 || strcmp(q, "+") == 0)
+    {
+      if (proc_list.end)
+	job_add(s, proc_list.end);
+    }
+  else if (isdigit(*q))
+    {
+      a = b = strtol(q, &end, 10);
+      if (*end == '-')
+	{
+	  q = end + 1 + (end[1] == '%');
+	  if (!isdigit(*q))
+	    return -1;
+	  b = strtol(q, &end, 10);
+	}
+      if (*end || a < 1 || b < a)
+	return -1;
+
+      for (p = list_elem(&proc_list, a); p && a <= b; p = p->next, a++)
+	job_add(s, p);
+    }
+  else if (*spec == '%')
+    {
+      len = strlen(q);
+      for (p = proc_list.beg; p; p = p->next)
+	if (strncmp(p->name, q, len) == 0)
+	  job_add(s, p);
+    }
+
+  return s->n > n ? 0 : -1;
+}
+
+/*-
+  *      Routine:      job_select
+  *
+  *      Purpose:
+  *              Resuelve una lista de especificaciones de trabajo
+  *              (ver job_spec). Cada trabajo aparece una sola vez
+  *              en la selección, en el orden en que se designó.
+  *      Conditions:
+  *              SIGCHLD debe estar bloqueada mientras se use la
+  *              selección. El llamante libera s->v.
+  *      Returns:
+  *              El número de especificaciones que no designan
+  *              ningún trabajo (ya notificadas).
+  *
+  */
+int job_select(char **spec, int n, struct job_sel *s)
+{
+  int i, err = 0;
+
+  job_gen++;
+  for (i = 0; i < n; i++)
+    if (job_spec(spec[i], s))
+      {
+	printf("ERROR: %s: no existe ese trabajo\n", spec[i]);
+	err++;
+      }
+
+  return err;
+}
+
+/*-
+  *      Routine:      job_signal
+  *
+  *      Purpose:
+  *              Envía una señal a todo el grupo de procesos de un
+  *              trabajo. Se emplea el pidfd del líder, que no puede
+  *              referirse a otro proceso aunque su pid se haya
+  *              reutilizado; si no lo hay o el núcleo no admite
+  *              PIDFD_SIGNAL_PROCESS_GROUP se recurre a kill().
+  *      Conditions:
+  *              SIGCHLD debe estar bloqueada.
+  *      Returns:
+  *              0 si se envió, -1 (con errno) e.o.c.
+  *
+  */
+int job_signal(node_t *p, int sig)
+{
+  if (p->pidfd != -1)
+    {
+      if (syscall(SYS_pidfd_send_signal, p->pidfd, sig, NULL,
+		  PIDFD_SIGNAL_PROCESS_GROUP) == 0)
+	return 0;
+      if (errno != EINVAL && errno != ENOSYS)
+	return -1;
+    }
+
+  return kill(-p->pid, sig);
+}
+
+/*-
+  *      Routine:      sig_num
+  *
+  *      Purpose:
+  *              Traduce un nombre (TERM, SIGTERM, term) o número de
+  *              señal.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              El número de la señal, -1 si no es válida.
+  *
+  */
+static int sig_num(char *name)
+{
+  int i;
+  const char *abbr;
+
+  if (isdigit(*name) && is_nat(name))
+    return atoi(name) < NSIG ? atoi(name) : -1;
+
+  if (strncasecmp(name, "SIG", 3) == 0)
+    name += 3;
+
+  for (i = 1; i < NSIG; i++)
+    if ((abbr = sigabbrev_np(i)) && strcasecmp(name, abbr) == 0)
+      return i;
+
+  return -1;
+}
+
+/*-
+  *      Routine:      kill_args
+  *
+  *      Purpose:
+  *              Lee la señal de kill y killall-jobs: -s señal,
+  *              -señal o SIGTERM por omisión.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              El índice del primer argumento que no es la señal
+  *              (en '*sig' la señal, -1 si no es válida).
+  *
+  */
+static int kill_args(int argc, char *argv[], int *sig)
+{
+  *sig = SIGTERM;
+
+  if (argc > 2 && strcmp(argv[1], "-s") == 0)
+    {
+      *sig = sig_num(argv[2]);
+      return 3;
+    }
+  if (argc > 1 && argv[1][0] == '-')
+    {
+      *sig = sig_num(argv[1] + 1);
+      return 2;
+    }
+
+  return 1;
+}
+
+/*-
+  *      Routine:      kill_sel
+  *
+  *      Purpose:
+  *              Envía 'sig' a los grupos de procesos de los trabajos
+  *              seleccionados, un pidfd_send_signal por trabajo (ver
+  *              job_signal). Los que estaban parados se reanudan si
+  *              la señal es SIGTERM o SIGHUP.
+  *      Conditions:
+  *              SIGCHLD debe estar bloqueada.
+  *      Returns:
+  *              El número de trabajos a los que no se pudo enviar
+  *              (ya notificados).
+  *
+  */
+static int kill_sel(struct job_sel *sel, int sig)
+{
+  int i, err = 0;
+  node_t *p;
+
+  for (i = 0; i < sel->n; i++)
+    {
+      p = sel->v[i];
+      if (job_signal(p, sig))
+	{
+	  printf("kill: [%d] %s (pid=%d): %s\n",
+		 list_index(&proc_list, p), p->name, p->pid, strerror(errno));
+	  err++;
+	}
+      else if (sig == SIGCONT)
+	{
+	  p->stopped = CLEAR;
+	  p->reason[0] = '\0';
+	  if (jobshm)
+	    jobshm_state(p, NULL);
+	}
+      else if (p->stopped && (sig == SIGTERM || sig == SIGHUP))
+	{
+	  /* Parado no atendería la señal hasta que lo reanuden. */
+	  job_signal(p, SIGCONT);
+	}
+    }
+
+  return err;
+}
+
+/*-
+  *      Routine:      cmd_kill
+  *
+  *      Purpose:
+  *              Envía una señal (SIGTERM por omisión) a los grupos
+  *              de procesos de los trabajos indicados.
+  *              kill -l lista las señales.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              El status que queda en last_status: 0 si todas las
+  *              señales se enviaron, 1 e.o.c.
+  *
+  */
+int cmd_kill(int argc, char *argv[])
+{
+  int i, sig, err;
+  struct job_sel sel = { NULL };
+
+  if (argc == 2 && strcmp(argv[1], "-l") == 0)
+    {
+      for (i = 1; i < NSIG; i++)
+	if (sigabbrev_np(i))
+	  printf("%2d) SIG%-8s%s", i, sigabbrev_np(i),
+		 i % 5 ? " " : "\n");
+      printf("\n");
+      return last_status = 0;
+    }
+
+  i = kill_args(argc, argv, &sig);
+  if (sig < 0 || i == argc)
+    {
+      printf(" Sintaxis: kill [-s señal | -señal] trabajo...\n");
+      printf("           kill -l\n");
+      return last_status = W_EXITCODE(2, 0);
+    }
+
+  sigprocmask(SIG_BLOCK, &block_sigchld, NULL);
+  err = job_select(argv + i, argc - i, &sel);
+  err += kill_sel(&sel, sig);
+  free(sel.v);
+  sigprocmask(SIG_UNBLOCK, &block_sigchld, NULL);
+
+  return last_status = W_EXITCODE(err ? 1 : 0, 0);
+}
+
+/*-
+  *      Routine:      cmd_killall
+  *
+  *      Purpose:
+  *              killall-jobs: envía una señal (SIGTERM por omisión)
+  *              a todos los trabajos de la lista, como kill con
+  *              todos ellos.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              El status que queda en last_status: 0 si todas las
+  *              señales se enviaron, 1 e.o.c.
+  *
+  */
+int cmd_killall(int argc, char *argv[])
+{
+  int sig, err;
+  struct job_sel sel = { NULL };
+  node_t *p;
+
+  if (kill_args(argc, argv, &sig) != argc || sig < 0)
+    {
+      printf(" Sintaxis: killall-jobs [-s señal | -señal]\n");
+      return last_status = W_EXITCODE(2, 0);
+    }
+
+  sigprocmask(SIG_BLOCK, &block_sigchld, NULL);
+  job_gen++;
+  for (p = proc_list.beg; p; p = p->next)
+    job_add(&sel, p);
+  err = kill_sel(&sel, sig);
+  free(sel.v);
+  sigprocmask(SIG_UNBLOCK, &block_sigchld, NULL);
+
+  return last_status = W_EXITCODE(err ? 1 : 0, 0);
+}
+
+/*-
+  *      Routine:      cmd_disown
+  *
+  *      Purpose:
+  *              Elimina de la lista los trabajos indicados (todos
+  *              con -a, el último si no se indica ninguno) sin
+  *              enviarles ninguna señal. Siguen siendo hijos del
+  *              shell, que los recogerá sin informar.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              none
+  *
+  */
+void cmd_disown(int argc, char *argv[])
+{
+  int i;
+  node_t *p;
+  struct job_sel sel = { NULL };
+  char *cur = "%%";
+
+  sigprocmask(SIG_BLOCK, &block_sigchld, NULL);
+
+  if (argc == 2 && strcmp(argv[1], "-a") == 0)
+    {
+      while (proc_list.beg)
+	{
+	  if (jobshm)
+	    jobshm_del(proc_list.beg, NULL, NULL);
+	  list_remove(&proc_list, proc_list.beg);
+	}
+    }
+  else
+    {
+      if (argc == 1)
+	job_select(&cur, 1, &sel);
+      else
+	job_select(argv + 1, argc - 1, &sel);
+
+      for (i = 0; i < sel.n; i++)
+	{
+	  p = sel.v[i];
+	  if (p->stopped)
+	    printf("AVISO: [%d] %s (pid=%d) queda parado\n",
+		   list_index(&proc_list, p), p->name, p->pid);
+	  if (jobshm)
+	    jobshm_del(p, NULL, NULL);
+	  list_remove(&proc_list, p);
+	}
+      free(sel.v);
+    }
+
+  sigprocmask(SIG_UNBLOCK, &block_sigchld, NULL);
+}
+
+/*-
+  *      Routine:      memo_key
+  *
+  *      Purpose:
+  *              Calcula la clave de una invocación: directorio
+  *              actual, argumentos, las variables de entorno
+  *              listadas en $MEMO_ENV y, para cada argumento que
+  *              nombre un fichero regular, su dispositivo, inodo,
+  *              tamaño y fecha de modificación. Deja la clave
+  *              completa en '*key' (de 'len' bytes, a liberar con
+  *              free), que se guarda en la entrada: el hash sólo
+  *              da el nombre del fichero, y dos claves distintas
+  *              pueden compartirlo.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              El hash (FNV-1a de 64 bits) de la clave.
+  *
+  */
+static uint64_t memo_hash(uint64_t h, const void *buf, size_t len)
+{
+  const unsigned char *c = buf;
+
+  while (len--)
+    {
+      h ^= *c++;
+      h *= 0x100000001b3ULL;
+    }
+
+  return h;
+}
+
+uint64_t memo_key(int argc, char *argv[], char **key, size_t *len)
+{
+  char *pwd, *vars, *var, *val;
+  struct stat st;
+  FILE *f;
+  int i;
+
+  f = open_memstream(key, len);
+
+  /* Cada campo va terminado en '\0' y los que pueden faltar llevan
+     una marca, para que dos claves distintas no se confundan. */
+  pwd = get_current_dir_name();
+  fprintf(f, "%s%c", pwd ? pwd : "", '\0');
+  free(pwd);
+
+  for (i=0; i<argc; i++)
+    {
+      fprintf(f, "%s%c", argv[i], '\0');
+
+      if (stat(argv[i], &st) == 0 && S_ISREG(st.st_mode))
+	{
+	  fputc('F', f);
+	  fwrite(&st.st_dev, sizeof(st.st_dev), 1, f);
+	  fwrite(&st.st_ino, sizeof(st.st_ino), 1, f);
+	  fwrite(&st.st_size, sizeof(st.st_size), 1, f);
+	  fwrite(&st.st_mtim, sizeof(st.st_mtim), 1, f);
+	}
+      else
+	fputc('-', f);
+    }
+
+  vars = strdup(getenv("MEMO_ENV") ? getenv("MEMO_ENV") : MEMO_ENV);
+  for (var = strtok(vars, ":"); var; var = strtok(NULL, ":"))
+    {
+      val = getenv(var);
+      fprintf(f, "%s%c", var, '\0');
+      if (val)
+	fprintf(f, "=%s%c", val, '\0');
+      else
+	fputc('-', f);
+    }
+  free(vars);
+
+  fclose(f);
+
+  return memo_hash(0xcbf29ce484222325ULL, *key, *len);
+}
+
+/*-
+  *      Routine:      memo_dir
+  *
+  *      Purpose:
+  *              Obtiene (y crea si no existe) el directorio del
+  *              almacén de memo: $MEMO_DIR o $HOME/.shfso_memo.
+  *      Conditions:
+  *              'dir' debe tener espacio para PATH_MAX caracteres.
+  *      Returns:
+  *              0 si el directorio es utilizable.
+  *              -1 e.o.c.
+  *
+  */
+int memo_dir(char *dir)
+{
+  if (getenv("MEMO_DIR"))
+    snprintf(dir, PATH_MAX, "%s", getenv("MEMO_DIR"));
+  else
+    snprintf(dir, PATH_MAX, "%s/%s",
+	     getenv("HOME") ? getenv("HOME") : ".", MEMO_DIR);
+
+  if (mkdir(dir, 0700) && errno != EEXIST)
+    {
+      perror("memo");
+      return -1;
+    }
+
+  return 0;
+}
+
+/*-
+  *      Routine:      memo_prune
+  *
+  *      Purpose:
+  *              Mantiene el almacén por debajo de $MEMO_MAX bytes
+  *              borrando las entradas usadas hace más tiempo (LRU;
+  *              cada acierto actualiza la fecha de la entrada).
+  *              Si 'nent' y 'total' no son NULL devuelve en ellos
+  *              el número de entradas y bytes que quedan.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              none
+  *
+  */
+struct memo_ent {
+  struct timespec used;
+  off_t size;
+  char name[32];
+};
+
+static int memo_ent_cmp(const void *a, const void *b)
+{
+  const struct memo_ent *x = a, *y = b;
+
+  if (x->used.tv_sec != y->used.tv_sec)
+    return x->used.tv_sec < y->used.tv_sec ? -1 : 1;
+  if (x->used.tv_nsec != y->used.tv_nsec)
+    return x->used.tv_nsec < y->used.tv_nsec ? -1 : 1;
+  return 0;
+}
+
+void memo_prune(char *dir, long *nent, long long *total)
+{
+  DIR *d;
+  struct dirent *de;
+  struct stat st;
+  struct memo_ent *ent = NULL;
+  int n = 0, cap = 0, i;
+  long long sum = 0, max;
+
+  max = getenv("MEMO_MAX") ? atoll(getenv("MEMO_MAX")) : MEMO_MAX;
+
+  if (!(d = opendir(dir)))
+    return;
+
+  while ((de = readdir(d)))
+    {
+      /* Sólo las entradas confirmadas: 16 dígitos hexadecimales. */
+      if (strlen(de->d_name) != 16
+	  || fstatat(dirfd(d), de->d_name, &st, 0)
+	  || !S_ISREG(st.st_mode))
+	continue;
+
+      if (n == cap)
+	{
+	  cap = cap ? 2*cap : 64;
+	  ent = realloc(ent, cap * sizeof(*ent));
+	}
+      ent[n].used = st.st_mtim;
+      ent[n].size = st.st_size;
+      strcpy(ent[n].name, de->d_name);
+      sum += st.st_size;
+      n++;
+    }
+
+  if (sum > max)
+    {
+      qsort(ent, n, sizeof(*ent), memo_ent_cmp);
+      for (i=0; i<n && sum > max; i++)
+	if (unlinkat(dirfd(d), ent[i].name, 0) == 0)
+	  {
+	    sum -= ent[i].size;
+	    memo_stats.evicted++;
+	  }
+      n -= i;
+    }
+
+  closedir(d);
+  free(ent);
+
+  if (nent)
+    *nent = n;
+  if (total)
+    *total = sum;
+}
+
+/*-
+  *      Routine:      memo_replay
+  *
+  *      Purpose:
+  *              Reproduce una entrada del almacén si es de la
+  *              clave 'key' (de 'len' bytes): vuelca en la salida
+  *              estándar la salida guardada y deja en last_status
+  *              el status con el que terminó. Una entrada es:
+  *                i32 status, u32 longitud de la clave, clave,
+  *                salida
+  *      Conditions:
+  *              'fd' debe estar abierto sobre una entrada.
+  *      Returns:
+  *              0 si se pudo reproducir.
+  *              -1 si no es de esa clave o no se pudo leer.
+  *
+  */
+int memo_replay(int fd, char *key, size_t len)
+{
+  char buf[65536];
+  int32_t status;
+  uint32_t klen;
+  size_t off;
+  ssize_t n;
+
+  if (read(fd, &status, sizeof(status)) != sizeof(status)
+      || read(fd, &klen, sizeof(klen)) != sizeof(klen)
+      || klen != len)
+    return -1;
+  for (off = 0; off < len; off += n)
+    {
+      n = read(fd, buf, len - off < sizeof(buf) ? len - off : sizeof(buf));
+      if (n <= 0 || memcmp(buf, key + off, n))
+	return -1;
+    }
+
+  /* Marcar la entrada como usada recientemente. */
+  futimens(fd, NULL);
+
+  fflush(stdout);
+  while ((n = read(fd, buf, sizeof(buf))) > 0)
+    write(STDOUT_FILENO, buf, n);
+
+  last_status = status;
+
+  return 0;
+}
+
+/*-
+  *      Routine:      memo_tee
+  *
+  *      Purpose:
+  *              Crea un proceso que copia lo que lea de la tubería
+  *              'pipe' en la salida estándar y en 'out'. El proceso
+  *              se desliga del shell (doble fork), por lo que el
+  *              shell no lo espera: termina al cerrarse la tubería,
+  *              y sólo entonces cierra su copia de 'sync', lo que
+  *              permite saber que ya ha volcado toda la salida.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              none
+  *
+  */
+void memo_tee(int pipe[2], int out, int sync)
+{
+  char buf[65536];
+  ssize_t n;
+  int pid;
+
+  sigprocmask(SIG_BLOCK, &block_sigchld, NULL);
+
+  pid = fork();
+  if (pid == 0)
+    {
+      if (fork() == 0)
+	{
+	  proc_close_pidfds();
+	  close(pipe[1]);
+	  while ((n = read(pipe[0], buf, sizeof(buf))) > 0)
+	    {
+	      write(STDOUT_FILENO, buf, n);
+	      write(out, buf, n);
+	    }
+	  close(out);
+	  close(sync);
+	  _exit(0);
+	}
+      _exit(0);
+    }
+
+  if (pid > 0)
+    waitpid(pid, NULL, 0);
+
+  sigprocmask(SIG_UNBLOCK, &block_sigchld, NULL);
+}
+
+/*-
+  *      Routine:      cmd_memo
+  *
+  *      Purpose:
+  *              Implementación del comando interno 'memo'.
+  *              Ejecuta un programa memorizando su salida y su
+  *              status; si ya se ejecutó con los mismos argumentos,
+  *              entorno y ficheros de entrada reproduce el resultado
+  *              guardado en vez de volver a ejecutarlo.
+  *              'memo --stats' muestra la tasa de aciertos.
+  *              No admite segundo plano ('bg'): la entrada sólo se
+  *              guarda si el shell ve terminar al programa.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              >0 si error.
+  *              0 e.o.c.
+  *
+  */
+int cmd_memo(int argc, char *argv[], int bg)
+{
+  char dir[PATH_MAX], path[PATH_MAX], tmp[PATH_MAX], *key;
+  int fd, out[2], sync[2];
+  int32_t status;
+  uint32_t klen;
+  uint64_t h;
+  size_t len;
+  long nent, total_req;
+  long long total;
+  char c;
+
+  if (argc == 2 && strcmp(argv[1], "--stats") == 0)
+    {
+      if (memo_dir(dir))
+	return 2;
+      memo_prune(dir, &nent, &total);
+      total_req = memo_stats.hits + memo_stats.misses;
+
+      printf(" Aciertos  : %ld\n", memo_stats.hits);
+      printf(" Fallos    : %ld\n", memo_stats.misses);
+      printf(" Tasa      : %.1f%%\n",
+	     total_req ? 100.0 * memo_stats.hits / total_req : 0.0);
+      printf(" Expulsadas: %ld\n", memo_stats.evicted);
+      printf(" Almacén   : %ld entradas, %lld bytes (%s)\n",
+	     nent, total, dir);
+      return 0;
+    }
+
+  if (bg)
+    {
+      printf("ERROR: memo no se puede ejecutar en segundo plano\n");
+      return 1;
+    }
+
+  if (argc < 2 || is_builtin(argv[1]))
+    {
+      printf(" Sintaxis: memo programa <args>\n");
+      printf("           memo --stats\n");
+      return 1;
+    }
+
+  if (memo_dir(dir))
+    return 2;
+
+  /* La entrada se confirma renombrando la temporal. */
+  h = memo_key(argc-1, &argv[1], &key, &len);
+  if (snprintf(path, sizeof(path), "%s/%016llx",
+	       dir, (unsigned long long) h) >= (int) sizeof(path)
+      || snprintf(tmp, sizeof(tmp), "%s/.%016llx.%d",
+		  dir, (unsigned long long) h, shell_pid) >= (int) sizeof(tmp))
+    {
+      printf("memo: %s: ruta demasiado larga\n", dir);
+      free(key);
+      return 2;
+    }
+
+  /* Acierto: reproducir. */
+  if ((fd = open(path, O_RDONLY|O_CLOEXEC)) != -1)
+    {
+      if (memo_replay(fd, key, len) == 0)
+	{
+	  memo_stats.hits++;
+	  close(fd);
+	  free(key);
+	  return 0;
+	}
+      close(fd);
+    }
+
+  /* Fallo: ejecutar por el camino normal copiando la salida
+     a una entrada temporal, que sólo se confirma (rename) si el
+     programa termina normalmente.
+  */
+  memo_stats.misses++;
+
+  fd = open(tmp, O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+  if (fd == -1)
+    {
+      perror("memo");
+      free(key);
+      return 2;
+    }
+  status = 0;
+  klen = len;
+  write(fd, &status, sizeof(status));
+  write(fd, &klen, sizeof(klen));
+  write(fd, key, len);
+  free(key);
+
+  if (pipe2(out, O_CLOEXEC) || pipe2(sync, O_CLOEXEC))
+    {
+      perror("pipe");
+      close(fd);
+      unlink(tmp);
+      return 2;
+    }
+
+  fflush(stdout);
+  memo_tee(out, fd, sync[1]);
+  close(out[0]);
+  close(sync[1]);
+
+  launch_proc(&argv[1], 0, -1, out[1], NULL);
+  close(out[1]);
+
+  if (WIFEXITED(last_status) && WEXITSTATUS(last_status) != EXEC_NOENT
+      && WEXITSTATUS(last_status) != EXEC_FAILED)
+    {
+      /* Esperar a que el tee haya volcado toda la salida. */
+      while (read(sync[0], &c, 1) > 0)
+	;
+      status = last_status;
+      pwrite(fd, &status, sizeof(status), 0);
+      if (rename(tmp, path) == 0)
+	memo_prune(dir, NULL, NULL);
+    }
+  else
+    {
+      /* Parado, muerto por una señal o no se pudo ejecutar: no se
+	 memoriza. Si está parado, el tee sigue copiando su salida
+	 hasta que termine. */
+      unlink(tmp);
+    }
+
+  close(sync[0]);
+  close(fd);
+
+  return 0;
+}
+
+/*-
+  *      Routine:      hist_init
+  *
+  *      Purpose:
+  *              Abre el fichero de histórico ($SHFSO_HISTORY o
+  *              $HOME/.shfso_history), lo proyecta en memoria y
+  *              pone al día el índice: carga el que se guardó al
+  *              salir (ver hist_save) e indexa sólo las entradas
+  *              posteriores, así que la primera búsqueda no tiene
+  *              que recorrer todo el fichero.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              none
+  *
+  */
+void hist_init()
+{
+  char path[PATH_MAX];
+
+  if (getenv("SHFSO_HISTORY"))
+    snprintf(path, sizeof(path), "%s", getenv("SHFSO_HISTORY"));
+  else
+    snprintf(path, sizeof(path), "%s/%s",
+	     getenv("HOME") ? getenv("HOME") : ".", HIST_FILE);
+
+  hist.fd = open(path, O_RDWR|O_CREAT|O_APPEND|O_CLOEXEC, 0600);
+  if (hist.fd == -1)
+    {
+      perror("history");
+      return;
+    }
+  snprintf(hist.idx, sizeof(hist.idx), "%s.idx", path);
+
+  hist_map();
+  hist_load();
+  hist_index();
+}
+
+/*-
+  *      Routine:      hist_reset
+  *
+  *      Purpose:
+  *              Vacía el índice del histórico (conserva la memoria
+  *              de las listas) para que hist_index lo reconstruya
+  *              desde el principio del fichero.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              none
+  *
+  */
+static void hist_reset()
+{
+  int i;
+
+  hist.scanned = hist.n = hist.saved = 0;
+  for (i = 0; i < (1 << HIST_TRI_BITS); i++)
+    {
+      hist.tri[i].n = 0;
+      hist.tri[i].enc = NULL;
+    }
+  if (hist.imap)
+    munmap(hist.imap, hist.ilen);
+  hist.imap = NULL;
+}
+
+/*-
+  *      Routine:      hist_map
+  *
+  *      Purpose:
+  *              Actualiza la proyección del histórico si el fichero
+  *              ha cambiado de tamaño (por este shell o por otro).
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              none
+  *
+  */
+void hist_map()
+{
+  struct stat st;
+
+  if (hist.fd == -1 || fstat(hist.fd, &st) || st.st_size == hist.len)
+    return;
+
+  if (hist.map)
+    munmap(hist.map, hist.len);
+
+  /* Si el fichero ha encogido (lo han truncado o reescrito) las
+     posiciones ya indexadas no valen: se reconstruye el índice. */
+  if (st.st_size < hist.len)
+    hist_reset();
+
+  hist.len = st.st_size;
+  hist.map = hist.len ? mmap(NULL, hist.len, PROT_READ, MAP_SHARED, hist.fd, 0)
+                      : NULL;
+  if (hist.map == MAP_FAILED)
+    {
+      perror("history");
+      hist.map = NULL;
+      hist.len = 0;
+      hist_reset();
+    }
+}
+
+/*-
+  *      Routine:      hist_sum
+  *
+  *      Purpose:
+  *              Resume la primera y la última de las 'n' primeras
+  *              entradas del histórico, las que acaban en el byte
+  *              'scanned'. Junto con el i-nodo basta para notar que
+  *              el fichero se ha reescrito o recortado sin tener que
+  *              leerlo entero.
+  *      Conditions:
+  *              0 < n, hist.off[n-1] < scanned <= hist.len
+  *      Returns:
+  *              El FNV-1a de ambas entradas.
+  *
+  */
+static uint64_t hist_sum(int n, size_t scanned)
+{
+  uint64_t h;
+
+  h = memo_hash(0xcbf29ce484222325ULL, hist.map,
+		n > 1 ? hist.off[1] : scanned);
+  return memo_hash(h, hist.map + hist.off[n-1], scanned - hist.off[n-1]);
+}
+
+/*-
+  *      Routine:      hist_get
+  *
+  *      Purpose:
+  *              Lee un entero codificado con hist_put de '*p', sin
+  *              pasar de 'end', y avanza '*p'.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              0 si se leyó, -1 si los datos se acaban antes.
+  *
+  */
+static int hist_get(unsigned char **p, unsigned char *end, uint64_t *v)
+{
+  int shift;
+
+  for (*v = 0, shift = 0; *p < end && shift < 64; shift += 7)
+    {
+      *v |= (uint64_t) (**p & 0x7f) << shift;
+      if (!(*(*p)++ & 0x80))
+	return 0;
+    }
+
+  return -1;
+}
+
+/*-
+  *      Routine:      hist_put
+  *
+  *      Purpose:
+  *              Escribe 'v' en 'f' con 7 bits por byte, el bit alto
+  *              indica que sigue otro byte.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              none
+  *
+  */
+static void hist_put(FILE *f, uint64_t v)
+{
+  while (v >= 0x80)
+    {
+      putc_unlocked(v | 0x80, f);
+      v >>= 7;
+    }
+  putc_unlocked(v, f);
+}
+
+/*-
+  *      Routine:      hist_load
+  *
+  *      Purpose:
+  *              Carga el índice guardado si corresponde al
+  *              principio del fichero de histórico actual. Si no
+  *              existe o no vale, deja el índice vacío. Sólo se
+  *              decodifican las posiciones de las entradas: cada
+  *              lista de trigramas se queda en la proyección del
+  *              fichero hasta que se use (ver hist_post_load).
+  *      Conditions:
+  *              El índice debe estar vacío.
+  *      Returns:
+  *              none
+  *
+  */
+void hist_load()
+{
+  struct hist_idx_hdr h;
+  unsigned char *c, *end;
+  uint32_t cnt;
+  uint64_t v, d, pos;
+  struct stat st;
+  int fd, i;
+
+  if ((fd = open(hist.idx, O_RDONLY|O_CLOEXEC)) == -1)
+    return;
+  if (fstat(fd, &st) || st.st_size < (off_t) HIST_IDX_DATA
+      || (hist.imap = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0))
+      == MAP_FAILED)
+    {
+      hist.imap = NULL;
+      close(fd);
+      return;
+    }
+  close(fd);
+  hist.ilen = st.st_size;
+
+  memcpy(&h, hist.imap, sizeof(h));
+  if (memcmp(h.magic, HIST_IDX_MAGIC, 8) || h.bits != HIST_TRI_BITS
+      || h.n == 0 || h.n > INT_MAX || h.scanned > hist.len
+      || hist.map[h.scanned - 1] != '\n')
+    goto bad;
+
+  /* Posiciones: diferencias con la anterior. */
+  c = hist.imap + HIST_IDX_DATA;
+  end = hist.imap + hist.ilen;
+  hist.cap = h.n;
+  hist.off = realloc(hist.off, hist.cap * sizeof(*hist.off));
+  for (i = 0, v = 0; i < h.n; i++)
+    {
+      if (hist_get(&c, end, &d) || (v += d) >= h.scanned)
+	goto bad;
+      hist.off[i] = v;
+    }
+  if (fstat(hist.fd, &st) || h.ino != st.st_ino
+      || hist_sum(h.n, h.scanned) != h.sum)
+    goto bad;
+
+  for (i = 0; i < (1 << HIST_TRI_BITS); i++)
+    {
+      memcpy(&cnt, hist.imap + sizeof(h) + i * sizeof(cnt), sizeof(cnt));
+      memcpy(&pos, hist.imap + sizeof(h) + (1 << HIST_TRI_BITS) * sizeof(cnt)
+	     + i * sizeof(pos), sizeof(pos));
+      if (cnt > h.n || (cnt && pos >= hist.ilen))
+	goto bad;
+      hist.tri[i].n = cnt;
+      hist.tri[i].enc = cnt ? hist.imap + pos : NULL;
+    }
+
+  hist.n = hist.saved = h.n;
+  hist.scanned = h.scanned;
+  return;
+
+ bad:
+  hist_reset();
+}
+
+/*-
+  *      Routine:      hist_post_load
+  *
+  *      Purpose:
+  *              Decodifica una lista de trigramas que sigue en el
+  *              índice guardado (ver hist_load).
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              0 si la lista está lista para usarse.
+  *              -1 si el índice guardado estaba dañado: hay que
+  *              reconstruirlo (hist_reset).
+  *
+  */
+static int hist_post_load(struct hist_post *p)
+{
+  unsigned char *c = p->enc;
+  uint64_t v, d;
+  int k;
+
+  if (!c)
+    return 0;
+  p->enc = NULL;
+
+  if (p->n > p->cap)
+    {
+      p->cap = p->n;
+      p->ids = realloc(p->ids, p->cap * sizeof(*p->ids));
+    }
+  for (k = 0, v = 0; k < p->n; k++)
+    {
+      if (hist_get(&c, hist.imap + hist.ilen, &d) || (v += d) >= hist.saved)
+	return -1;
+      p->ids[k] = v;
+    }
+
+  return 0;
+}
+
+/*-
+  *      Routine:      hist_save
+  *
+  *      Purpose:
+  *              Guarda el índice junto al fichero de histórico si
+  *              desde que se cargó ha crecido en al menos
+  *              HIST_IDX_GROW entradas y una octava parte: así cada
+  *              entrada cuesta en promedio una cantidad constante de
+  *              escrituras, y al arrancar sólo hay que indexar esa
+  *              parte como mucho. Se escribe en un fichero temporal
+  *              y se renombra, así que otro shell que lo cargue a
+  *              la vez lo ve entero o no lo ve.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              none
+  *
+  */
+void hist_save()
+{
+  struct hist_idx_hdr h;
+  char tmp[PATH_MAX + 32];
+  uint32_t cnt[1 << HIST_TRI_BITS];
+  uint64_t pos[1 << HIST_TRI_BITS];
+  struct hist_post *p;
+  struct stat st;
+  FILE *f;
+  int i, k, ok;
+
+  if (hist.fd == -1 || hist_index() - hist.saved < HIST_IDX_GROW
+      || hist.n - hist.saved < hist.saved / 8)
+    return;
+
+  for (i = 0; i < (1 << HIST_TRI_BITS); i++)
+    if (hist_post_load(&hist.tri[i]))
+      {
+	hist_reset();
+	hist_index();
+	break;
+      }
+
+  snprintf(tmp, sizeof(tmp), "%s.%d", hist.idx, (int) getpid());
+  if (!(f = fopen(tmp, "we")))
+    return;
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, HIST_IDX_MAGIC, 8);
+  h.scanned = hist.scanned;
+  h.sum = hist_sum(hist.n, hist.scanned);
+  if (fstat(hist.fd, &st) == 0)
+    h.ino = st.st_ino;
+  h.n = hist.n;
+  h.bits = HIST_TRI_BITS;
+
+  /* La tabla de listas se escribe al final, cuando se conocen sus
+     posiciones. */
+  fseek(f, HIST_IDX_DATA, SEEK_SET);
+  for (i = 0; i < hist.n; i++)
+    hist_put(f, hist.off[i] - (i ? hist.off[i-1] : 0));
+  for (i = 0; i < (1 << HIST_TRI_BITS); i++)
+    {
+      p = &hist.tri[i];
+      cnt[i] = p->n;
+      pos[i] = ftell(f);
+      for (k = 0; k < p->n; k++)
+	hist_put(f, p->ids[k] - (k ? p->ids[k-1] : 0));
+    }
+  rewind(f);
+  ok = fwrite(&h, sizeof(h), 1, f) == 1
+    && fwrite(cnt, sizeof(cnt), 1, f) == 1
+    && fwrite(pos, sizeof(pos), 1, f) == 1;
+
+  if (fclose(f) == 0 && ok && rename(tmp, hist.idx) == 0)
+    hist.saved = hist.n;
+  else
+    unlink(tmp);
+
+  /* Ya no queda ninguna lista en la proyección. */
+  if (hist.imap)
+    munmap(hist.imap, hist.ilen);
+  hist.imap = NULL;
+}
+
+/*-
+  *      Routine:      hist_add
+  *
+  *      Purpose:
+  *              Añade una línea al final del histórico. La línea
+  *              se escribe con una única llamada sobre un fichero
+  *              abierto en modo O_APPEND y bajo un cerrojo flock,
+  *              de modo que varios shells pueden añadir a la vez
+  *              sin mezclar entradas ni reescribir el fichero.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              none
+  *
+  */
+void hist_add(char *linea)
+{
+  struct iovec iov[2];
+
+  if (hist.fd == -1 || *linea == '\0')
+    return;
+
+  iov[0].iov_base = linea;
+  iov[0].iov_len = strlen(linea);
+  iov[1].iov_base = "\n";
+  iov[1].iov_len = 1;
+
+  flock(hist.fd, LOCK_EX);
+  writev(hist.fd, iov, 2);
+  flock(hist.fd, LOCK_UN);
+}
+
+/*-
+  *      Routine:      hist_index
+  *
+  *      Purpose:
+  *              Extiende el índice con las entradas añadidas desde
+  *              la última llamada: posición de cada entrada y, para
+  *              cada trigrama que contiene, su número de entrada en
+  *              la lista de apariciones correspondiente.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              El número de entradas del histórico.
+  *
+  */
+static unsigned hist_tri(const char *c)
+{
+  unsigned k = (unsigned char) c[0] << 16
+             | (unsigned char) c[1] << 8
+             | (unsigned char) c[2];
+
+  return (k * 2654435761u) >> (32 - HIST_TRI_BITS);
+}
+
+int hist_index()
+{
+  char *beg, *end, *c;
+  struct hist_post *p;
+  unsigned t;
+
+  hist_map();
+
+ again:
+  while (hist.scanned < hist.len)
+    {
+      beg = hist.map + hist.scanned;
+      end = memchr(beg, '\n', hist.len - hist.scanned);
+      if (!end)
+	break;   /* entrada a medio escribir */
+
+      if (hist.n == hist.cap)
+	{
+	  hist.cap = hist.cap ? 2*hist.cap : 1024;
+	  hist.off = realloc(hist.off, hist.cap * sizeof(*hist.off));
+	}
+      hist.off[hist.n] = hist.scanned;
+
+      for (c = beg; c + 3 <= end; c++)
+	{
+	  t = hist_tri(c);
+	  p = &hist.tri[t];
+	  if (hist_post_load(p))
+	    {
+	      hist_reset();
+	      goto again;
+	    }
+	  if (p->n && p->ids[p->n-1] == hist.n)
+	    continue;
+	  if (p->n == p->cap)
+	    {
+	      p->cap = p->cap ? 2*p->cap : 4;
+	      p->ids = realloc(p->ids, p->cap * sizeof(*p->ids));
+	    }
+	  p->ids[p->n++] = hist.n;
+	}
+
+      hist.n++;
+      hist.scanned = end + 1 - hist.map;
+    }
+
+  return hist.n;
+}
+
+/*-
+  *      Routine:      hist_entry
+  *
+  *      Purpose:
+  *              Obtiene la entrada 'i' del histórico.
+  *      Conditions:
+  *              0 <= i < hist.n
+  *      Returns:
+  *              Un apuntador al texto (no terminado en '\0')
+  *              y su longitud en 'len'.
+  *
+  */
+char * hist_entry(int i, int *len)
+{
+  size_t end = (i+1 < hist.n) ? hist.off[i+1] : hist.scanned;
+
+  *len = end - hist.off[i] - 1;
+  return hist.map + hist.off[i];
+}
+
+/*-
+  *      Routine:      hist_search
+  *
+  *      Purpose:
+  *              Busca hacia atrás, empezando por la entrada
+  *              anterior a 'from', una entrada que contenga 'q'.
+  *              Si 'q' tiene al menos tres caracteres sólo se
+  *              examinan las entradas de la lista de apariciones
+  *              más corta entre los trigramas de 'q'.
+  *      Conditions:
+  *              El índice debe estar al día (hist_index).
+  *      Returns:
+  *              El número de la entrada, o -1 si no hay ninguna.
+  *
+  */
+int hist_search(char *q, int from)
+{
+  struct hist_post *best = NULL, *p;
+  int qlen = strlen(q), len, lo, hi, mid, i;
+  char *e;
+
+  if (qlen >= 3)
+    {
+      for (i=0; i+3 <= qlen; i++)
+	{
+	  p = &hist.tri[hist_tri(q+i)];
+	  if (!best || p->n < best->n)
+	    best = p;
+	}
+      if (hist_post_load(best))
+	{
+	  /* Índice guardado dañado: reconstruirlo desde el fichero. */
+	  hist_reset();
+	  hist_index();
+	  return hist_search(q, from);
+	}
+
+      /* Primera aparición >= from. */
+      lo = 0;
+      hi = best->n;
+      while (lo < hi)
+	{
+	  mid = (lo + hi) / 2;
+	  if (best->ids[mid] < from)
+	    lo = mid + 1;
+	  else
+	    hi = mid;
+	}
+
+      while (lo-- > 0)
+	{
+	  e = hist_entry(best->ids[lo], &len);
+	  if (memmem(e, len, q, qlen))
+	    return best->ids[lo];
+	}
+      return -1;
+    }
+
+  for (i = from-1; i >= 0; i--)
+    {
+      e = hist_entry(i, &len);
+      if (memmem(e, len, q, qlen))
+	return i;
+    }
+
+  return -1;
+}
+
+/*-
+  *      Routine:      cmd_history
+  *
+  *      Purpose:
+  *              Implementación del comando interno 'history'.
+  *              'history [n]' muestra las últimas n entradas
+  *              (20 por defecto); 'history -s texto' muestra las
+  *              entradas que contienen el texto, de la más reciente
+  *              a la más antigua.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              none
+  *
+  */
+void cmd_history(int argc, char *argv[])
+{
+  int i, n, len;
+  char *e;
+
+  if (argc == 3 && strcmp(argv[1], "-s") == 0)
+    {
+      hist_index();
+      for (i = hist_search(argv[2], hist.n); i != -1;
+	   i = hist_search(argv[2], i))
+	{
+	  e = hist_entry(i, &len);
+	  printf(" %5d  %.*s\n", i+1, len, e);
+	}
+      return;
+    }
+
+  if (argc > 2 || (argc == 2 && !is_nat(argv[1])))
+    {
+      printf(" Sintaxis: history [n]\n");
+      printf("           history -s texto\n");
+      return;
+    }
+
+  n = argc == 2 ? atoi(argv[1]) : 20;
+  hist_index();
+  for (i = hist.n > n ? hist.n - n : 0; i < hist.n; i++)
+    {
+      e = hist_entry(i, &len);
+      printf(" %5d  %.*s\n", i+1, len, e);
+    }
+}
+
+/*-
+  *      Routine:      read_key
+  *
+  *      Purpose:
+  *              Espera a que haya una tecla en el terminal y la lee.
+  *              Mientras tanto atiende el resto de descriptores del
+  *              bucle principal (eventos inotify del índice de
+  *              completado y socket de control).
+  *      Conditions:
+  *              El terminal debe estar en modo raw.
+  *      Returns:
+  *              La tecla leída.
+  *              -1 si se llegó al final de la entrada.
+  *              -2 si la espera fue interrumpida por una señal.
+  *
+  */
+int read_key()
+{
+  struct pollfd fds[2 + 1 + CTL_MAXCLI];
+  struct timespec ts;
+  sigset_t mask;
+  unsigned char c;
+  int n, nfds, timeout;
+
+  for (;;)
+    {
+      fds[0].fd = STDIN_FILENO;
+      fds[0].events = POLLIN;
+      fds[1].fd = comp.ifd;
+      fds[1].events = POLLIN;
+      nfds = 2 + ctl_pollfds(fds + 2);
+
+      /* El vigilante de memoria sólo despierta al shell si hay
+	 algún presupuesto de RSS activo. */
+      if ((timeout = watchdog_poll(&n)) >= 0 && n)
+	return -2;      /* ha escrito: redibujar la línea */
+
+      /* Un hijo que termine después del prompt pero antes de
+	 esperar no interrumpiría la espera: SIGCHLD sólo se admite
+	 dentro de ppoll, y si ya se atendió se redibuja sin esperar. */
+      sigprocmask(SIG_BLOCK, &block_sigchld, &mask);
+      if (chld_seen)
+	n = -1, errno = EINTR;
+      else
+	{
+	  ts.tv_sec = timeout / 1000;
+	  ts.tv_nsec = (timeout % 1000) * 1000000L;
+	  n = ppoll(fds, nfds, timeout < 0 ? NULL : &ts, &mask);
+	}
+      sigprocmask(SIG_SETMASK, &mask, NULL);
+      if (n == -1)
+	{
+	  if (errno == EINTR)
+	    {
+	      chld_seen = CLEAR;
+	      return -2;
+	    }
+	  perror("poll");
+	  exit(1);
+	}
+
+      if (fds[1].revents & POLLIN)
+	comp_events();
+
+      ctl_events(fds + 2);
+
+      if (fds[0].revents & (POLLIN|POLLHUP))
+	{
+	  n = read(STDIN_FILENO, &c, 1);
+	  if (n == 1)
+	    return c;
+	  if (n == 0 || errno != EINTR)
+	    return -1;
+	  return -2;
+	}
+    }
+}
+
+/*-
+  *      Routine:      ed_refresh
+  *
+  *      Purpose:
+  *              Redibuja la línea en edición (prompt, contenido y
+  *              posición del cursor) con una única escritura.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              none
+  *
+  */
+void ed_refresh(char *pre, char *buf, int len, int pos)
+{
+  char out[2*MAXLINEA + PATH_MAX];
+  int n;
+
+  n = snprintf(out, sizeof(out), "\r%s%.*s\033[K", pre, len, buf);
+  if (len > pos)
+    n += snprintf(out+n, sizeof(out)-n, "\033[%dD", len - pos);
+  write(STDOUT_FILENO, out, n);
+}
+
+/*-
+  *      Routine:      ed_search
+  *
+  *      Purpose:
+  *              Búsqueda incremental hacia atrás en el histórico
+  *              (Ctrl-R). Cada carácter tecleado refina la búsqueda
+  *              y cada Ctrl-R adicional salta a la coincidencia
+  *              anterior. Enter acepta la entrada encontrada,
+  *              Ctrl-G cancela y cualquier otra tecla la deja en la
+  *              línea para seguir editando.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              La tecla que terminó la búsqueda (0 si se canceló).
+  *              La entrada encontrada se copia en 'buf'.
+  *
+  */
+int ed_search(char *buf, int size, int *len)
+{
+  char q[MAXLINEA], pre[MAXLINEA + 32];
+  int qlen = 0, cur, found = -1, elen, c, i;
+  char *e;
+
+  hist_index();
+  cur = hist.n;
+  q[0] = '\0';
+
+  for (;;)
+    {
+      snprintf(pre, sizeof(pre), "(buscar)`%s': ", q);
+      if (found != -1)
+	{
+	  e = hist_entry(found, &elen);
+	  if (elen > size-1)
+	    elen = size-1;
+	  memcpy(buf, e, elen);
+	  *len = elen;
+	}
+      ed_refresh(pre, buf, *len, *len);
+
+      c = read_key();
+      if (c == -2)
+	continue;
+
+      if (c == 18)              /* Ctrl-R: la anterior */
+	{
+	  if (found != -1)
+	    cur = found;
+	}
+      else if (c == 127 || c == 8)
+	{
+	  if (qlen)
+	    q[--qlen] = '\0';
+	  cur = hist.n;
+	}
+      else if (c >= 32 && c < 127 && qlen < sizeof(q)-1)
+	{
+	  q[qlen++] = c;
+	  q[qlen] = '\0';
+	  cur = found != -1 ? found+1 : hist.n;
+	}
+      else
+	return c == 7 ? 0 : c;  /* Ctrl-G cancela */
+
+      if (qlen && (i = hist_search(q, cur)) != -1)
+	found = i;
+    }
+}
+
+/*-
+  *      Routine:      edit_line
+  *
+  *      Purpose:
+  *              Editor de línea en modo raw: movimiento del cursor
+  *              (flechas, Inicio/Fin, Ctrl-A/E/B/F), borrado
+  *              (Retroceso, Supr, Ctrl-D/K/U), histórico (flechas
+  *              arriba/abajo y Ctrl-R) y completado con Tab.
+  *      Conditions:
+  *              La entrada estándar debe ser un terminal y el
+  *              prompt debe estar ya escrito.
+  *      Returns:
+  *              La longitud de la línea leída.
+  *
+  */
+int edit_line(char *linea, int size)
+{
+  struct termios raw;
+  char saved[MAXLINEA];
+  int len = 0, pos = 0, c, h, elen, savedlen = 0;
+  char *e;
+
+  fflush(stdout);
+
+  raw = shell_tmode;
+  raw.c_lflag &= ~(ICANON|ECHO|IEXTEN);
+  raw.c_iflag &= ~(ICRNL|IXON);
+  raw.c_cc[VMIN] = 1;
+  raw.c_cc[VTIME] = 0;
+  tcsetattr(shell_term, TCSADRAIN, &raw);
+
+  h = -1;              /* el índice del histórico se carga al usarlo */
+
+  for (;;)
+    {
+      c = read_key();
+
+    again:
+      switch (c)
+	{
+	case -2:                /* señal: quizá se escribió algo */
+	  ed_refresh(prompt, linea, len, pos);
+	  break;
+
+	case -1:
+	case 4:                 /* Ctrl-D */
+	  if (len == 0)
+	    {
+	      /* Fin de la entrada: equivale a "logout". */
+	      strcpy(linea, "logout");
+	      len = pos = strlen(linea);
+	      ed_refresh(prompt, linea, len, pos);
+	      goto done;
+	    }
+	  if (c == -1)
+	    goto done;
+	  if (pos < len)
+	    {
+	      memmove(linea+pos, linea+pos+1, len-pos-1);
+	      len--;
+	      ed_refresh(prompt, linea, len, pos);
+	    }
+	  break;
+
+	case '\r':
+	case '\n':
+	  goto done;
+
+	case 127:
+	case 8:
+	  if (pos > 0)
+	    {
+	      memmove(linea+pos-1, linea+pos, len-pos);
+	      pos--;
+	      len--;
+	      ed_refresh(prompt, linea, len, pos);
+	    }
+	  break;
+
+	case 1:                 /* Ctrl-A */
+	  pos = 0;
+	  ed_refresh(prompt, linea, len, pos);
+	  break;
+
+	case 5:                 /* Ctrl-E */
+	  pos = len;
+	  ed_refresh(prompt, linea, len, pos);
+	  break;
+
+	case 2:                 /* Ctrl-B */
+	  if (pos > 0)
+	    pos--;
+	  ed_refresh(prompt, linea, len, pos);
+	  break;
+
+	case 6:                 /* Ctrl-F */
+	  if (pos < len)
+	    pos++;
+	  ed_refresh(prompt, linea, len, pos);
+	  break;
+
+	case 11:                /* Ctrl-K */
+	  len = pos;
+	  ed_refresh(prompt, linea, len, pos);
+	  break;
+
+	case 21:                /* Ctrl-U */
+	  memmove(linea, linea+pos, len-pos);
+	  len -= pos;
+	  pos = 0;
+	  ed_refresh(prompt, linea, len, pos);
+	  break;
+
+	case 16:                /* Ctrl-P */
+	case 14:                /* Ctrl-N */
+	  if (h == -1)
+	    h = hist_index();
+	  if (c == 16 ? h == 0 : h >= hist.n)
+	    break;
+	  if (h == hist.n)
+	    {
+	      memcpy(saved, linea, len);
+	      savedlen = len;
+	    }
+	  h += c == 16 ? -1 : 1;
+	  if (h == hist.n)
+	    {
+	      memcpy(linea, saved, savedlen);
+	      len = savedlen;
+	    }
+	  else
+	    {
+	      e = hist_entry(h, &elen);
+	      len = elen < size-1 ? elen : size-1;
+	      memcpy(linea, e, len);
+	    }
+	  pos = len;
+	  ed_refresh(prompt, linea, len, pos);
+	  break;
+
+	case 18:                /* Ctrl-R */
+	  c = ed_search(linea, size, &len);
+	  pos = len;
+	  ed_refresh(prompt, linea, len, pos);
+	  if (c)
+	    goto again;
+	  break;
+
+	case '\t':
+	  complete(linea, size, &len, &pos);
+	  ed_refresh(prompt, linea, len, pos);
+	  break;
+
+	case 27:                /* secuencias de escape */
+	  c = read_key();
+	  if (c != '[' && c != 'O')
+	    break;
+	  c = read_key();
+	  if (c >= '0' && c <= '9')
+	    {
+	      if (read_key() != '~')
+		break;
+	      c = c == '1' || c == '7' ? 'H'
+		: c == '4' || c == '8' ? 'F'
+		: c == '3' ? 4 : 0;
+	      if (c == 4)
+		{
+		  if (pos < len)
+		    goto again;
+		  break;
+		}
+	    }
+	  c = c == 'A' ? 16 : c == 'B' ? 14
+	    : c == 'C' ? 6 : c == 'D' ? 2
+	    : c == 'H' ? 1 : c == 'F' ? 5 : 0;
+	  if (c)
+	    goto again;
+	  break;
+
+	default:
+	  if (c >= 32 && len < size-1)
+	    {
+	      memmove(linea+pos+1, linea+pos, len-pos);
+	      linea[pos++] = c;
+	      len++;
+	      if (pos == len)
+		write(STDOUT_FILENO, &linea[pos-1], 1);
+	      else
+		ed_refresh(prompt, linea, len, pos);
+	    }
+	  break;
+	}
+    }
+
+ done:
+  write(STDOUT_FILENO, "\n", 1);
+  tcsetattr(shell_term, TCSADRAIN, &shell_tmode);
+
+  linea[len] = '\0';
+  return len;
+}
+
+/*-
+  *      Routine:      comp_find
+  *
+  *      Purpose:
+  *              Busca en un índice de completado (vector ordenado)
+  *              la primera entrada mayor o igual que 'key'.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              La posición encontrada.
+  *
+  */
+int comp_find(struct comp_index *ix, char *key, int klen)
+{
+  int lo = 0, hi = ix->n, mid;
+
+  while (lo < hi)
+    {
+      mid = (lo + hi) / 2;
+      if (strncmp(ix->v[mid].name, key, klen) < 0)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+
+  return lo;
+}
+
+/*-
+  *      Routine:      comp_add
+  *
+  *      Purpose:
+  *              Añade un nombre a un índice de completado,
+  *              manteniéndolo ordenado. Si ya estaba sólo se anota
+  *              'bit' (el mismo ejecutable puede estar en varios
+  *              directorios del PATH).
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              none
+  *
+  */
+void comp_add(struct comp_index *ix, char *name, uint64_t bit)
+{
+  int i, len = strlen(name);
+
+  i = comp_find(ix, name, len + 1);
+  if (i < ix->n && strcmp(ix->v[i].name, name) == 0)
+    {
+      ix->v[i].dirs |= bit;
+      return;
+    }
+
+  if (ix->n == ix->cap)
+    {
+      ix->cap = ix->cap ? 2*ix->cap : 256;
+      ix->v = realloc(ix->v, ix->cap * sizeof(*ix->v));
+    }
+  memmove(&ix->v[i+1], &ix->v[i], (ix->n - i) * sizeof(*ix->v));
+  ix->v[i].name = strdup(name);
+  ix->v[i].dirs = bit;
+  ix->n++;
+}
+
+/*-
+  *      Routine:      comp_del
+  *
+  *      Purpose:
+  *              Quita 'bit' de un nombre de un índice de completado,
+  *              eliminándolo si no queda ninguno.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              none
+  *
+  */
+void comp_del(struct comp_index *ix, char *name, uint64_t bit)
+{
+  int i, len = strlen(name);
+
+  i = comp_find(ix, name, len + 1);
+  if (i == ix->n || strcmp(ix->v[i].name, name)
+      || (ix->v[i].dirs &= ~bit))
+    return;
+
+  free(ix->v[i].name);
+  memmove(&ix->v[i], &ix->v[i+1], (ix->n - i - 1) * sizeof(*ix->v));
+  ix->n--;
+}
+
+/*-
+  *      Routine:      comp_cmp
+  *
+  *      Purpose:
+  *              Comparación de entradas para qsort.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              <0, 0 o >0.
+  *
+  */
+static int comp_cmp(const void *a, const void *b)
+{
+  return strcmp(((struct comp_ent *) a)->name, ((struct comp_ent *) b)->name);
+}
+
+/*-
+  *      Routine:      comp_sort
+  *
+  *      Purpose:
+  *              Ordena un índice al que comp_scan ha añadido
+  *              entradas al final y funde los nombres repetidos.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              none
+  *
+  */
+void comp_sort(struct comp_index *ix)
+{
+  int i, j;
+
+  qsort(ix->v, ix->n, sizeof(*ix->v), comp_cmp);
+
+  for (i = j = 0; i < ix->n; i++)
+    if (j && strcmp(ix->v[j-1].name, ix->v[i].name) == 0)
+      {
+	ix->v[j-1].dirs |= ix->v[i].dirs;
+	free(ix->v[i].name);
+      }
+    else
+      ix->v[j++] = ix->v[i];
+  ix->n = j;
+}
+
+/*-
+  *      Routine:      comp_exec
+  *
+  *      Purpose:
+  *              Indica si 'name' en el directorio 'dir' es un
+  *              ejecutable (y no un directorio).
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              1 si lo es, 0 e.o.c.
+  *
+  */
+int comp_exec(int dir, char *name)
+{
+  struct stat st;
+
+  return fstatat(dir, name, &st, 0) == 0 && !S_ISDIR(st.st_mode)
+    && faccessat(dir, name, X_OK, 0) == 0;
+}
+
+/*-
+  *      Routine:      comp_scan
+  *
+  *      Purpose:
+  *              Añade a un índice de completado las entradas de un
+  *              directorio. Si 'exec' sólo se añaden los ejecutables.
+  *              Las entradas se añaden al final, sin ordenar: hay
+  *              que llamar a comp_sort después (una sola vez si se
+  *              leen varios directorios).
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              0 si se pudo leer el directorio.
+  *              -1 e.o.c.
+  *
+  */
+int comp_scan(struct comp_index *ix, char *dir, int exec, uint64_t bit)
+{
+  DIR *d;
+  struct dirent *de;
+
+  if (!(d = opendir(dir)))
+    return -1;
+
+  while ((de = readdir(d)))
+    {
+      if (de->d_name[0] == '.'
+	  && (!de->d_name[1] || (de->d_name[1] == '.' && !de->d_name[2])))
+	continue;
+      if (exec && (de->d_type == DT_DIR
+		   || (de->d_type == DT_UNKNOWN || de->d_type == DT_LNK
+		       ? !comp_exec(dirfd(d), de->d_name)
+		       : faccessat(dirfd(d), de->d_name, X_OK, 0))))
+	continue;
+
+      if (ix->n == ix->cap)
+	{
+	  ix->cap = ix->cap ? 2*ix->cap : 256;
+	  ix->v = realloc(ix->v, ix->cap * sizeof(*ix->v));
+	}
+      ix->v[ix->n].name = strdup(de->d_name);
+      ix->v[ix->n].dirs = bit;
+      ix->n++;
+    }
+
+  closedir(d);
+
+  return 0;
+}
+
+/*-
+  *      Routine:      comp_watch
+  *
+  *      Purpose:
+  *              Vigila con inotify las altas, bajas y cambios de
+  *              permisos de un directorio indexado para mantener su
+  *              índice al día.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              El descriptor de vigilancia, o -1.
+  *
+  */
+int comp_watch(char *dir)
+{
+  if (comp.ifd == -1)
+    return -1;
+
+  return inotify_add_watch(comp.ifd, dir,
+			   IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO
+			   |IN_ATTRIB|IN_ONLYDIR);
+}
+
+/*-
+  *      Routine:      comp_path_bit
+  *
+  *      Purpose:
+  *              El bit de comp_ent.dirs del i-ésimo directorio del
+  *              PATH.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              El bit.
+  *
+  */
+static uint64_t comp_path_bit(int i)
+{
+  return 1ULL << (i < 63 ? i : 63);
+}
+
+/*-
+  *      Routine:      comp_build
+  *
+  *      Purpose:
+  *              Construye (la primera vez) los índices de completado:
+  *              comandos internos y ejecutables del PATH, y entradas
+  *              del directorio actual. Después sólo se reconstruye
+  *              el del directorio actual si éste cambia; el resto de
+  *              cambios llega incrementalmente por inotify. Si se
+  *              perdieron eventos (la cola de inotify se desbordó)
+  *              se reconstruyen los dos.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              none
+  *
+  */
+void comp_build()
+{
+  char *path, *dir, *pwd;
+  char **b;
+  int i;
+
+  comp_events();
+
+  if (comp.stale)
+    {
+      for (i=0; i<comp.cmds.n; i++)
+	free(comp.cmds.v[i].name);
+      comp.cmds.n = 0;
+      for (i=0; i<comp.npath; i++)
+	comp_scan(&comp.cmds, comp.path[i].dir, 1, comp_path_bit(i));
+      comp_sort(&comp.cmds);
+      for (b = builtins; *b; b++)
+	comp_add(&comp.cmds, *b, comp_path_bit(63));
+
+      free(comp.cwd);
+      comp.cwd = NULL;
+      comp.stale = CLEAR;
+    }
+
+  if (!comp.built)
+    {
+      path = strdup(getenv("PATH") ? getenv("PATH") : "/bin:/usr/bin");
+      for (dir = strtok(path, ":"); dir; dir = strtok(NULL, ":"))
+	{
+	  comp.path = realloc(comp.path, (comp.npath+1) * sizeof(*comp.path));
+	  comp.path[comp.npath].dir = strdup(dir);
+	  comp_scan(&comp.cmds, dir, 1, comp_path_bit(comp.npath));
+	  comp.path[comp.npath].wd = comp_watch(dir);
+	  comp.npath++;
+	}
+      free(path);
+      comp_sort(&comp.cmds);
+      for (b = builtins; *b; b++)
+	comp_add(&comp.cmds, *b, comp_path_bit(63));
+
+      comp.built = SET;
+    }
+
+  pwd = get_current_dir_name();
+  if (!comp.cwd || strcmp(comp.cwd, pwd))
+    {
+      if (comp.cwd_wd != -1)
+	{
+	  /* Si el directorio está también en el PATH se comparte
+	     la vigilancia: no retirarla. */
+	  for (i=0; i<comp.npath && comp.path[i].wd != comp.cwd_wd; i++)
+	    ;
+	  if (i == comp.npath)
+	    inotify_rm_watch(comp.ifd, comp.cwd_wd);
+	}
+      for (i=0; i<comp.files.n; i++)
+	free(comp.files.v[i].name);
+      comp.files.n = 0;
+
+      free(comp.cwd);
+      comp.cwd = pwd;
+      comp_scan(&comp.files, pwd, 0, 1);
+      comp_sort(&comp.files);
+      comp.cwd_wd = comp_watch(pwd);
+    }
+  else
+    free(pwd);
+}
+
+/*-
+  *      Routine:      comp_events
+  *
+  *      Purpose:
+  *              Aplica a los índices de completado los eventos
+  *              inotify pendientes: altas y bajas de ficheros en
+  *              los directorios del PATH y en el directorio actual,
+  *              y cambios de permisos en los del PATH (un chmod +x
+  *              o -x). Si la cola se desbordó se marca todo para
+  *              reconstruir (ver comp_build).
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              none
+  *
+  */
+void comp_events()
+{
+  char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  struct inotify_event *ev;
+  char path[PATH_MAX];
+  ssize_t n;
+  char *c;
+  int i;
+
+  if (comp.ifd == -1)
+    return;
+
+  while ((n = read(comp.ifd, buf, sizeof(buf))) > 0)
+    for (c = buf; c < buf + n; c += sizeof(*ev) + ev->len)
+      {
+	ev = (struct inotify_event *) c;
+	if (ev->mask & IN_Q_OVERFLOW)
+	  comp.stale = SET;
+	if (!ev->len || comp.stale)
+	  continue;
+
+	if (ev->wd == comp.cwd_wd && !(ev->mask & IN_ATTRIB))
+	  {
+	    if (ev->mask & (IN_CREATE|IN_MOVED_TO))
+	      comp_add(&comp.files, ev->name, 1);
+	    else
+	      comp_del(&comp.files, ev->name, 1);
+	  }
+
+	for (i=0; i<comp.npath; i++)
+	  if (ev->wd == comp.path[i].wd)
+	    {
+	      /* Al crearlo puede no ser aún ejecutable: el chmod
+		 llegará como IN_ATTRIB. */
+	      if (ev->mask & (IN_CREATE|IN_MOVED_TO|IN_ATTRIB)
+		  && !(ev->mask & IN_ISDIR)
+		  && snprintf(path, sizeof(path), "%s/%s", comp.path[i].dir,
+			      ev->name) < sizeof(path)
+		  && comp_exec(AT_FDCWD, path))
+		comp_add(&comp.cmds, ev->name, comp_path_bit(i));
+	      else
+		comp_del(&comp.cmds, ev->name, comp_path_bit(i));
+	    }
+      }
+}
+
+/*-
+  *      Routine:      complete
+  *
+  *      Purpose:
+  *              Completa la palabra que hay antes del cursor: como
+  *              comando si es la primera de un comando, como número
+  *              de trabajo si empieza por '%' y como fichero en
+  *              otro caso. Si hay varias posibilidades se completa
+  *              su prefijo común y, si no hay nada que añadir, se
+  *              muestran.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              none
+  *
+  */
+void complete(char *linea, int size, int *len, int *pos)
+{
+  struct comp_index tmp = { NULL, 0, 0 }, *ix;
+  char word[MAXLINEA], dir[MAXLINEA], num[16], path[PATH_MAX], *base;
+  int beg, i, lo, hi, blen, n, job = CLEAR;
+  struct stat st;
+  node_t *p;
+
+  for (beg = *pos; beg > 0 && linea[beg-1] != ' '; beg--)
+    ;
+  snprintf(word, sizeof(word), "%.*s", *pos - beg, linea + beg);
+
+  for (i = beg; i > 0 && linea[i-1] == ' '; i--)
+    ;
+
+  comp_build();
+
+  base = word;
+  if (word[0] == '%')
+    {
+      /* Números de trabajo. */
+      job = SET;
+      base = word + 1;
+      for (i=1, p=proc_list.beg; p; i++, p=p->next)
+	{
+	  snprintf(num, sizeof(num), "%d", i);
+	  comp_add(&tmp, num, 1);
+	}
+      ix = &tmp;
+    }
+  else if (strchr(word, '/'))
+    {
+      /* Fuera del directorio actual: no está indexado, se lee. */
+      base = strrchr(word, '/') + 1;
+      snprintf(dir, sizeof(dir), "%.*s", (int) (base - word), word);
+      comp_scan(&tmp, dir, 0, 1);
+      comp_sort(&tmp);
+      ix = &tmp;
+    }
+  else if (i == 0 || linea[i-1] == ';')
+    ix = &comp.cmds;
+  else
+    ix = &comp.files;
+
+  blen = strlen(base);
+  lo = comp_find(ix, base, blen);
+  for (hi = lo; hi < ix->n && strncmp(ix->v[hi].name, base, blen) == 0; hi++)
+    ;
+
+  if (hi > lo)
+    {
+      /* Prefijo común: basta comparar la primera y la última. */
+      for (n = blen;
+	   ix->v[lo].name[n] && ix->v[lo].name[n] == ix->v[hi-1].name[n];
+	   n++)
+	;
+      n -= blen;
+
+      if (n == 0 && hi - lo > 1)
+	{
+	  printf("\n");
+	  for (i = lo; i < hi && i < lo + 100; i++)
+	    printf("%s%s", ix->v[i].name, i+1 < hi ? "  " : "\n");
+	  if (hi - lo > 100)
+	    printf("... (%d posibilidades)\n", hi - lo);
+	  fflush(stdout);
+	}
+
+      if (*len + n + 1 < size)
+	{
+	  memmove(linea + *pos + n, linea + *pos, *len - *pos);
+	  memcpy(linea + *pos, ix->v[lo].name + blen, n);
+	  *len += n;
+	  *pos += n;
+
+	  /* Única posibilidad: cerrar la palabra ('/' si es un
+	     directorio, para poder seguir completando dentro). */
+	  if (hi - lo == 1)
+	    {
+	      snprintf(path, sizeof(path), "%.*s", *pos - beg, linea + beg);
+	      memmove(linea + *pos + 1, linea + *pos, *len - *pos);
+	      linea[(*pos)++] = ix != &comp.cmds && !job
+		&& stat(path, &st) == 0 && S_ISDIR(st.st_mode) ? '/' : ' ';
+	      (*len)++;
+	    }
+	}
+    }
+
+  for (i=0; i<tmp.n; i++)
+    free(tmp.v[i].name);
+  free(tmp.v);
+}
+
+/*-
+  *      Routine:      glob_read
+  *
+  *      Purpose:
+  *              Obtiene el listado de un directorio, leyéndolo con
+  *              getdents64 sólo la primera vez que se pide durante
+  *              la línea de comandos actual; las siguientes se
+  *              sirven de la caché (ver glob_flush).
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              El listado, o NULL si no se pudo leer.
+  *
+  */
+struct glob_dir * glob_read(char *path)
+{
+  struct glob_dir *d;
+  struct glob_dirent64 *de;
+  char *buf;
+  long n, i;
+  int fd, len, cap = 0, acap = 0;
+
+  for (d = glob_cache; d; d = d->next)
+    if (strcmp(d->path, path) == 0)
+      return d;
+
+  fd = open(*path ? path : ".", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+  if (fd == -1)
+    return NULL;
+
+  d = calloc(1, sizeof(*d));
+  d->path = strdup(path);
+  buf = malloc(GLOB_BUF);
+
+  while ((n = syscall(SYS_getdents64, fd, buf, GLOB_BUF)) > 0)
+    for (i = 0; i < n; i += de->d_reclen)
+      {
+	de = (struct glob_dirent64 *) (buf + i);
+	if (de->d_name[0] == '.'
+	    && (!de->d_name[1] || (de->d_name[1] == '.' && !de->d_name[2])))
+	  continue;
+
+	len = strlen(de->d_name) + 1;
+	if (d->used + len > acap)
+	  {
+	    acap = acap ? 2*acap : GLOB_BUF;
+	    if (acap < d->used + len)
+	      acap = d->used + len;
+	    d->names = realloc(d->names, acap);
+	  }
+	if (d->n == cap)
+	  {
+	    cap = cap ? 2*cap : 256;
+	    d->off = realloc(d->off, cap * sizeof(*d->off));
+	    d->type = realloc(d->type, cap);
+	  }
+	memcpy(d->names + d->used, de->d_name, len);
+	d->off[d->n] = d->used;
+	d->type[d->n] = de->d_type;
+	d->used += len;
+	d->n++;
+      }
+
+  free(buf);
+  close(fd);
+
+  d->next = glob_cache;
+  glob_cache = d;
+
+  return d;
+}
+
+/*-
+  *      Routine:      glob_flush
+  *
+  *      Purpose:
+  *              Vacía la caché de directorios de glob_read. Se
+  *              llama al terminar cada línea de comandos, porque los
+  *              comandos ejecutados pueden haber cambiado los
+  *              directorios.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              none
+  *
+  */
+void glob_flush()
+{
+  struct glob_dir *d;
+
+  while ((d = glob_cache))
+    {
+      glob_cache = d->next;
+      free(d->path);
+      free(d->names);
+      free(d->off);
+      free(d->type);
+      free(d);
+    }
+}
+
+/*-
+  *      Routine:      glob_match
+  *
+  *      Purpose:
+  *              Expande recursivamente el patrón 'pat' (ruta a
+  *              partir del prefijo ya resuelto 'pre'), componente a
+  *              componente. Los componentes sin comodines no se
+  *              buscan en el directorio; sólo se comprueba que
+  *              existan al final.
+  *      Conditions:
+  *              'pre' debe tener espacio para PATH_MAX caracteres.
+  *      Returns:
+  *              none
+  *
+  */
+static int has_glob(char *c, int len)
+{
+  while (len-- > 0)
+    if (strchr("*?[", *c++))
+      return 1;
+
+  return 0;
+}
+
+static void glob_add(struct glob_res *r, char *path)
+{
+  if (r->n == r->cap)
+    {
+      r->cap = r->cap ? 2*r->cap : 64;
+      r->v = realloc(r->v, r->cap * sizeof(*r->v));
+    }
+  r->v[r->n++] = strdup(path);
+}
+
+void glob_match(char *pre, int plen, char *pat, struct glob_res *r)
+{
+  struct glob_dir *d;
+  struct stat st;
+  char comp[NAME_MAX+1], *name, *slash;
+  int clen, i, last, nlen;
+
+  /* Separadores iniciales. */
+  while (*pat == '/')
+    {
+      if (plen < PATH_MAX-1)
+	pre[plen++] = '/';
+      pat++;
+    }
+  pre[plen] = '\0';
+
+  if (*pat == '\0')
+    {
+      if (lstat(pre, &st) == 0)
+	glob_add(r, pre);
+      return;
+    }
+
+  slash = strchr(pat, '/');
+  clen = slash ? slash - pat : strlen(pat);
+  last = !slash;
+
+  if (clen > NAME_MAX)
+    return;
+
+  if (!has_glob(pat, clen))
+    {
+      if (plen + clen >= PATH_MAX)
+	return;
+      memcpy(pre + plen, pat, clen);
+      glob_match(pre, plen + clen, pat + clen, r);
+      pre[plen] = '\0';
+      return;
+    }
+
+  memcpy(comp, pat, clen);
+  comp[clen] = '\0';
+
+  if (!(d = glob_read(pre)))
+    return;
+
+  for (i = 0; i < d->n; i++)
+    {
+      name = d->names + d->off[i];
+      if (fnmatch(comp, name, FNM_PERIOD))
+	continue;
+
+      nlen = strlen(name);
+      if (plen + nlen >= PATH_MAX)
+	continue;
+      memcpy(pre + plen, name, nlen + 1);
+
+      if (last)
+	glob_add(r, pre);
+      else if (d->type[i] == DT_DIR || d->type[i] == DT_LNK
+	       || d->type[i] == DT_UNKNOWN)
+	glob_match(pre, plen + nlen, pat + clen, r);
+    }
+  pre[plen] = '\0';
+}
+
+/*-
+  *      Routine:      expande
+  *
+  *      Purpose:
+  *              Añade la palabra 'token' a la lista de argumentos a
+  *              partir de la posición 'narg', sustituyéndola por
+  *              los nombres de fichero que casan con ella (en orden
+  *              alfabético) si contiene comodines '*', '?' o '[...]'.
+  *              Si no casa ninguno se deja la palabra tal cual.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              El nuevo número de argumentos.
+  *
+  */
+static int glob_cmp(const void *a, const void *b)
+{
+  return strcmp(*(char **) a, *(char **) b);
+}
+
+int expande(char *token, char **argumentos, int narg)
+{
+  struct glob_res r = { NULL, 0, 0 };
+  char pre[PATH_MAX];
+  int i;
+
+  if (has_glob(token, strlen(token)))
+    glob_match(pre, 0, token, &r);
+
+  if (r.n == 0)
+    {
+      argumentos[narg++] = strdup(token);
+      return narg;
+    }
+
+  qsort(r.v, r.n, sizeof(*r.v), glob_cmp);
+
+  for (i = 0; i < r.n && narg < MAXARG-1; i++)
+    argumentos[narg++] = r.v[i];
+
+  if (i < r.n)
+    printf("AVISO: %s: demasiados argumentos, se descartan %d\n",
+	   token, r.n - i);
+  for (; i < r.n; i++)
+    free(r.v[i]);
+  free(r.v);
+
+  return narg;
+}
+
+/*-
+  *      Routine:      stats_now
+  *
+  *      Purpose:
+  *              Lee el reloj monótono.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              El instante actual en nanosegundos.
+  *
+  */
+uint64_t stats_now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*-
+  *      Routine:      stats_bucket
+  *
+  *      Purpose:
+  *              Calcula el intervalo del histograma log-lineal que
+  *              corresponde a un valor, y el límite inferior de un
+  *              intervalo (stats_lower).
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              El índice del intervalo / su límite inferior.
+  *
+  */
+int stats_bucket(uint64_t v)
+{
+  int e;
+
+  if (v < (1 << STATS_SUB_BITS))
+    return v;
+
+  e = 63 - __builtin_clzll(v);
+  return ((e - STATS_SUB_BITS + 1) << STATS_SUB_BITS)
+    + ((v >> (e - STATS_SUB_BITS)) & ((1 << STATS_SUB_BITS) - 1));
+}
+
+uint64_t stats_lower(int b)
+{
+  int e = (b >> STATS_SUB_BITS) + STATS_SUB_BITS - 1;
+  uint64_t sub = b & ((1 << STATS_SUB_BITS) - 1);
+
+  if (b < (1 << STATS_SUB_BITS))
+    return b;
+
+  return ((1ULL << STATS_SUB_BITS) + sub) << (e - STATS_SUB_BITS);
+}
+
+/*-
+  *      Routine:      stats_add
+  *
+  *      Purpose:
+  *              Anota la duración de una fase en su histograma y en
+  *              los tiempos de la línea actual.
+  *      Conditions:
+  *              SIGCHLD debe estar bloqueada: el manejador también
+  *              anota fases al recoger hijos.
+  *      Returns:
+  *              none
+  *
+  */
+void stats_add(int fase, uint64_t ns)
+{
+  struct stats_hist *h = &stats[fase];
+
+  h->count++;
+  h->sum += ns;
+  if (ns > h->max)
+    h->max = ns;
+  h->bucket[stats_bucket(ns)]++;
+
+  fase_linea[fase] += ns;
+}
+
+/*-
+  *      Routine:      stats_pct
+  *
+  *      Purpose:
+  *              Estima un percentil de un histograma.
+  *      Conditions:
+  *              0 < pct <= 100
+  *      Returns:
+  *              El límite superior del intervalo en el que cae el
+  *              percentil (sin pasar del máximo observado).
+  *
+  */
+uint64_t stats_pct(struct stats_hist *h, double pct)
+{
+  uint64_t rank, acc = 0, up;
+  int b;
+
+  if (h->count == 0)
+    return 0;
+
+  rank = (uint64_t) (h->count * pct / 100.0 + 0.5);
+  if (rank == 0)
+    rank = 1;
+
+  for (b = 0; b < STATS_NBUCKETS; b++)
+    {
+      acc += h->bucket[b];
+      if (acc >= rank)
+	{
+	  up = b+1 < STATS_NBUCKETS ? stats_lower(b+1) - 1 : h->max;
+	  return up < h->max ? up : h->max;
+	}
+    }
+
+  return h->max;
+}
+
+/*-
+  *      Routine:      stats_json
+  *
+  *      Purpose:
+  *              Vuelca los histogramas en formato JSON en el fichero
+  *              indicado (sólo los intervalos no vacíos, como pares
+  *              [límite inferior en ns, cuenta]).
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              0 si se pudo escribir.
+  *              -1 e.o.c.
+  *
+  */
+int stats_json(char *path)
+{
+  FILE *f;
+  struct stats_hist *h;
+  int i, b, first;
+
+  if (!(f = fopen(path, "w")))
+    {
+      perror(path);
+      return -1;
+    }
+
+  fprintf(f, "{\n  \"pid\": %d,\n  \"phases\": {\n", shell_pid);
+  for (i = 0; i < NFASES; i++)
+    {
+      h = &stats[i];
+      fprintf(f, "    \"%s\": {\"count\": %llu, \"sum_ns\": %llu, "
+	      "\"p50_ns\": %llu, \"p99_ns\": %llu, \"max_ns\": %llu, "
+	      "\"buckets\": [",
+	      fase_name[i],
+	      (unsigned long long) h->count, (unsigned long long) h->sum,
+	      (unsigned long long) stats_pct(h, 50),
+	      (unsigned long long) stats_pct(h, 99),
+	      (unsigned long long) h->max);
+      for (b = 0, first = 1; b < STATS_NBUCKETS; b++)
+	if (h->bucket[b])
+	  {
+	    fprintf(f, "%s[%llu, %u]", first ? "" : ", ",
+		    (unsigned long long) stats_lower(b), h->bucket[b]);
+	    first = 0;
+	  }
+      fprintf(f, "]}%s\n", i+1 < NFASES ? "," : "");
+    }
+  fprintf(f, "  }\n}\n");
+
+  return fclose(f) ? -1 : 0;
+}
+
+/*-
+  *      Routine:      cmd_stats
+  *
+  *      Purpose:
+  *              Implementación del comando interno 'stats'.
+  *              Muestra, para cada fase del bucle del shell, el
+  *              número de muestras y los tiempos p50, p99, máximo y
+  *              medio. 'stats -r' pone a cero los histogramas y
+  *              'stats -j fichero' los vuelca en JSON.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              none
+  *
+  */
+void cmd_stats(int argc, char *argv[])
+{
+  struct stats_hist *h;
+  int i;
+
+  if (argc == 2 && strcmp(argv[1], "-r") == 0)
+    {
+      sigprocmask(SIG_BLOCK, &block_sigchld, NULL);
+      memset(stats, 0, sizeof(stats));
+      sigprocmask(SIG_UNBLOCK, &block_sigchld, NULL);
+      return;
+    }
+
+  if (argc == 3 && strcmp(argv[1], "-j") == 0)
+    {
+      stats_json(argv[2]);
+      return;
+    }
+
+  if (argc != 1)
+    {
+      printf(" Sintaxis: stats [-r | -j fichero]\n");
+      return;
+    }
+
+  printf(" %-14s %9s %11s %11s %11s %11s\n",
+	 "fase", "n", "p50 (us)", "p99 (us)", "max (us)", "media (us)");
+  for (i = 0; i < NFASES; i++)
+    {
+      h = &stats[i];
+      printf(" %-14s %9llu %11.1f %11.1f %11.1f %11.1f\n",
+	     fase_name[i], (unsigned long long) h->count,
+	     stats_pct(h, 50) / 1e3, stats_pct(h, 99) / 1e3, h->max / 1e3,
+	     h->count ? (double) h->sum / h->count / 1e3 : 0.0);
+    }
+}
+
+
+/*-
+  *      Routine:      trace_open
+  *
+  *      Purpose:
+  *              Activa el modo grabación: cada línea leída se
+  *              añadirá a la traza 'path' junto con su status y los
+  *              tiempos de cada fase (ver TRACE_MAGIC).
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              0 si se pudo crear la traza.
+  *              -1 e.o.c.
+  *
+  */
+int trace_open(char *path)
+{
+  uint32_t nf = NFASES;
+
+  if (!(trace = fopen(path, "w")))
+    {
+      perror(path);
+      return -1;
+    }
+  fcntl(fileno(trace), F_SETFD, FD_CLOEXEC);
+
+  trace_t0 = stats_now();
+  fwrite(TRACE_MAGIC, 8, 1, trace);
+  fwrite(&nf, sizeof(nf), 1, trace);
+  fwrite(&trace_t0, sizeof(trace_t0), 1, trace);
+  fflush(trace);
+
+  return 0;
+}
+
+/*-
+  *      Routine:      trace_record
+  *
+  *      Purpose:
+  *              Añade a la traza el registro de una línea ya
+  *              ejecutada. Se vuelca en el momento para no perder
+  *              nada si el shell muere.
+  *      Conditions:
+  *              La traza debe estar abierta.
+  *      Returns:
+  *              none
+  *
+  */
+void trace_record(char *linea, uint64_t t)
+{
+  uint32_t len = strlen(linea);
+  int32_t status = last_status;
+
+  t -= trace_t0;
+  fwrite(&t, sizeof(t), 1, trace);
+  fwrite(&len, sizeof(len), 1, trace);
+  fwrite(linea, 1, len, trace);
+  fwrite(&status, sizeof(status), 1, trace);
+  fwrite(fase_linea, sizeof(fase_linea), 1, trace);
+  fflush(trace);
+}
+
+
+/*-
+  *      Routine:      limit_apply
+  *
+  *      Purpose:
+  *              Aplica al proceso actual los límites de recursos
+  *              establecidos con 'limit'. Se llama en el hijo justo
+  *              antes de execvp.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              none
+  *
+  */
+static void limit_set(int res, rlim_t v)
+{
+  struct rlimit rl;
+
+  if (v == RLIM_INFINITY)
+    return;
+
+  rl.rlim_cur = rl.rlim_max = v;
+  if (setrlimit(res, &rl))
+    perror("setrlimit");
+}
+
+void limit_apply()
+{
+  limit_set(RLIMIT_CPU, limits.cpu);
+  limit_set(RLIMIT_AS, limits.as == RLIM_INFINITY ? RLIM_INFINITY
+	    : limits.as * 1024);
+  if (limits.nofile == RLIM_INFINITY)
+    setrlimit(RLIMIT_NOFILE, &nofile_orig);
+  else
+    limit_set(RLIMIT_NOFILE, limits.nofile);
+  limit_set(RLIMIT_NPROC, limits.nproc);
+}
+
+/*-
+  *      Routine:      job_rss
+  *
+  *      Purpose:
+  *              Mide la memoria residente de los trabajos vigilados:
+  *              la suma de todos los procesos de su grupo, que es a
+  *              quien para o mata el vigilante. Recorre /proc una
+  *              sola vez para todos y deja el total en p->rss.
+  *      Conditions:
+  *              SIGCHLD debe estar bloqueada.
+  *      Returns:
+  *              none
+  *
+  */
+void job_rss()
+{
+  char path[64], buf[512], *q;
+  long pgrp, rss, kb = sysconf(_SC_PAGESIZE) / 1024;
+  struct dirent *d;
+  node_t *p;
+  DIR *dir;
+  int fd, n;
+
+  for (p = proc_list.beg; p; p = p->next)
+    p->rss = 0;
+
+  if (!(dir = opendir("/proc")))
+    return;
+
+  while ((d = readdir(dir)))
+    {
+      if (!isdigit(d->d_name[0]))
+	continue;
+      snprintf(path, sizeof(path), "/proc/%s/stat", d->d_name);
+      if ((fd = open(path, O_RDONLY|O_CLOEXEC)) == -1)
+	continue;
+      n = read(fd, buf, sizeof(buf) - 1);
+      close(fd);
+      if (n <= 0)
+	continue;
+      buf[n] = '\0';
+
+      /* Tras el nombre, que puede llevar espacios y paréntesis: el
+	 grupo es el 3er campo y el RSS (en páginas) el 22º. */
+      if (!(q = strrchr(buf, ')'))
+	  || sscanf(q + 1, " %*c %*d %ld %*d %*d %*d %*u %*u %*u %*u %*u"
+		    " %*u %*u %*d %*d %*d %*d %*d %*d %*u %*u %ld",
+		    &pgrp, &rss) != 2)
+	continue;
+
+      if ((p = list_find_pid(&proc_list, pgrp)) && p->rss_max)
+	p->rss += rss * kb;
+    }
+
+  closedir(dir);
+}
+
+/*-
+  *      Routine:      watchdog_active
+  *
+  *      Purpose:
+  *              Decide si hay algún trabajo vigilado.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              1 <-> Sí
+  *              0 <-> No
+  *
+  */
+int watchdog_active()
+{
+  node_t *p;
+
+  /* Las esperas preguntan a menudo: no recorrer la lista si ningún
+     trabajo tiene presupuesto. */
+  if (watchdog_jobs == 0)
+    return 0;
+
+  for (p = proc_list.beg; p; p = p->next)
+    if (p->rss_max && !p->stopped)
+      return 1;
+
+  return 0;
+}
+
+/*-
+  *      Routine:      watchdog
+  *
+  *      Purpose:
+  *              Vigilante de memoria: mide el RSS de los trabajos
+  *              con presupuesto y para o mata (según 'limit -a') el
+  *              grupo de procesos de los que lo superen, anotando el
+  *              motivo en la lista de trabajos.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              El número de trabajos sobre los que se actuó.
+  *
+  */
+int watchdog()
+{
+  sigset_t mask;
+  node_t *p;
+  int n = 0;
+
+  /* Se conserva la máscara: la espera en primer plano llama con
+     SIGCHLD bloqueada y así debe seguir. */
+  sigprocmask(SIG_BLOCK, &block_sigchld, &mask);
+  job_rss();
+  for (p = proc_list.beg; p; p = p->next)
+    {
+      if (!p->rss_max || p->stopped || p->rss <= p->rss_max)
+	continue;
+
+      snprintf(p->reason, sizeof(p->reason), "RSS %ld KB > %ld KB",
+	       p->rss, p->rss_max);
+      printf("\n [%d] %s (pid=%d) : %s, %s\n",
+	     list_index(&proc_list, p), p->name, p->pid, p->reason,
+	     p->rss_action == SIGKILL ? "matando" : "parando");
+      kill(-p->pid, p->rss_action);
+      n++;
+    }
+  sigprocmask(SIG_SETMASK, &mask, NULL);
+
+  return n;
+}
+
+/*-
+  *      Routine:      watchdog_poll
+  *
+  *      Purpose:
+  *              Pasa el vigilante de memoria si han transcurrido
+  *              WATCHDOG_MS desde la última vez. Lo llaman todas las
+  *              esperas del shell: read_key, la lectura de órdenes
+  *              sin terminal, la del trabajo en primer plano
+  *              (fg_wait), 'wait' y 'coreq'.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              Los milisegundos hasta la siguiente pasada, -1 si no
+  *              hay ningún trabajo vigilado. En '*acted', el número
+  *              de trabajos sobre los que actuó.
+  *
+  */
+int watchdog_poll(int *acted)
+{
+  uint64_t t;
+  int timeout;
+
+  *acted = 0;
+  if (!watchdog_active())
+    return -1;
+
+  t = stats_now();
+  if (t - watchdog_last >= WATCHDOG_MS * 1000000ULL)
+    {
+      watchdog_last = t;
+      *acted = watchdog();
+    }
+
+  timeout = WATCHDOG_MS - (stats_now() - watchdog_last) / 1000000;
+  return timeout < 0 ? 0 : timeout;
+}
+
+/*-
+  *      Routine:      fg_wait
+  *
+  *      Purpose:
+  *              Espera a que el trabajo en primer plano termine o se
+  *              pare. Si hay trabajos vigilados (él mismo u otros en
+  *              segundo plano) se despierta para pasar el vigilante;
+  *              si no, duerme en wait4 como siempre.
+  *      Conditions:
+  *              SIGCHLD debe estar bloqueada.
+  *      Returns:
+  *              Lo que devuelve wait4.
+  *
+  */
+int fg_wait(node_t *p, int *status)
+{
+  struct timespec ts;
+  int r, timeout, n, chld = CLEAR;
+
+  while ((timeout = watchdog_poll(&n)) >= 0)
+    {
+      if ((r = wait4(p->pid, status, WUNTRACED|WNOHANG, &reap_ru)) != 0)
+	break;
+      ts.tv_sec = timeout / 1000;
+      ts.tv_nsec = (timeout % 1000) * 1000000L;
+      if (sigtimedwait(&block_sigchld, NULL, &ts) == SIGCHLD)
+	chld = SET;
+    }
+  if (timeout < 0)
+    r = wait4(p->pid, status, WUNTRACED, &reap_ru);
+
+  /* La SIGCHLD consumida puede ser de otro trabajo: que la atienda
+     el manejador cuando se desbloquee. */
+  if (chld)
+    kill(getpid(), SIGCHLD);
+
+  return r;
+}
+
+/*-
+  *      Routine:      cmd_limit
+  *
+  *      Purpose:
+  *              Implementación del comando interno 'limit'.
+  *              Sin opciones muestra los límites vigentes. Con
+  *              opciones los cambia para los trabajos que se lancen
+  *              a partir de ahora o, si les sigue un programa, sólo
+  *              para ese programa.
+  *                -t seg   tiempo de CPU
+  *                -v KB    espacio de direcciones
+  *                -n num   ficheros abiertos
+  *                -u num   procesos
+  *                -m KB    presupuesto de RSS vigilado por el shell
+  *                -a stop|kill  qué hacer al superar el RSS
+  *              El valor "unlimited" quita el límite.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              >0 si error.
+  *              0 e.o.c.
+  *
+  */
+static void limit_show(char *name, char *opt, rlim_t v, char *unit)
+{
+  if (v == RLIM_INFINITY)
+    printf(" %-10s (%s): ilimitado\n", name, opt);
+  else
+    printf(" %-10s (%s): %llu%s\n", name, opt, (unsigned long long) v, unit);
+}
+
+int cmd_limit(int argc, char *argv[], int bg)
+{
+  struct limits_t saved;
+  rlim_t v, *dst;
+  int i;
+
+  if (argc == 1)
+    {
+      limit_show("cpu", "-t", limits.cpu, " s");
+      limit_show("memoria", "-v", limits.as, " KB");
+      limit_show("ficheros", "-n", limits.nofile, "");
+      limit_show("procesos", "-u", limits.nproc, "");
+      limit_show("rss", "-m", limits.rss ? limits.rss : RLIM_INFINITY, " KB");
+      printf(" acción     (-a): %s\n",
+	     limits.action == SIGKILL ? "kill" : "stop");
+      return 0;
+    }
+
+  /* Si les sigue un programa, los cambios son sólo para él. */
+  saved = limits;
+
+  for (i = 1; i < argc && argv[i][0] == '-'; i += 2)
+    {
+      if (i+1 == argc)
+	goto syntax;
+
+      if (strcmp(argv[i], "-a") == 0)
+	{
+	  if (strcmp(argv[i+1], "stop") == 0)
+	    limits.action = SIGSTOP;
+	  else if (strcmp(argv[i+1], "kill") == 0)
+	    limits.action = SIGKILL;
+	  else
+	    goto syntax;
+	  continue;
+	}
+
+      if (strcmp(argv[i+1], "unlimited") == 0)
+	v = RLIM_INFINITY;
+      else if (is_nat(argv[i+1]) && *argv[i+1])
+	v = strtoull(argv[i+1], NULL, 10);
+      else
+	goto syntax;
+
+      if (strcmp(argv[i], "-t") == 0)
+	dst = &limits.cpu;
+      else if (strcmp(argv[i], "-v") == 0)
+	dst = &limits.as;
+      else if (strcmp(argv[i], "-n") == 0)
+	dst = &limits.nofile;
+      else if (strcmp(argv[i], "-u") == 0)
+	dst = &limits.nproc;
+      else if (strcmp(argv[i], "-m") == 0)
+	{
+	  limits.rss = v == RLIM_INFINITY ? 0 : v;
+	  continue;
+	}
+      else
+	goto syntax;
+
+      *dst = v;
+    }
+
+  if (i < argc)
+    {
+      if (is_builtin(argv[i]))
+	goto syntax;
+      launch_proc(&argv[i], bg, -1, -1, NULL);
+      limits = saved;
+    }
+
+  return 0;
+
+ syntax:
+  limits = saved;
+  printf(" Sintaxis: limit [-t seg] [-v KB] [-n num] [-u num] [-m KB]\n");
+  printf("                 [-a stop|kill] [programa <args>]\n");
+  return 1;
+}
+
+/*-
+  *      Routine:      wait_note
+  *
+  *      Purpose:
+  *              Anota el status de un trabajo recogido si 'wait'
+  *              lo está esperando. Si se ha parado deja de
+  *              esperarse, pero no cuenta como terminado.
+  *      Conditions:
+  *              SIGCHLD debe estar bloqueada.
+  *      Returns:
+  *              none
+  *
+  */
+void wait_note(int pid, int status)
+{
+  int lo = 0, hi = wait_set.n, mid;
+
+  while (lo < hi)
+    {
+      mid = (lo + hi) / 2;
+      if (wait_set.pid[mid] < pid)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+
+  if (lo == wait_set.n || wait_set.pid[lo] != pid || wait_set.done[lo])
+    return;
+
+  wait_set.status[lo] = status;
+  wait_set.done[lo] = SET;
+  if (WIFSTOPPED(status))
+    {
+      wait_set.stop = status;
+      wait_set.nstop++;
+      return;
+    }
+
+  if (wait_set.ndone == 0)
+    wait_set.first = status;
+  wait_set.ndone++;
+}
+
+/*-
+  *      Routine:      cmp_pid
+  *
+  *      Purpose:
+  *              Compara dos pids para qsort.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              <0, 0 o >0.
+  *
+  */
+int cmp_pid(const void *a, const void *b)
+{
+  return *(const int *) a - *(const int *) b;
+}
+
+/*-
+  *      Routine:      cmd_wait
+  *
+  *      Purpose:
+  *              Espera a que terminen trabajos en segundo plano:
+  *              todos, los indicados (ver job_spec) o (con -n) el
+  *              primero de ellos, opcionalmente con un plazo en
+  *              segundos (-t).
+  *              Con SIGCHLD bloqueada se duerme en sigtimedwait y
+  *              se recoge con proc_reap al despertar, sin sondeos.
+  *              Los trabajos parados no se esperan, ni tampoco los
+  *              que se paren durante la espera (se informa de
+  *              cuántos fueron).
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              El status (waitpid) que queda en last_status: el
+  *              del último trabajo indicado, el del primero en
+  *              terminar con -n, 0 si se esperaba a todos, 124 si
+  *              vence el plazo, 130 si se interrumpe con Ctrl-C y
+  *              127 si no hay nada que esperar.
+  *
+  */
+int cmd_wait(int argc, char *argv[])
+{
+  int i, n = 0, any = CLEAR, last_pid = 0, status = 0, sig, wd, acted;
+  double secs = -1;
+  char *end;
+  node_t *p;
+  uint64_t deadline = 0, now, left;
+  struct timespec ts;
+  struct job_sel sel = { NULL };
+
+  for (i = 1; i < argc && argv[i][0] == '-'; i++)
+    {
+      if (strcmp(argv[i], "-n") == 0)
+	any = SET;
+      else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+	{
+	  secs = strtod(argv[++i], &end);
+	  if (*end || secs < 0)
+	    goto syntax;
+	}
+      else
+	goto syntax;
+    }
+
+  sigprocmask(SIG_BLOCK, &block_sigchld, NULL);
+
+  /* Lo que ya haya terminado no debe contar como pendiente. */
+  proc_reap();
+
+  wait_set.n = wait_set.ndone = wait_set.nstop = 0;
+  wait_set.pid = malloc((list_length(&proc_list) + 1) * sizeof(int));
+
+  if (i == argc)
+    {
+      for (p = proc_list.beg; p; p = p->next)
+	if (!p->stopped)
+	  wait_set.pid[n++] = p->pid;
+    }
+  else
+    {
+      if (job_select(argv + i, argc - i, &sel))
+	status = W_EXITCODE(127, 0);
+
+      for (i = 0; i < sel.n; i++)
+	{
+	  p = sel.v[i];
+	  if (p->stopped)
+	    {
+	      printf("wait: [%d] %s (pid=%d) está parado\n",
+		     list_index(&proc_list, p), p->name, p->pid);
+	      status = p->status;
+	      continue;
+	    }
+	  wait_set.pid[n++] = last_pid = p->pid;
+	}
+      free(sel.v);
+    }
+
+  if (n == 0)
+    {
+      if (argc == 1 || any)
+	status = W_EXITCODE(127, 0);
+      goto out;
+    }
+
+  qsort(wait_set.pid, n, sizeof(int), cmp_pid);
+  wait_set.status = malloc(n * sizeof(int));
+  wait_set.done = calloc(n, 1);
+  wait_set.n = n;
+
+  if (secs >= 0)
+    deadline = stats_now() + (uint64_t) (secs * 1e9);
+
+  in_wait = SET;
+  while (wait_set.ndone + wait_set.nstop < wait_set.n
+	 && !(any && wait_set.ndone))
+    {
+      /* Despertar también para el vigilante de memoria. */
+      wd = watchdog_poll(&acted);
+      now = stats_now();
+      left = secs >= 0 ? (now < deadline ? deadline - now : 0) : UINT64_MAX;
+      if (wd >= 0 && wd * 1000000ULL < left)
+	left = wd * 1000000ULL;
+
+      if (secs >= 0 && now >= deadline)
+	{
+	  sig = -1;
+	  errno = EAGAIN;
+	}
+      else if (left == UINT64_MAX)
+	sig = sigtimedwait(&block_sigchld, NULL, NULL);
+      else
+	{
+	  ts.tv_sec = left / 1000000000;
+	  ts.tv_nsec = left % 1000000000;
+	  sig = sigtimedwait(&block_sigchld, NULL, &ts);
+	  if (sig == -1 && errno == EAGAIN
+	      && (secs < 0 || stats_now() < deadline))
+	    continue;
+	}
+
+      if (sig == SIGCHLD)
+	proc_reap();
+      else if (errno == EAGAIN)
+	{
+	  printf("wait: plazo vencido, quedan %d trabajos\n",
+		 wait_set.n - wait_set.ndone - wait_set.nstop);
+	  status = W_EXITCODE(124, 0);
+	  break;
+	}
+      else if (errno == EINTR)
+	{
+	  printf("\nwait: interrumpido\n");
+	  status = W_EXITCODE(130, 0);
+	  break;
+	}
+    }
+  in_wait = CLEAR;
+
+  if (wait_set.nstop)
+    printf("wait: %d trabajos se pararon y no se esperaron\n",
+	   wait_set.nstop);
+
+  if (wait_set.ndone + wait_set.nstop == wait_set.n
+      || (any && wait_set.ndone))
+    {
+      if (any)
+	status = wait_set.ndone ? wait_set.first : wait_set.stop;
+      else if (last_pid)
+	status = wait_set.status[(int *) bsearch(&last_pid, wait_set.pid, n,
+						 sizeof(int), cmp_pid)
+				 - wait_set.pid];
+      else
+	status = 0;
+    }
+
+  free(wait_set.status);
+  free(wait_set.done);
+  wait_set.n = 0;
+
+ out:
+  free(wait_set.pid);
+  sigprocmask(SIG_UNBLOCK, &block_sigchld, NULL);
+
+  last_status = status;
+  return status;
+
+ syntax:
+  printf(" Sintaxis: wait [-n] [-t segundos] [numero_de_trabajo ...]\n");
+  last_status = W_EXITCODE(2, 0);
+  return last_status;
+}
+
+/*-
+  *      Routine:      map_args
+  *
+  *      Purpose:
+  *              Analiza las opciones de 'map': -j N, -i fich y
+  *              -o fich.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              La posición en 'argv' del programa a ejecutar, o
+  *              -1 si la sintaxis no es válida.
+  *
+  */
+int map_args(int argc, char *argv[], int *n, char **in, char **out)
+{
+  int i;
+
+  *n = 0;
+  *in = *out = NULL;
+
+  for (i = 1; i + 1 < argc && argv[i][0] == '-'; i += 2)
+    {
+      if (strcmp(argv[i], "-j") == 0 && is_nat(argv[i+1]) && *argv[i+1])
+	*n = atoi(argv[i+1]);
+      else if (strcmp(argv[i], "-i") == 0)
+	*in = argv[i+1];
+      else if (strcmp(argv[i], "-o") == 0)
+	*out = argv[i+1];
+      else
+	return -1;
+    }
+
+  if (*n < 1 || *n > MAP_MAXJ || i == argc || is_builtin(argv[i]))
+    return -1;
+
+  return i;
+}
+
+/*-
+  *      Routine:      cmd_map
+  *
+  *      Purpose:
+  *              Lanza como un único trabajo un coordinador que
+  *              reparte la entrada, en trozos de líneas completas,
+  *              entre N copias a la vez del programa indicado y
+  *              reúne su salida en el orden de la entrada (ver
+  *              map_run).
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              0 si se lanzó, 1 si la sintaxis no es válida.
+  *
+  */
+int cmd_map(int argc, char *argv[], int bg)
+{
+  int n;
+  char *in, *out;
+
+  if (map_args(argc, argv, &n, &in, &out) < 0)
+    {
+      printf(" Sintaxis: map -j N [-i fichero] [-o fichero] programa <args>\n");
+      printf("           (1 <= N <= %d)\n", MAP_MAXJ);
+      return 1;
+    }
+
+  launch_proc(argv, bg, -1, -1, map_run);
+
+  return 0;
+}
+
+/*-
+  *      Routine:      map_cut
+  *
+  *      Purpose:
+  *              Decide cuánto de la entrada pendiente forma el
+  *              siguiente trozo: líneas completas hasta 'csize'
+  *              bytes (una sola línea si es más larga), o con 'all'
+  *              todas las líneas completas que haya.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              La longitud del trozo, 0 si todavía no hay uno.
+  *
+  */
+static size_t map_cut(char *buf, size_t len, size_t csize, int all)
+{
+  char *nl;
+
+  if (len >= csize)
+    {
+      if ((nl = memrchr(buf, '\n', csize))
+	  || (nl = memchr(buf + csize, '\n', len - csize)))
+	return nl + 1 - buf;
+      return 0;
+    }
+
+  if (all && len && (nl = memrchr(buf, '\n', len)))
+    return nl + 1 - buf;
+
+  return 0;
+}
+
+/*-
+  *      Routine:      map_spawn
+  *
+  *      Purpose:
+  *              Lanza un trabajador de 'map' con el programa 'cmd'
+  *              para el trozo 'seq', unido al coordinador por dos
+  *              tuberías.
+  *      Conditions:
+  *              Sólo en el coordinador.
+  *      Returns:
+  *              0 si se lanzó, -1 e.o.c. (ya notificado).
+  *
+  */
+static int map_spawn(struct map_worker *w, char **cmd, long seq,
+		     char *data, size_t len)
+{
+  int pin[2], pout[2];
+
+  if (pipe2(pin, O_CLOEXEC) || pipe2(pout, O_CLOEXEC))
+    {
+      perror("map: pipe");
+      return -1;
+    }
+
+  switch (w->pid = fork())
+    {
+    case -1:
+      perror("map: fork");
+      return -1;
+
+    case 0:
+      signal(SIGPIPE, SIG_DFL);
+      dup2(pin[0], STDIN_FILENO);
+      dup2(pout[1], STDOUT_FILENO);
+      execvp(cmd[0], cmd);
+      perror("execvp");
+      _exit(errno == ENOENT ? EXEC_NOENT : EXEC_FAILED);
+    }
+
+  close(pin[0]);
+  close(pout[1]);
+  w->in = pin[1];
+  w->out = pout[0];
+  fcntl(w->in, F_SETFL, O_NONBLOCK);
+
+  if (len > w->wcap)
+    {
+      w->wcap = len;
+      w->wbuf = realloc(w->wbuf, w->wcap);
+    }
+  memcpy(w->wbuf, data, len);
+  w->wlen = len;
+  w->woff = 0;
+  w->seq = seq;
+
+  return 0;
+}
+
+/*-
+  *      Routine:      map_run
+  *
+  *      Purpose:
+  *              Coordinador de 'map', ejecutado en el hijo que
+  *              lanza launch_proc. Corta la entrada en trozos de
+  *              líneas completas numerados y lanza un proceso por
+  *              trozo, hasta N a la vez, que comparten su grupo de
+  *              procesos (Ctrl-Z, fg y bg actúan sobre todos). Cada
+  *              proceso recibe su trozo seguido de fin de fichero,
+  *              así que toda su salida es de ese trozo: el programa
+  *              puede ser cualquier filtro (grep, sort, uno con la
+  *              salida en buffer...), no sólo uno que responda una
+  *              línea por línea. Lo que produce cada trozo sale en
+  *              el orden de la entrada; la ventana es de MAP_DEPTH
+  *              trozos por trabajador: no se lanzan más mientras el
+  *              más antiguo no se haya escrito.
+  *              Con -i los trozos se ajustan al tamaño del fichero
+  *              para que haya al menos MAP_DEPTH por trabajador. Si
+  *              la entrada se para MAP_IDLE_MS, lo que haya forma un
+  *              trozo, para no retener la salida de una entrada que
+  *              llega poco a poco.
+  *      Conditions:
+  *              Sólo en el hijo.
+  *      Returns:
+  *              El código de salida: 0, o el del primer trabajador
+  *              que falló.
+  *
+  */
+int map_run(char **argv)
+{
+  int argc, n, k, nring, fd_in, fd_out, status, ret = 0;
+  int ieof = CLEAR, idle = CLEAR, running = 0;
+  char *in, *out, **cmd, *ibuf;
+  size_t ilen = 0, icap, csize = MAP_CHUNK, cut;
+  ssize_t r;
+  long seq = 0, emit = 0;
+  struct map_worker *w;
+  struct map_slot *ring, *slot;
+  struct pollfd *pfd;
+  struct stat st;
+
+  for (argc = 0; argv[argc]; argc++)
+    ;
+  cmd = argv + map_args(argc, argv, &n, &in, &out);
+
+  signal(SIGINT, SIG_DFL);
+  signal(SIGCHLD, SIG_DFL);
+  signal(SIGPIPE, SIG_IGN);
+  sigprocmask(SIG_UNBLOCK, &block_sigchld, NULL);
+
+  fd_in = in ? open(in, O_RDONLY|O_CLOEXEC) : STDIN_FILENO;
+  fd_out = out ? open(out, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0666)
+    : STDOUT_FILENO;
+  if (fd_in == -1 || fd_out == -1)
+    {
+      perror("map");
+      return 1;
+    }
+
+  if (fstat(fd_in, &st) == 0 && S_ISREG(st.st_mode)
+      && st.st_size / (n * MAP_DEPTH) < (off_t) csize)
+    csize = st.st_size / (n * MAP_DEPTH) > MAP_MINCHUNK
+      ? st.st_size / (n * MAP_DEPTH) : MAP_MINCHUNK;
+
+  w = calloc(n, sizeof(*w));
+  nring = n * MAP_DEPTH;
+  ring = calloc(nring, sizeof(*ring));
+  icap = 2 * csize;
+  ibuf = malloc(icap);
+  pfd = malloc((2 * n + 1) * sizeof(*pfd));
+
+  for (;;)
+    {
+      /* Un proceso por trozo listo, si hay sitio. */
+      while (running < n && seq < emit + nring
+	     && (cut = map_cut(ibuf, ilen, csize, ieof || idle)))
+	{
+	  for (k = 0; w[k].pid; k++)
+	    ;
+	  if (map_spawn(&w[k], cmd, seq, ibuf, cut))
+	    return 1;
+	  slot = &ring[seq++ % nring];
+	  slot->len = 0;
+	  slot->done = CLEAR;
+	  running++;
+	  ilen -= cut;
+	  memmove(ibuf, ibuf + cut, ilen);
+	}
+      idle = CLEAR;
+
+      if (ieof && ilen == 0 && running == 0)
+	break;
+
+      /* Sólo se lee entrada mientras no haya un trozo entero. */
+      pfd[0].fd = !ieof && !map_cut(ibuf, ilen, csize, CLEAR) ? fd_in : -1;
+      pfd[0].events = POLLIN;
+      for (k = 0; k < n; k++)
+	{
+	  pfd[1 + 2*k].fd = w[k].pid ? w[k].in : -1;
+	  pfd[1 + 2*k].events = POLLOUT;
+	  pfd[2 + 2*k].fd = w[k].pid ? w[k].out : -1;
+	  pfd[2 + 2*k].events = POLLIN;
+	}
+
+      switch (poll(pfd, 2 * n + 1,
+		   pfd[0].fd != -1 && ilen ? MAP_IDLE_MS : -1))
+	{
+	case -1:
+	  continue;
+
+	case 0:
+	  idle = SET;
+	  continue;
+	}
+
+      if (pfd[0].revents)
+	{
+	  if (ilen == icap)
+	    ibuf = realloc(ibuf, icap *= 2);
+
+	  r = read(fd_in, ibuf + ilen, icap - ilen);
+	  if (r > 0)
+	    ilen += r;
+	  else if (r == 0 || errno != EINTR)
+	    {
+	      ieof = SET;
+	      if (ilen && ibuf[ilen-1] != '\n')
+		{
+		  if (ilen == icap)
+		    ibuf = realloc(ibuf, ++icap);
+		  ibuf[ilen++] = '\n';
+		}
+	    }
+	}
+
+      for (k = 0; k < n; k++)
+	{
+	  if (!w[k].pid)
+	    continue;
+
+	  if (pfd[1 + 2*k].revents)
+	    {
+	      r = write(w[k].in, w[k].wbuf + w[k].woff, w[k].wlen - w[k].woff);
+	      if (r > 0)
+		w[k].woff += r;
+	      else if (r == -1 && errno != EAGAIN)
+		w[k].woff = w[k].wlen;  /* el trabajador ya no lee */
+	      if (w[k].woff == w[k].wlen)
+		{
+		  close(w[k].in);
+		  w[k].in = -1;
+		}
+	    }
+
+	  if (pfd[2 + 2*k].revents)
+	    {
+	      slot = &ring[w[k].seq % nring];
+	      if (slot->cap - slot->len < MAP_CHUNK)
+		{
+		  slot->cap = 2 * slot->cap + MAP_CHUNK;
+		  slot->out = realloc(slot->out, slot->cap);
+		}
+	      r = read(w[k].out, slot->out + slot->len, slot->cap - slot->len);
+	      if (r > 0)
+		slot->len += r;
+	      else if (r == 0 || errno != EINTR)
+		{
+		  /* Fin del trozo. */
+		  close(w[k].out);
+		  if (w[k].in != -1)
+		    close(w[k].in);
+		  waitpid(w[k].pid, &status, 0);
+		  if (ret == 0 && WIFEXITED(status))
+		    ret = WEXITSTATUS(status);
+		  else if (ret == 0 && WIFSIGNALED(status))
+		    ret = 128 + WTERMSIG(status);
+		  if (WIFEXITED(status)
+		      && (WEXITSTATUS(status) == EXEC_NOENT
+			  || WEXITSTATUS(status) == EXEC_FAILED))
+		    {
+		      /* No se puede ejecutar: no lanzar más. */
+		      ieof = SET;
+		      ilen = 0;
+		    }
+		  w[k].pid = 0;
+		  slot->done = SET;
+		  running--;
+		}
+	    }
+	}
+
+      /* Escribir en orden los trozos completos. */
+      while (emit < seq && ring[emit % nring].done)
+	{
+	  write(fd_out, ring[emit % nring].out, ring[emit % nring].len);
+	  ring[emit % nring].done = CLEAR;
+	  emit++;
+	}
+    }
+
+  return ret;
+}
+
+/*-
+  *      Routine:      coproc_find
+  *
+  *      Purpose:
+  *              Busca un coproceso por su nombre.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              El coproceso, o NULL si no existe.
+  *
+  */
+struct coproc * coproc_find(char *name)
+{
+  struct coproc *c;
+
+  for (c = coprocs; c; c = c->next)
+    if (strcmp(c->name, name) == 0)
+      return c;
+
+  return NULL;
+}
+
+/*-
+  *      Routine:      coproc_close
+  *
+  *      Purpose:
+  *              Cierra la conexión con todas las copias de un
+  *              coproceso (lo que les hace leer fin de fichero),
+  *              envía SIGTERM a las que sigan en la lista de
+  *              trabajos y lo elimina del registro.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              none
+  *
+  */
+void coproc_close(struct coproc *c)
+{
+  struct coproc **pp;
+  node_t *p;
+  int i;
+
+  sigprocmask(SIG_BLOCK, &block_sigchld, NULL);
+  for (i = 0; i < c->n; i++)
+    {
+      if (c->v[i].fd != -1)
+	close(c->v[i].fd);
+      if ((p = list_find_pid(&proc_list, c->v[i].pid)))
+	job_signal(p, SIGTERM);
+      free(c->v[i].rbuf);
+      free(c->v[i].wbuf);
+    }
+  sigprocmask(SIG_UNBLOCK, &block_sigchld, NULL);
+
+  for (pp = &coprocs; *pp != c; pp = &(*pp)->next)
+    ;
+  *pp = c->next;
+
+  free(c->name);
+  free(c->v);
+  free(c);
+}
+
+/*-
+  *      Routine:      cmd_coproc
+  *
+  *      Purpose:
+  *              Lanza N copias (-n, 1 por omisión) de un programa
+  *              como coprocesos con nombre. Cada una es un trabajo
+  *              en segundo plano, con ese nombre, cuya entrada y
+  *              salida estándar son un socket del shell.
+  *              Sin argumentos lista los coprocesos; con -k nombre
+  *              los termina.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              0 si no hubo errores, 1 e.o.c.
+  *
+  */
+int cmd_coproc(int argc, char *argv[])
+{
+  struct coproc *c;
+  node_t *p;
+  int i = 1, n = 1, sv[2];
+
+  if (argc == 1)
+    {
+      for (c = coprocs; c; c = c->next)
+	{
+	  printf(" %s:", c->name);
+	  for (i = 0; i < c->n; i++)
+	    printf(" %d%s(%ld)", c->v[i].pid,
+		   c->v[i].fd == -1
+		   || !list_find_pid(&proc_list, c->v[i].pid) ? "!" : "",
+		   c->v[i].served);
+	  printf("\n");
+	}
+      return 0;
+    }
+
+  if (argc == 3 && strcmp(argv[1], "-k") == 0)
+    {
+      if (!(c = coproc_find(argv[2])))
+	{
+	  printf("coproc: %s: no existe\n", argv[2]);
+	  return 1;
+	}
+      coproc_close(c);
+      return 0;
+    }
+
+  if (argc > 2 && strcmp(argv[1], "-n") == 0)
+    {
+      n = is_nat(argv[2]) ? atoi(argv[2]) : 0;
+      i = 3;
+    }
+
+  if (n < 1 || n > MAP_MAXJ || argc - i < 2 || argv[i][0] == '-'
+      || is_builtin(argv[i+1]))
+    {
+      printf(" Sintaxis: coproc [-n N] nombre programa <args>\n");
+      printf("           coproc [-k nombre]\n");
+      return 1;
+    }
+
+  if (coproc_find(argv[i]))
+    {
+      printf("coproc: %s: ya existe\n", argv[i]);
+      return 1;
+    }
+
+  c = calloc(1, sizeof(*c));
+  c->name = strdup(argv[i]);
+  c->v = calloc(n, sizeof(*c->v));
+  c->next = coprocs;
+  coprocs = c;
+
+  for (c->n = 0; c->n < n; c->n++)
+    {
+      if (socketpair(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0, sv))
+	{
+	  perror("coproc: socketpair");
+	  break;
+	}
+
+      /* Sólo el extremo del shell: el coproceso lee bloqueándose. */
+      fcntl(sv[0], F_SETFL, O_NONBLOCK);
+      c->v[c->n].fd = sv[0];
+      c->v[c->n].pid = launch_proc(&argv[i+1], 1, sv[1], sv[1], NULL);
+      close(sv[1]);
+
+      /* En la lista de trabajos figura con el nombre del coproceso,
+	 que así sirve como %nombre. */
+      sigprocmask(SIG_BLOCK, &block_sigchld, NULL);
+      if ((p = list_find_pid(&proc_list, c->v[c->n].pid)))
+	{
+	  free(p->name);
+	  p->name = strdup(c->name);
+	  if (jobshm)
+	    jobshm_state(p, NULL);
+	}
+      sigprocmask(SIG_UNBLOCK, &block_sigchld, NULL);
+    }
+
+  return 0;
+}
+
+/*-
+  *      Routine:      coproc_reply
+  *
+  *      Purpose:
+  *              Lee lo que haya enviado una copia del coproceso y
+  *              asigna cada línea completa a la petición más
+  *              antigua pendiente en ella.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              0, o -1 si la copia cerró la conexión.
+  *
+  */
+static int coproc_reply(struct coproc_inst *ci, char **resp, int nring)
+{
+  char *nl;
+  size_t len;
+  ssize_t r;
+
+  if (ci->rcap - ci->rlen < 4096)
+    {
+      ci->rcap = ci->rcap ? 2 * ci->rcap : 8192;
+      ci->rbuf = realloc(ci->rbuf, ci->rcap);
+    }
+
+  r = read(ci->fd, ci->rbuf + ci->rlen, ci->rcap - ci->rlen);
+  if (r <= 0)
+    return r == -1 && (errno == EINTR || errno == EAGAIN) ? 0 : -1;
+  ci->rlen += r;
+
+  while ((nl = memchr(ci->rbuf, '\n', ci->rlen)))
+    {
+      len = nl + 1 - ci->rbuf;
+      if (ci->skip)
+	ci->skip--;
+      else if (ci->qn)
+	{
+	  resp[ci->q[ci->qh] % nring] = strndup(ci->rbuf, len);
+	  ci->qh = (ci->qh + 1) % COPROC_DEPTH;
+	  ci->qn--;
+	  ci->served++;
+	}
+      ci->rlen -= len;
+      memmove(ci->rbuf, nl + 1, ci->rlen);
+    }
+
+  return 0;
+}
+
+/*-
+  *      Routine:      coproc_queue
+  *
+  *      Purpose:
+  *              Añade una petición a lo pendiente de enviar a una
+  *              copia del coproceso.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              none
+  *
+  */
+static void coproc_queue(struct coproc_inst *ci, char *req)
+{
+  size_t len = strlen(req);
+
+  if (ci->woff == ci->wlen)
+    ci->woff = ci->wlen = 0;
+  if (ci->wlen + len > ci->wcap)
+    {
+      memmove(ci->wbuf, ci->wbuf + ci->woff, ci->wlen - ci->woff);
+      ci->wlen -= ci->woff;
+      ci->woff = 0;
+      if (ci->wlen + len > ci->wcap)
+	{
+	  ci->wcap = 2 * (ci->wlen + len);
+	  ci->wbuf = realloc(ci->wbuf, ci->wcap);
+	}
+    }
+  memcpy(ci->wbuf + ci->wlen, req, len);
+  ci->wlen += len;
+}
+
+/*-
+  *      Routine:      coproc_run
+  *
+  *      Purpose:
+  *              Envía al coproceso una petición por cada línea de
+  *              'in' y escribe las respuestas en la salida
+  *              estándar, en el orden de las peticiones. Cada
+  *              petición va a la copia con menos peticiones
+  *              pendientes (como mucho COPROC_DEPTH), de modo que
+  *              varias se atienden a la vez; las respuestas se
+  *              reordenan en una ventana de n * COPROC_DEPTH.
+  *              Los envíos no bloquean: como en map_run, se hacen
+  *              cuando poll dice que caben, mientras se leen las
+  *              respuestas. Si una copia cierra la conexión, sus
+  *              peticiones sin responder pasan a las demás; si no
+  *              queda ninguna, se responden con una línea vacía y
+  *              se informa de cuántas fueron.
+  *              Las copias deben responder con una línea por
+  *              petición y volcar cada respuesta (p.ej. python -u,
+  *              fflush() en awk).
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              0 si todas las peticiones obtuvieron respuesta, 1 si
+  *              alguna copia terminó, 130 si se interrumpió con
+  *              Ctrl-C.
+  *
+  */
+int coproc_run(struct coproc *c, FILE *in)
+{
+  struct coproc_inst *ci;
+  struct pollfd *pfd;
+  char **resp, **req, *line = NULL;
+  size_t cap = 0;
+  ssize_t len;
+  long seq = 0, emit = 0, *retry, j;
+  int nring = c->n * COPROC_DEPTH, ieof = CLEAR, ret = 0, i, k, best, npend;
+  int rh = 0, rn = 0, moved, lost = 0, dead, wd;
+
+  resp = calloc(nring, sizeof(*resp));
+  req = calloc(nring, sizeof(*req));
+  retry = malloc(nring * sizeof(*retry));
+  pfd = malloc(c->n * sizeof(*pfd));
+
+  /* Con SIGCHLD bloqueada, poll sólo se interrumpe por Ctrl-C (una
+     copia que termina no es una interrupción). */
+  sigprocmask(SIG_BLOCK, &block_sigchld, NULL);
+  in_wait = SET;
+  for (;;)
+    {
+      /* Escribir en orden las respuestas que ya estén. */
+      while (emit < seq && resp[emit % nring])
+	{
+	  fputs(resp[emit % nring], stdout);
+	  free(resp[emit % nring]);
+	  resp[emit % nring] = NULL;
+	  free(req[emit % nring]);
+	  req[emit % nring] = NULL;
+	  emit++;
+	}
+      fflush(stdout);
+
+      if (ieof && emit == seq)
+	break;
+
+      /* Repartir primero las peticiones de copias que terminaron y
+	 luego otras nuevas, mientras quepan en la ventana. */
+      while (rn || (!ieof && seq < emit + nring))
+	{
+	  best = -1;
+	  for (k = 0; k < c->n; k++)
+	    {
+	      i = (c->rr + k) % c->n;
+	      if (c->v[i].fd != -1 && c->v[i].qn < COPROC_DEPTH
+		  && (best == -1 || c->v[i].qn < c->v[best].qn))
+		best = i;
+	    }
+	  if (best == -1)
+	    break;
+
+	  if (rn)
+	    {
+	      j = retry[rh];
+	      rh = (rh + 1) % nring;
+	      rn--;
+	    }
+	  else
+	    {
+	      if ((len = getline(&line, &cap, in)) <= 0)
+		{
+		  ieof = SET;
+		  break;
+		}
+	      if (line[len-1] != '\n')
+		{
+		  if (len + 1 >= cap)
+		    line = realloc(line, cap = len + 2);
+		  line[len++] = '\n';
+		  line[len] = '\0';
+		}
+	      j = seq++;
+	      req[j % nring] = strdup(line);
+	    }
+
+	  ci = &c->v[best];
+	  c->rr = (best + 1) % c->n;
+	  coproc_queue(ci, req[j % nring]);
+	  ci->q[(ci->qh + ci->qn++) % COPROC_DEPTH] = j;
+	}
+
+      for (k = npend = 0; k < c->n; k++)
+	{
+	  ci = &c->v[k];
+	  pfd[k].fd = ci->qn || ci->woff < ci->wlen ? ci->fd : -1;
+	  pfd[k].events = (ci->qn ? POLLIN : 0)
+	    | (ci->woff < ci->wlen ? POLLOUT : 0);
+	  npend += pfd[k].fd != -1;
+	}
+
+      if (npend == 0)
+	{
+	  /* Ninguna copia viva: lo que falte no tendrá respuesta. */
+	  for (; rn; rn--, rh = (rh + 1) % nring, lost++)
+	    resp[retry[rh] % nring] = strdup("");
+	  if (emit < seq || ieof)
+	    continue;
+	  printf("coreq: no queda ninguna copia de %s\n", c->name);
+	  ret = 1;
+	  break;
+	}
+
+      if (poll(pfd, c->n, watchdog_poll(&wd)) == -1)
+	{
+	  if (errno != EINTR)
+	    continue;
+	  printf("\ncoreq: interrumpido\n");
+	  ret = 130;
+	  break;
+	}
+
+      for (k = 0; k < c->n; k++)
+	{
+	  ci = &c->v[k];
+	  dead = CLEAR;
+	  if (pfd[k].revents & POLLOUT)
+	    {
+	      len = send(ci->fd, ci->wbuf + ci->woff, ci->wlen - ci->woff,
+			 MSG_NOSIGNAL);
+	      if (len > 0)
+		ci->woff += len;
+	      else if (errno != EAGAIN && errno != EINTR)
+		dead = SET;
+	    }
+	  if (!dead && (pfd[k].revents & ~POLLOUT)
+	      && coproc_reply(ci, resp, nring))
+	    dead = SET;
+	  if (!dead)
+	    continue;
+
+	  /* Lo que tenía pendiente se reparte entre las demás. */
+	  close(ci->fd);
+	  ci->fd = -1;
+	  ci->wlen = ci->woff = ci->rlen = 0;
+	  for (moved = 0; ci->qn;
+	       ci->qn--, ci->qh = (ci->qh + 1) % COPROC_DEPTH, moved++)
+	    retry[(rh + rn++) % nring] = ci->q[ci->qh];
+	  printf("coreq: %s (pid=%d) ha cerrado la conexión", c->name,
+		 ci->pid);
+	  if (moved)
+	    printf(": %d peticiones pasan a otras copias", moved);
+	  printf("\n");
+	  ret = 1;
+	}
+    }
+  in_wait = CLEAR;
+  sigprocmask(SIG_UNBLOCK, &block_sigchld, NULL);
+
+  if (lost)
+    printf("coreq: %d peticiones se quedaron sin respuesta\n", lost);
+
+  /* Las respuestas que lleguen tarde no son de nadie. Lo que quede
+     por enviar se enviará en el próximo coreq. */
+  for (k = 0; k < c->n; k++)
+    {
+      c->v[k].skip += c->v[k].qn;
+      c->v[k].qn = 0;
+    }
+  for (i = 0; i < nring; i++)
+    {
+      free(resp[i]);
+      free(req[i]);
+    }
+  free(resp);
+  free(req);
+  free(retry);
+  free(pfd);
+  free(line);
+
+  return ret;
+}
+
+/*-
+  *      Routine:      cmd_coreq
+  *
+  *      Purpose:
+  *              Envía peticiones a un coproceso: la línea formada
+  *              por los argumentos, o (con -i) cada línea de un
+  *              fichero. Ver coproc_run.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              El status que queda en last_status.
+  *
+  */
+int cmd_coreq(int argc, char *argv[])
+{
+  struct coproc *c;
+  FILE *in;
+  char *line = NULL;
+  size_t len = 0;
+  int i, ret;
+
+  if (argc == 4 && strcmp(argv[1], "-i") == 0)
+    {
+      if (!(c = coproc_find(argv[3])))
+	goto nosuch;
+      if (!(in = fopen(argv[2], "r")))
+	{
+	  perror(argv[2]);
+	  return last_status = W_EXITCODE(1, 0);
+	}
+    }
+  else if (argc >= 3 && argv[1][0] != '-')
+    {
+      if (!(c = coproc_find(argv[1])))
+	goto nosuch;
+      /* Sin límite de longitud: coproc_run lee con getline. */
+      in = open_memstream(&line, &len);
+      for (i = 2; i < argc; i++)
+	fprintf(in, "%s%s", i > 2 ? " " : "", argv[i]);
+      fputc('\n', in);
+      fclose(in);
+      if (!(in = fmemopen(line, len, "r")))
+	{
+	  perror("coreq");
+	  free(line);
+	  return last_status = W_EXITCODE(1, 0);
+	}
+    }
+  else
+    {
+      printf(" Sintaxis: coreq nombre petición\n");
+      printf("           coreq -i fichero nombre\n");
+      return last_status = W_EXITCODE(2, 0);
+    }
+
+  ret = coproc_run(c, in);
+  fclose(in);
+  free(line);
+
+  return last_status = W_EXITCODE(ret, 0);
+
+ nosuch:
+  printf("coreq: %s: no existe ese coproceso\n", argc == 4 ? argv[3] : argv[1]);
+  return last_status = W_EXITCODE(1, 0);
+}
+
+/*-
+  *      Routine:      ctl_open
+  *
+  *      Purpose:
+  *              Crea el socket de control en 'path' (ver el
+  *              protocolo junto a la definición de 'ctl'). Se
+  *              atiende desde read_key, es decir, mientras el shell
+  *              espera órdenes en el terminal: durante un trabajo en
+  *              primer plano las peticiones esperan.
+  *      Conditions:
+  *              La entrada estándar debe ser un terminal (si no,
+  *              read_key no se usa y nadie atendería el socket).
+  *      Returns:
+  *              0 si se creó, -1 e.o.c.
+  *
+  */
+int ctl_open(char *path)
+{
+  struct sockaddr_un sa;
+  struct stat st;
+  mode_t mask;
+
+  if (strlen(path) >= sizeof(sa.sun_path))
+    {
+      fprintf(stderr, "%s: ruta demasiado larga\n", path);
+      return -1;
+    }
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  strcpy(sa.sun_path, path);
+
+  /* Sólo se quita un socket que haya quedado de otra sesión. */
+  if (lstat(path, &st) == 0)
+    {
+      if (!S_ISSOCK(st.st_mode))
+	{
+	  fprintf(stderr, "%s: existe y no es un socket\n", path);
+	  return -1;
+	}
+      unlink(path);
+    }
+
+  /* Quien puede conectarse puede lanzar órdenes: el socket se crea ya
+     con permisos 0600, sin un momento en que otros puedan abrirlo. */
+  ctl.fd = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+  mask = umask(0177);
+  if (ctl.fd == -1
+      || bind(ctl.fd, (struct sockaddr *) &sa, sizeof(sa))
+      || listen(ctl.fd, CTL_MAXCLI))
+    {
+      umask(mask);
+      perror(path);
+      if (ctl.fd != -1)
+	close(ctl.fd);
+      ctl.fd = -1;
+      return -1;
+    }
+  umask(mask);
+  ctl.path = strdup(path);
+
+  return 0;
+}
+
+/*-
+  *      Routine:      ctl_close
+  *
+  *      Purpose:
+  *              Cierra el socket de control y sus clientes.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              none
+  *
+  */
+void ctl_close()
+{
+  int i;
+
+  if (ctl.fd == -1)
+    return;
+
+  for (i = 0; i < ctl.ncli; i++)
+    {
+      close(ctl.cli[i].fd);
+      free(ctl.cli[i].in);
+      free(ctl.cli[i].out);
+    }
+  ctl.ncli = 0;
+  close(ctl.fd);
+  ctl.fd = -1;
+  unlink(ctl.path);
+}
+
+/*-
+  *      Routine:      ctl_pollfds
+  *
+  *      Purpose:
+  *              Prepara las entradas de poll() del socket de
+  *              control: la escucha (si caben más clientes) y cada
+  *              cliente, que se vigila también para escritura si
+  *              tiene respuestas pendientes.
+  *      Conditions:
+  *              'fds' debe tener sitio para 1 + CTL_MAXCLI.
+  *      Returns:
+  *              El número de entradas preparadas.
+  *
+  */
+int ctl_pollfds(struct pollfd *fds)
+{
+  int i;
+
+  if (ctl.fd == -1)
+    return 0;
+
+  fds[0].fd = ctl.ncli < CTL_MAXCLI ? ctl.fd : -1;
+  fds[0].events = POLLIN;
+  for (i = 0; i < ctl.ncli; i++)
+    {
+      fds[1+i].fd = ctl.cli[i].fd;
+      fds[1+i].events = POLLIN
+	| (ctl.cli[i].ooff < ctl.cli[i].olen ? POLLOUT : 0);
+      fds[1+i].revents = 0;
+    }
+
+  return 1 + ctl.ncli;
+}
+
+/*-
+  *      Routine:      ctl_reply
+  *
+  *      Purpose:
+  *              Añade una trama a las respuestas de un cliente.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              none
+  *
+  */
+static void ctl_reply(struct ctl_client *cl, char type, void *data,
+		      uint32_t len)
+{
+  if (cl->olen + 5 + len > cl->ocap)
+    {
+      memmove(cl->out, cl->out + cl->ooff, cl->olen - cl->ooff);
+      cl->olen -= cl->ooff;
+      cl->ooff = 0;
+      if (cl->olen + 5 + len > cl->ocap)
+	{
+	  cl->ocap = 2 * (cl->olen + 5 + len);
+	  cl->out = realloc(cl->out, cl->ocap);
+	}
+    }
+
+  memcpy(cl->out + cl->olen, &len, 4);
+  cl->out[cl->olen + 4] = type;
+  memcpy(cl->out + cl->olen + 5, data, len);
+  cl->olen += 5 + len;
+}
+
+/*-
+  *      Routine:      ctl_error
+  *
+  *      Purpose:
+  *              Responde con una trama 'E'.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              none
+  *
+  */
+static void ctl_error(struct ctl_client *cl, char *msg)
+{
+  ctl_reply(cl, 'E', msg, strlen(msg));
+}
+
+/*-
+  *      Routine:      ctl_submit
+  *
+  *      Purpose:
+  *              Lanza en segundo plano la línea de órdenes recibida,
+  *              por el mismo camino que ejecuta_comando, sin
+  *              informar por el terminal.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              none
+  *
+  */
+static void ctl_submit(struct ctl_client *cl, char *data, uint32_t len)
+{
+  char linea[MAXLINEA], *argumentos[MAXARG];
+  struct termios mode = shell_tmode;
+  int i, narg, null, pid;
+  uint32_t r[2];
+  char *err = NULL;
+  node_t *p;
+
+  if (len >= MAXLINEA)
+    {
+      ctl_error(cl, "línea demasiado larga");
+      return;
+    }
+  memcpy(linea, data, len);
+  linea[len] = '\0';
+
+  narg = lee_linea(linea, argumentos);
+  if (narg && strcmp(argumentos[narg-1], "&") == 0)
+    free(argumentos[--narg]);
+  argumentos[narg] = NULL;
+
+  for (i = 0; i < narg && strcmp(argumentos[i], ";"); i++)
+    ;
+
+  if (narg == 0)
+    err = "línea vacía";
+  else if (i < narg)
+    err = "una sola orden por trama";
+  else if (is_builtin(argumentos[0]))
+    err = "no se admiten comandos internos";
+  else if ((null = open("/dev/null", O_RDWR|O_CLOEXEC)) == -1)
+    err = strerror(errno);
+
+  if (err)
+    {
+      ctl_error(cl, err);
+      libera_mem_arg(argumentos, narg);
+      glob_flush();
+      return;
+    }
+
+  /* El terminal está en modo raw mientras se edita la línea:
+     launch_proc no debe tomarlo por el modo del shell. */
+  launch_quiet = SET;
+  pid = launch_proc(argumentos, 1, null, null, NULL);
+  launch_quiet = CLEAR;
+  shell_tmode = mode;
+  close(null);
+
+  sigprocmask(SIG_BLOCK, &block_sigchld, NULL);
+  r[0] = pid;
+  r[1] = 0;
+  if ((p = list_find_pid(&proc_list, pid)))
+    {
+      p->term_mode = mode;
+      /* Recién lanzado, normalmente es el último. */
+      r[1] = p == proc_list.end ? list_length(&proc_list)
+	: list_index(&proc_list, p);
+    }
+  sigprocmask(SIG_UNBLOCK, &block_sigchld, NULL);
+
+  ctl_reply(cl, 'S', r, sizeof(r));
+  libera_mem_arg(argumentos, narg);
+  glob_flush();
+}
+
+/*-
+  *      Routine:      ctl_status
+  *
+  *      Purpose:
+  *              Responde a una petición 'Q'.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              none
+  *
+  */
+static void ctl_status(struct ctl_client *cl, char *data, uint32_t len)
+{
+  char *out, *o;
+  int32_t pid;
+  uint32_t i, n, num;
+  node_t *p;
+
+  if (len % 4)
+    {
+      ctl_error(cl, "trama Q mal formada");
+      return;
+    }
+
+  sigprocmask(SIG_BLOCK, &block_sigchld, NULL);
+
+  n = len ? len / 4 : list_length(&proc_list);
+  o = out = malloc(n * 9 + 1);
+
+  for (i = 0, p = proc_list.beg; i < n; i++)
     {
-      if (chdir(argv[1]))
+      if (len)
 	{
-	  perror("cd");
-	  return 2;
+	  memcpy(&pid, data + 4*i, 4);
+	  p = list_find_pid(&proc_list, pid);
+	  num = p ? list_index(&proc_list, p) : 0;
+	}
+      else
+	{
+	  pid = p->pid;
+	  num = i + 1;
 	}
 
-      pwd = (char *) get_current_dir_name();
-
-      setenv("PWD", pwd, 1);
-      printf(" Directorio actual = %s\n", pwd);
+      memcpy(o, &pid, 4);
+      memcpy(o + 4, &num, 4);
+      o[8] = !p ? 'X' : p->stopped ? 'T' : 'R';
+      o += 9;
 
+      if (!len)
+	p = p->next;
     }
 
-  free(pwd);
+  sigprocmask(SIG_UNBLOCK, &block_sigchld, NULL);
+
+  ctl_reply(cl, 'Q', out, o - out);
+  free(out);
 }
 
 /*-
-  *      Routine:      cmd_fg
+  *      Routine:      ctl_signal
   *
   *      Purpose:
-  *              Pone en primer plano un proceso que se encuentra
-  *              parado o en segundo plano.
+  *              Responde a una petición 'K' (ver job_signal).
   *      Conditions:
   *              none
   *      Returns:
   *              none
   *
   */
-void cmd_fg(int argc, char *argv[])
+static void ctl_signal(struct ctl_client *cl, char *data, uint32_t len)
 {
-  int n;
+  int32_t sig, pid;
+  uint32_t i, n = 0;
   node_t *p;
 
-  if (argc != 2 || !is_nat(argv[1]))
+  if (len < 4 || len % 4)
     {
-      printf(" Sintaxis: fg numero_de_trabajo\n");
+      ctl_error(cl, "trama K mal formada");
       return;
     }
+  memcpy(&sig, data, 4);
 
   sigprocmask(SIG_BLOCK, &block_sigchld, NULL);
-  p = list_elem(&proc_list, atoi(argv[1]) );
-  if (!p)
+  for (i = 4; i < len; i += 4)
     {
-      printf("ERROR: número de trabajo no válido\n");
-
-      sigprocmask(SIG_UNBLOCK, &block_sigchld, NULL);
-      return;
+      memcpy(&pid, data + i, 4);
+      if ((p = list_find_pid(&proc_list, pid)) && job_signal(p, sig) == 0)
+	{
+	  n++;
+	  if (sig == SIGCONT)
+	    {
+	      p->stopped = CLEAR;
+	      if (jobshm)
+		jobshm_state(p, NULL);
+	    }
+	}
     }
+  sigprocmask(SIG_UNBLOCK, &block_sigchld, NULL);
 
-  /* Salvar el modo actual del terminal. */
-  tcgetattr(shell_term, &shell_tmode);
+  ctl_reply(cl, 'K', &n, 4);
+}
 
-  /* Restaurar el modo del terminal tal como lo dejó el hijo. */
-  tcsetattr(shell_term, TCSANOW, &p->term_mode);
-  /* Dar el terminal al hijo. */
-  tcsetpgrp(shell_term, p->pid);
+/*-
+  *      Routine:      ctl_events
+  *
+  *      Purpose:
+  *              Atiende el socket de control tras un poll(): acepta
+  *              clientes, procesa en orden todas las tramas
+  *              completas recibidas y envía las respuestas.
+  *      Conditions:
+  *              'fds' debe ser lo preparado por ctl_pollfds, con
+  *              los resultados de poll().
+  *      Returns:
+  *              none
+  *
+  */
+void ctl_events(struct pollfd *fds)
+{
+  struct ctl_client *cl;
+  uint32_t len;
+  size_t off;
+  ssize_t r;
+  int i, fd, ncli = ctl.ncli, drop;
 
-  p->fg = SET;
-  p->stopped = CLEAR;
+  if (ctl.fd == -1)
+    return;
 
-  printf("Pasando... [%d] %s (pid=%d) ... a primer plano\n",
-	 list_index(&proc_list, p), p->name, p->pid);
+  for (i = 0; i < ncli; i++)
+    {
+      cl = &ctl.cli[i];
+      drop = CLEAR;
 
-  kill(p->pid, SIGCONT);
+      if (fds[1+i].revents & (POLLIN|POLLHUP|POLLERR))
+	{
+	  if (cl->icap - cl->ilen < 65536)
+	    {
+	      cl->icap = cl->icap ? 2 * cl->icap : 65536;
+	      cl->in = realloc(cl->in, cl->icap);
+	    }
+	  r = read(cl->fd, cl->in + cl->ilen, cl->icap - cl->ilen);
+	  if (r == 0 || (r == -1 && errno != EAGAIN && errno != EINTR))
+	    drop = SET;
+	  else if (r > 0)
+	    cl->ilen += r;
 
-  waitpid(p->pid, &p->status, WUNTRACED);
+	  for (off = 0; !drop && cl->ilen - off >= 5; off += 5 + len)
+	    {
+	      memcpy(&len, cl->in + off, 4);
+	      if (len > CTL_MAXFRAME)
+		{
+		  /* Sin avanzar 'off': la trama no está en el búfer. */
+		  drop = SET;
+		  break;
+		}
+	      if (cl->ilen - off < 5 + len)
+		break;
+	      else if (cl->in[off + 4] == 'S')
+		ctl_submit(cl, cl->in + off + 5, len);
+	      else if (cl->in[off + 4] == 'Q')
+		ctl_status(cl, cl->in + off + 5, len);
+	      else if (cl->in[off + 4] == 'K')
+		ctl_signal(cl, cl->in + off + 5, len);
+	      else
+		ctl_error(cl, "tipo de trama desconocido");
+	    }
+	  cl->ilen -= off;
+	  memmove(cl->in, cl->in + off, cl->ilen);
+	}
 
-  /* Salvar el modo del terminal empleado por el hijo. */
-  tcgetattr(shell_term, &p->term_mode);
+      /* Todas las respuestas de un lote salen juntas. */
+      if (!drop && cl->ooff < cl->olen)
+	{
+	  r = send(cl->fd, cl->out + cl->ooff, cl->olen - cl->ooff,
+		   MSG_NOSIGNAL|MSG_DONTWAIT);
+	  if (r > 0)
+	    cl->ooff += r;
+	  else if (r == -1 && errno != EAGAIN && errno != EINTR)
+	    drop = SET;
+	  if (cl->ooff == cl->olen)
+	    cl->ooff = cl->olen = 0;
+	}
 
-  /* Recuperar el terminal. */
-  if (tcsetpgrp(shell_term, shell_pid) == -1)
+      if (drop)
+	{
+	  close(cl->fd);
+	  free(cl->in);
+	  free(cl->out);
+	  cl->fd = -1;
+	}
+    }
+
+  /* Compactar la tabla de clientes. */
+  for (i = fd = 0; i < ncli; i++)
+    if (ctl.cli[i].fd != -1)
+      ctl.cli[fd++] = ctl.cli[i];
+  ctl.ncli = fd;
+
+  if (fds[0].revents & POLLIN)
+    while (ctl.ncli < CTL_MAXCLI
+	   && (fd = accept4(ctl.fd, NULL, NULL,
+			    SOCK_NONBLOCK|SOCK_CLOEXEC)) != -1)
+      {
+	memset(&ctl.cli[ctl.ncli], 0, sizeof(ctl.cli[0]));
+	ctl.cli[ctl.ncli++].fd = fd;
+      }
+}
+
+/*-
+  *      Routine:      jobshm_stale
+  *
+  *      Purpose:
+  *              Mira si el segmento 'path', que ya existe, lo dejó un
+  *              shell que terminó sin borrarlo: su 'shell_pid' ya no
+  *              existe o es el nuestro (el pid se ha reutilizado).
+  *              Uno sin cabecera completa también se da por perdido.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              SET si se puede borrar, CLEAR e.o.c.
+  *
+  */
+static int jobshm_stale(char *path)
+{
+  struct stat st;
+  struct jobshm *old;
+  int fd, stale = SET;
+  pid_t pid;
+
+  if ((fd = shm_open(path, O_RDONLY|O_CLOEXEC, 0)) == -1)
+    return CLEAR;
+  if (fstat(fd, &st) == 0
+      && st.st_size >= (off_t) offsetof(struct jobshm, done))
     {
-      perror("tcsetpgrp");
-      exit(1);
+      old = mmap(NULL, offsetof(struct jobshm, done), PROT_READ, MAP_SHARED,
+		 fd, 0);
+      if (old == MAP_FAILED)
+	stale = CLEAR;
+      else
+	{
+	  pid = old->shell_pid;
+	  if (memcmp(old->magic, JOBSHM_MAGIC, 8) == 0 && pid != getpid()
+	      && (kill(pid, 0) == 0 || errno != ESRCH))
+	    stale = CLEAR;
+	  munmap(old, offsetof(struct jobshm, done));
+	}
     }
+  close(fd);
 
-  /* Restaurar el modo del terminal para el shell. */
-  tcsetattr(shell_term, TCSANOW, &shell_tmode);
+  return stale;
+}
 
-  proc_info(p, p->status);
-  proc_update(p, p->status);
+/*-
+  *      Routine:      jobshm_open
+  *
+  *      Purpose:
+  *              Crea el segmento de memoria compartida en el que se
+  *              publica la tabla de trabajos (ver jobshm.h).
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              0 si se creó, -1 e.o.c.
+  *
+  */
+int jobshm_open()
+{
+  int fd;
 
-  sigprocmask(SIG_UNBLOCK, &block_sigchld, NULL);
+  snprintf(jobshm_path, sizeof(jobshm_path), JOBSHM_PREFIX "%d",
+	   (int) getpid());
+
+  /* Las páginas de job[] que no se usan no llegan a ocupar memoria.
+     Sólo el propio usuario puede leer la tabla: las líneas de órdenes
+     pueden llevar datos privados. */
+  fd = shm_open(jobshm_path, O_RDWR|O_CREAT|O_EXCL|O_CLOEXEC, 0600);
+  if (fd == -1 && errno == EEXIST && jobshm_stale(jobshm_path))
+    {
+      shm_unlink(jobshm_path);
+      fd = shm_open(jobshm_path, O_RDWR|O_CREAT|O_EXCL|O_CLOEXEC, 0600);
+    }
+  if (fd == -1 || ftruncate(fd, sizeof(struct jobshm)))
+    {
+      perror(jobshm_path);
+      if (fd != -1)
+	shm_unlink(jobshm_path);
+      return -1;
+    }
+  jobshm = mmap(NULL, sizeof(struct jobshm), PROT_READ|PROT_WRITE,
+		MAP_SHARED, fd, 0);
+  close(fd);
+  if (jobshm == MAP_FAILED)
+    {
+      perror("mmap");
+      shm_unlink(jobshm_path);
+      jobshm = NULL;
+      return -1;
+    }
 
+  jobshm_node = calloc(JOBSHM_SLOTS, sizeof(*jobshm_node));
+  jobshm->cap = JOBSHM_SLOTS;
+  jobshm->shell_pid = getpid();
+  memcpy(jobshm->magic, JOBSHM_MAGIC, 8);
+
+  return 0;
 }
 
 /*-
-  *      Routine:      cmd_bg
+  *      Routine:      jobshm_close
   *
   *      Purpose:
-  *              Pone en ejecución en segundo plano un proceso
-  *              que se encuentra parado.
+  *              Retira el segmento de la tabla de trabajos. Los
+  *              lectores que lo tengan proyectado conservan la
+  *              última vista.
   *      Conditions:
   *              none
   *      Returns:
   *              none
   *
   */
-void cmd_bg(int argc, char *argv[])
+void jobshm_close()
 {
-  int n;
-  node_t *p;
+  if (!jobshm)
+    return;
 
-  if (argc != 2 || !is_nat(argv[1]))
-    {
-      printf(" Sintaxis: bg numero_de_trabajo\n");
-      return;
-    }
+  shm_unlink(jobshm_path);
+  munmap(jobshm, sizeof(struct jobshm));
+  jobshm = NULL;
+  free(jobshm_node);
+}
 
-  sigprocmask(SIG_BLOCK, &block_sigchld, NULL);
-  p = list_elem(&proc_list, atoi(argv[1]) );
-  if (!p)
-    {
-      printf("ERROR: número de trabajo no válido\n");
+/*-
+  *      Routine:      jobshm_begin
+  *
+  *      Purpose:
+  *              Abre una escritura del seqlock de la tabla.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              none
+  *
+  */
+static void jobshm_begin()
+{
+  __atomic_store_n(&jobshm->seq, jobshm->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
 
-      sigprocmask(SIG_UNBLOCK, &block_sigchld, NULL);
-      return;
-    }
+/*-
+  *      Routine:      jobshm_end
+  *
+  *      Purpose:
+  *              Cierra la escritura abierta con jobshm_begin.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              none
+  *
+  */
+static void jobshm_end()
+{
+  __atomic_store_n(&jobshm->seq, jobshm->seq + 1, __ATOMIC_RELEASE);
+}
+
+/*-
+  *      Routine:      jobshm_ru
+  *
+  *      Purpose:
+  *              Copia el uso de recursos de wait4 en un trabajo
+  *              publicado.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              none
+  *
+  */
+static void jobshm_ru(struct jobshm_job *j, struct rusage *ru)
+{
+  j->utime = ru->ru_utime.tv_sec * 1000000000LL + ru->ru_utime.tv_usec * 1000LL;
+  j->stime = ru->ru_stime.tv_sec * 1000000000LL + ru->ru_stime.tv_usec * 1000LL;
+  j->maxrss = ru->ru_maxrss;
+  j->minflt = ru->ru_minflt;
+  j->majflt = ru->ru_majflt;
+  j->nvcsw = ru->ru_nvcsw;
+  j->nivcsw = ru->ru_nivcsw;
+}
+
+/*-
+  *      Routine:      jobshm_add
+  *
+  *      Purpose:
+  *              Publica un trabajo recién lanzado al final de la
+  *              tabla.
+  *      Conditions:
+  *              SIGCHLD debe estar bloqueada.
+  *      Returns:
+  *              none
+  *
+  */
+void jobshm_add(node_t *p)
+{
+  struct jobshm_job *j;
+  struct timespec ts;
 
-  if (!p->stopped)
+  jobshm_begin();
+  jobshm->launched++;
+  if (jobshm->n == JOBSHM_SLOTS)
     {
-      printf("ERROR: El trabajo ya se encuentra en segundo plano\n");
-      sigprocmask(SIG_UNBLOCK, &block_sigchld, NULL);
+      jobshm->overflow++;
+      jobshm_end();
       return;
     }
 
-  p->fg = CLEAR;
-  p->stopped = CLEAR;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  p->shm_slot = jobshm->n;
+  jobshm_node[p->shm_slot] = p;
+  j = &jobshm->job[p->shm_slot];
+  memset(j, 0, sizeof(*j));
+  j->seq = jobshm->launched;
+  j->pid = p->pid;
+  j->pgid = p->pid;
+  strncpy(j->name, p->name, JOBSHM_NAME - 1);
+  j->state = p->stopped ? 'T' : 'R';
+  j->start = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+  jobshm->n++;
+  jobshm_end();
+}
 
-  printf("Pasando... [%d] %s (pid=%d) ... a segundo plano\n",
-	 list_index(&proc_list, p), p->name, p->pid);
+/*-
+  *      Routine:      jobshm_state
+  *
+  *      Purpose:
+  *              Actualiza el estado y el nombre publicados de un
+  *              trabajo y, si se indica 'ru', su uso de recursos.
+  *      Conditions:
+  *              SIGCHLD debe estar bloqueada.
+  *      Returns:
+  *              none
+  *
+  */
+void jobshm_state(node_t *p, struct rusage *ru)
+{
+  struct jobshm_job *j;
+
+  if (p->shm_slot == -1)
+    return;
+
+  j = &jobshm->job[p->shm_slot];
+  jobshm_begin();
+  j->state = p->stopped ? 'T' : 'R';
+  strncpy(j->name, p->name, JOBSHM_NAME - 1);
+  if (ru)
+    jobshm_ru(j, ru);
+  jobshm_end();
+}
+
+/*-
+  *      Routine:      jobshm_del
+  *
+  *      Purpose:
+  *              Retira un trabajo de la tabla, moviendo el último a
+  *              su hueco. Si terminó ('status' no es NULL) lo pasa
+  *              además a la lista de terminados con su uso de
+  *              recursos final.
+  *      Conditions:
+  *              SIGCHLD debe estar bloqueada.
+  *      Returns:
+  *              none
+  *
+  */
+void jobshm_del(node_t *p, int *status, struct rusage *ru)
+{
+  struct jobshm_job *j, *d;
+  struct timespec ts;
+  uint32_t last;
 
-  kill(p->pid, SIGCONT);
+  jobshm_begin();
 
-  sigprocmask(SIG_UNBLOCK, &block_sigchld, NULL);
+  if (p->shm_slot == -1)
+    jobshm->overflow--;
+  else
+    {
+      j = &jobshm->job[p->shm_slot];
+      if (status)
+	{
+	  clock_gettime(CLOCK_REALTIME, &ts);
+	  d = &jobshm->done[jobshm->ndone++ % JOBSHM_DONE];
+	  *d = *j;
+	  d->state = 'X';
+	  d->status = *status;
+	  d->end = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+	  jobshm_ru(d, ru);
+	}
+
+      last = --jobshm->n;
+      if (p->shm_slot != last)
+	{
+	  *j = jobshm->job[last];
+	  jobshm_node[p->shm_slot] = jobshm_node[last];
+	  jobshm_node[p->shm_slot]->shm_slot = p->shm_slot;
+	}
+      p->shm_slot = -1;
+    }
+
+  jobshm_end();
 }
 
 
@@ -791,7 +6819,7 @@ void cmd_bg(int argc, char *argv[])
   */
 void list_init(list_t *lst)
 {
-  lst->beg = lst->end = NULL;
+  memset(lst, 0, sizeof(*lst));
 }
 
 /*-
@@ -807,7 +6835,10 @@ void list_init(list_t *lst)
   */
 void list_insert(list_t * lst, node_t * nod)
 {
+  node_t **h = &lst->hash[(unsigned) nod->pid % LIST_HASH];
+
   nod->next = NULL;
+  nod->prev = lst->end;
 
   if (lst->end)
     {
@@ -819,6 +6850,10 @@ void list_insert(list_t * lst, node_t * nod)
       lst->beg = nod;
       lst->end = nod;
     }
+
+  nod->hnext = *h;
+  *h = nod;
+  lst->n++;
 }
 
 /*-
@@ -835,25 +6870,37 @@ void list_insert(list_t * lst, node_t * nod)
   */
 int list_remove(list_t * lst, node_t * nod)
 {
-  node_t *ant = NULL, *aux = lst->beg;
+  node_t **h = &lst->hash[(unsigned) nod->pid % LIST_HASH];
 
-  while (aux != NULL && aux != nod)
-    {
-      ant = aux;
-      aux = aux->next;
-    }
+  while (*h != NULL && *h != nod)
+    h = &(*h)->hnext;
 
-  if (aux == NULL)
+  if (*h == NULL)
     return 1;
 
-  if (ant)
-    ant->next = aux->next;
+  *h = nod->hnext;
+  lst->n--;
+
+  if (nod->prev)
+    nod->prev->next = nod->next;
   else
-    lst->beg = aux->next;
+    lst->beg = nod->next;
 
-  if (lst->end == aux)
-    lst->end = ant;
+  if (nod->next)
+    nod->next->prev = nod->prev;
+  else
+    lst->end = nod->prev;
 
+  if (nod->pidfd != -1)
+    {
+      /* Algún hijo sin exec puede conservar una copia del pidfd:
+	 quitarlo del epoll explícitamente (ver reap_ep). */
+      if (reap_ep != -1)
+	epoll_ctl(reap_ep, EPOLL_CTL_DEL, nod->pidfd, NULL);
+      close(nod->pidfd);
+    }
+  if (nod->rss_max)
+    watchdog_jobs--;
   free(nod->name);
   free(nod);
 
@@ -874,29 +6921,35 @@ int list_remove(list_t * lst, node_t * nod)
   */
 int list_remove_pid(list_t * lst, int pid)
 {
-  node_t *ant = NULL, *aux = lst->beg;
-
-  while (aux != NULL && aux->pid != pid)
-    {
-      ant = aux;
-      aux = aux->next;
-    }
+  node_t *aux = list_find_pid(lst, pid);
 
   if (aux == NULL)
     return 1;
 
-  if (ant)
-    ant->next = aux->next;
-  else
-    lst->beg = aux->next;
+  return list_remove(lst, aux);
+}
 
-  if (lst->end == aux)
-    lst->end = ant;
+/*-
+  *      Routine:      list_find_pid
+  *
+  *      Purpose:
+  *              Busca el nodo cuyo pid sea el indicado, sin
+  *              recorrer la lista.
+  *      Conditions:
+  *              La lista debe estar inicializada
+  *      Returns:
+  *              Un apuntador al nodo.
+  *              NULL si no se encontró.
+  *
+  */
+node_t * list_find_pid(list_t * lst, int pid)
+{
+  node_t *aux = lst->hash[(unsigned) pid % LIST_HASH];
 
-  free(aux->name);
-  free(aux);
+  while (aux != NULL && aux->pid != pid)
+    aux = aux->hnext;
 
-  return 0;
+  return aux;
 }
 
 /*-
@@ -913,19 +6966,24 @@ int list_remove_pid(list_t * lst, int pid)
   */
 int list_index(list_t *lst, node_t *p)
 {
-  int i=1;
-  node_t *aux=lst->beg;
+  int i=1, j=lst->n;
+  node_t *a=lst->beg, *b=lst->end;
 
-  while (aux && aux!=p)
+  /* Desde los dos extremos a la vez: los trabajos más recientes,
+     que son los que se suelen nombrar, están al final. */
+  while (a && i<=j)
     {
+      if (a==p)
+	return i;
+      if (b==p)
+	return j;
+      a = a->next;
+      b = b->prev;
       i++;
-      aux = aux->next;
+      j--;
     }
 
-  if (aux==NULL)
-    return 1;
-
-  return i;
+  return 1;
 }
 
 /*-
@@ -941,16 +6999,7 @@ int list_index(list_t *lst, node_t *p)
   */
 int list_length(list_t *lst)
 {
-  int i=0;
-  node_t *aux=lst->beg;
-
-  while (aux!=NULL)
-    {
-      i++;
-      aux=aux->next;
-    }
-
-  return i;
+  return lst->n;
 }
 
 /*-
@@ -968,12 +7017,21 @@ int list_length(list_t *lst)
   */
 node_t * list_elem(list_t *lst, int pos)
 {
-  node_t *aux=lst->beg;
+  node_t *aux;
+  int i;
 
-  if (pos==0)
+  if (pos<1 || pos>lst->n)
     return NULL;
 
-  while (aux && --pos)
+  /* Se recorre desde el extremo más cercano. */
+  if (pos > lst->n/2)
+    {
+      for (aux=lst->end, i=lst->n; i>pos; i--)
+	aux = aux->prev;
+      return aux;
+    }
+
+  for (aux=lst->beg; --pos; )
     aux = aux->next;
 
   return aux;
@@ -1009,3 +7067,27 @@ int is_nat(char *c)
 
   return 1;
 }
+
+/*-
+  *      Routine:      is_builtin
+  *
+  *      Purpose:
+  *              Decide si una cadena de caracteres es el nombre
+  *              de un comando interno del shell.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              1 <-> Sí
+  *              0 <-> No
+  *
+  */
+int is_builtin(char *c)
+{
+  char **b;
+
+  for (b = builtins; *b; b++)
+    if (strcmp(c, *b) == 0)
+      return 1;
+
+  return 0;
+}
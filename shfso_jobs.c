@@ -0,0 +1,170 @@
+/* -*- mode: C -*-
+   *
+   *       File:         shfso_jobs.c
+   *
+   *       Muestra la tabla de trabajos de un shFSO lanzado con -m,
+   *       leyéndola de la memoria compartida sin molestar al shell.
+   *
+   *       Uso: shfso_jobs [-d] [-i ms [-n veces]] pid
+   *
+   *         -d  muestra también los últimos trabajos terminados
+   *         -i  repite cada 'ms' milisegundos (-n veces, o sin fin)
+   *
+   */
+
+/*
+  Copyright (C) 2009, 2013 Pedro J. Ruiz López <holzplatten@es.gnu.org>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "jobshm.h"
+
+/*-
+  *      Routine:      cmp_seq
+  *
+  *      Purpose:
+  *              Comparación para qsort: orden de lanzamiento.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              <0, 0 o >0.
+  *
+  */
+int cmp_seq(const void *a, const void *b)
+{
+  uint64_t x = ((struct jobshm_job *) a)->seq;
+  uint64_t y = ((struct jobshm_job *) b)->seq;
+
+  return x < y ? -1 : x > y;
+}
+
+/*-
+  *      Routine:      show_job
+  *
+  *      Purpose:
+  *              Muestra una línea de la tabla.
+  *      Conditions:
+  *              none
+  *      Returns:
+  *              none
+  *
+  */
+void show_job(struct jobshm_job *j, long num, int64_t now)
+{
+  char st[16];
+  int64_t t = (j->end ? j->end : now) - j->start;
+
+  if (j->state != 'X')
+    snprintf(st, sizeof(st), "%c", j->state);
+  else if (WIFSIGNALED(j->status))
+    snprintf(st, sizeof(st), "X sig %d", WTERMSIG(j->status));
+  else
+    snprintf(st, sizeof(st), "X %d", WEXITSTATUS(j->status));
+
+  if (num)
+    printf(" [%ld]", num);
+  else
+    printf("  -");
+  printf("\t%7d %7d  %-8s %9.3f s  %8.3f %8.3f %8ld KB  %-s\n",
+	 j->pid, j->pgid, st, j->start ? t / 1e9 : 0.0,
+	 j->utime / 1e9, j->stime / 1e9, (long) j->maxrss, j->name);
+}
+
+int main(int argc, char *argv[])
+{
+  char path[64];
+  struct jobshm *shm, *v;
+  struct timespec ts;
+  int fd, opt, done = 0, retries;
+  long interval = 0, count = -1, i;
+  uint64_t k;
+  int64_t now;
+
+  while ((opt = getopt(argc, argv, "di:n:")) != -1)
+    switch (opt)
+      {
+      case 'd': done = 1; break;
+      case 'i': interval = atol(optarg); break;
+      case 'n': count = atol(optarg); break;
+      default:
+	goto usage;
+      }
+  if (optind != argc - 1)
+    {
+    usage:
+      fprintf(stderr, "Uso: %s [-d] [-i ms [-n veces]] pid\n", argv[0]);
+      return 2;
+    }
+
+  snprintf(path, sizeof(path), JOBSHM_PREFIX "%s", argv[optind]);
+  if ((fd = shm_open(path, O_RDONLY, 0)) == -1)
+    {
+      perror(path);
+      return 1;
+    }
+  shm = mmap(NULL, sizeof(*shm), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  v = malloc(sizeof(*v));
+  if (shm == MAP_FAILED || !v || memcmp(shm->magic, JOBSHM_MAGIC, 8))
+    {
+      fprintf(stderr, "%s: no es una tabla de trabajos de shFSO\n", path);
+      return 1;
+    }
+
+  for (;;)
+    {
+      retries = jobshm_snapshot(shm, v, done);
+      clock_gettime(CLOCK_REALTIME, &ts);
+      now = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+
+      printf(" shFSO %d: %u trabajos", v->shell_pid, v->n);
+      if (v->overflow)
+	printf(" (y %u sin publicar)", v->overflow);
+      printf(", %llu lanzados, %llu terminados, %d reintentos\n",
+	     (unsigned long long) v->launched, (unsigned long long) v->ndone,
+	     retries);
+      printf(" trab.\t    pid    pgid  estado     tiempo      user      sys"
+	     "       rss  nombre\n");
+
+      /* El número de trabajo es la posición en orden de lanzamiento
+	 (salvo los que no cupieron en la tabla). */
+      qsort(v->job, v->n, sizeof(v->job[0]), cmp_seq);
+      for (i = 0; i < v->n; i++)
+	show_job(&v->job[i], i + 1, now);
+
+      if (done)
+	for (k = v->ndone > JOBSHM_DONE ? v->ndone - JOBSHM_DONE : 0;
+	     k < v->ndone; k++)
+	  show_job(&v->done[k % JOBSHM_DONE], 0, now);
+
+      if (interval <= 0 || (count > 0 && --count == 0))
+	break;
+      fflush(stdout);
+      usleep(interval * 1000);
+    }
+
+  return 0;
+}